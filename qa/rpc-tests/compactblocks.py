@@ -0,0 +1,89 @@
+#!/usr/bin/env python2
+# Copyright (c) 2016 The Bitcoin Core developers
+# Copyright (c) 2018-2019 The BaaS developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test compact block relay: new blocks reach a peer with compact blocks in
+# fewer bytes than full-block relay, and as fast or faster. Node 1 uses
+# compact blocks, node 2 runs with -compactblocks=0; both sync from node 0.
+#
+
+from test_framework import BitcoinTestFramework
+from util import *
+
+class CompactBlocksTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 3)
+
+    def setup_network(self):
+        self.nodes = []
+        self.is_network_split = False
+        self.nodes.append(start_node(0, self.options.tmpdir, ["-debug=cmpctblock"]))
+        self.nodes.append(start_node(1, self.options.tmpdir, ["-debug=cmpctblock"]))
+        self.nodes.append(start_node(2, self.options.tmpdir, ["-debug=cmpctblock", "-compactblocks=0"]))
+        connect_nodes(self.nodes[1], 0)
+        connect_nodes(self.nodes[2], 0)
+
+    def bytes_from_node0(self, node):
+        # Both nodes have a single peer, node 0
+        return sum(peer['bytesrecv'] for peer in node.getpeerinfo())
+
+    def relay_block(self):
+        """Mine a block on node 0, return (bytes, seconds) it took to reach nodes 1 and 2."""
+        before = [self.bytes_from_node0(self.nodes[i]) for i in (1, 2)]
+        start = time.time()
+        blockhash = self.nodes[0].generate(1)[0]
+        latency = [None, None]
+        while None in latency:
+            for i in (1, 2):
+                if latency[i-1] is None and self.nodes[i].getbestblockhash() == blockhash:
+                    latency[i-1] = time.time() - start
+            if time.time() - start > 60:
+                raise AssertionError("Block %s was not relayed"%blockhash)
+            time.sleep(0.01)
+        # Let the trailing messages of the block come in before counting
+        time.sleep(1)
+        after = [self.bytes_from_node0(self.nodes[i]) for i in (1, 2)]
+        return [after[i] - before[i] for i in (0, 1)], latency
+
+    def run_test(self):
+        print "Mine mature coins on node 0"
+        self.nodes[0].generate(110)
+        sync_blocks(self.nodes)
+
+        address = self.nodes[0].getnewaddress()
+        total_bytes = [0, 0]
+        total_latency = [0.0, 0.0]
+        rounds = 5
+        for r in range(rounds):
+            for i in range(20):
+                self.nodes[0].sendtoaddress(address, 1)
+            sync_mempools(self.nodes)
+            relayed, latency = self.relay_block()
+            block = self.nodes[0].getblock(self.nodes[0].getbestblockhash())
+            assert_equal(len(block['tx']), 21)
+            print "Block of %d transactions: compact %d bytes in %.3f s, full %d bytes in %.3f s"%(
+                len(block['tx']), relayed[0], latency[0], relayed[1], latency[1])
+            for i in (0, 1):
+                total_bytes[i] += relayed[i]
+                total_latency[i] += latency[i]
+
+        # The transactions are already known, only short IDs should go over the wire
+        print "Average: compact %d bytes in %.3f s, full %d bytes in %.3f s"%(
+            total_bytes[0] / rounds, total_latency[0] / rounds, total_bytes[1] / rounds, total_latency[1] / rounds)
+        assert_greater_than(total_bytes[1], total_bytes[0] * 3)
+
+        print "Transactions missing from the mempool are fetched with getblocktxn"
+        for i in range(10):
+            self.nodes[0].sendtoaddress(address, 1)
+        blockhash = self.nodes[0].generate(1)[0]
+        sync_blocks(self.nodes)
+        for node in self.nodes:
+            assert_equal(node.getbestblockhash(), blockhash)
+
+if __name__ == '__main__':
+    CompactBlocksTest().main()
@@ -0,0 +1,463 @@
+// Copyright (c) 2018-2019 The BaaS developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "hash.h"
+#include "main.h"
+#include "masternode-payments.h"
+#include "masternodeman.h"
+#include "obfuscation.h"
+#include "random.h"
+#include "script/standard.h"
+#include "txmempool.h"
+
+#include <map>
+
+// Walk the list in a scattered order, so the linear scans don't find their entry early
+static const size_t STRIDE = 7919;
+
+namespace {
+/** A masternode list of nCount entries with one seen broadcast and ping each, as mnb/mnp processing finds it */
+class MasternodeSetup
+{
+public:
+    CMasternodeMan mnodeman;
+    std::vector<CMasternodeBroadcast> vMnb;
+    std::vector<CScript> vPayee;
+    std::vector<CMasternode> vMasternodes;
+
+    MasternodeSetup(unsigned int nCount)
+    {
+        vMnb.reserve(nCount);
+        vPayee.reserve(nCount);
+        for (unsigned int i = 0; i < nCount; i++) {
+            CMasternodeBroadcast mnb;
+            mnb.vin = CTxIn(COutPoint(GetRandHash(), GetRand(2)));
+            // keys only need to hash, they are not checked
+            std::vector<unsigned char> vch(33);
+            GetRandBytes(&vch[1], 32);
+            vch[0] = 0x02;
+            mnb.pubKeyCollateralAddress = CPubKey(vch);
+            GetRandBytes(&vch[1], 32);
+            mnb.pubKeyMasternode = CPubKey(vch);
+            mnb.addr = CService(CNetAddr(strprintf("10.%d.%d.%d", i >> 16, (i >> 8) & 0xff, i & 0xff)), 51472);
+            mnb.lastPing.vin = mnb.vin;
+            mnb.lastPing.sigTime = i;
+
+            CMasternode mn(mnb);
+            mnodeman.Add(mn);
+            mnodeman.AddSeenBroadcast(mnb);
+            mnodeman.AddSeenPing(mnb.lastPing);
+            vMnb.push_back(mnb);
+            vPayee.push_back(GetScriptForDestination(mnb.pubKeyCollateralAddress.GetID()));
+        }
+        vMasternodes = mnodeman.GetFullMasternodeVector();
+    }
+};
+
+MasternodeSetup& GetSetup(unsigned int nCount)
+{
+    static std::map<unsigned int, MasternodeSetup*> mapSetup;
+    if (!mapSetup.count(nCount))
+        mapSetup[nCount] = new MasternodeSetup(nCount);
+    return *mapSetup[nCount];
+}
+}
+
+// What a mnp costs before its signature is checked: finding the entry by vin
+static void FindByVin(benchmark::State& state, unsigned int nCount)
+{
+    MasternodeSetup& setup = GetSetup(nCount);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        setup.mnodeman.Find(setup.vMnb[i].vin);
+        i = (i + STRIDE) % setup.vMnb.size();
+    }
+}
+
+static void FindByPubKey(benchmark::State& state, unsigned int nCount)
+{
+    MasternodeSetup& setup = GetSetup(nCount);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        setup.mnodeman.Find(setup.vMnb[i].pubKeyMasternode);
+        i = (i + STRIDE) % setup.vMnb.size();
+    }
+}
+
+static void FindByPayee(benchmark::State& state, unsigned int nCount)
+{
+    MasternodeSetup& setup = GetSetup(nCount);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        setup.mnodeman.Find(setup.vPayee[i]);
+        i = (i + STRIDE) % setup.vPayee.size();
+    }
+}
+
+// The scans over a vector the list used to be, for comparison.
+static void FindByVinLinear(benchmark::State& state, unsigned int nCount)
+{
+    MasternodeSetup& setup = GetSetup(nCount);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        BOOST_FOREACH (CMasternode& mn, setup.vMasternodes) {
+            if (mn.vin.prevout == setup.vMnb[i].vin.prevout)
+                break;
+        }
+        i = (i + STRIDE) % setup.vMnb.size();
+    }
+}
+
+static void FindByPayeeLinear(benchmark::State& state, unsigned int nCount)
+{
+    MasternodeSetup& setup = GetSetup(nCount);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        BOOST_FOREACH (CMasternode& mn, setup.vMasternodes) {
+            if (GetScriptForDestination(mn.pubKeyCollateralAddress.GetID()) == setup.vPayee[i])
+                break;
+        }
+        i = (i + STRIDE) % setup.vPayee.size();
+    }
+}
+
+// Removing an entry with what was seen from it and adding it back, as a re-announced masternode does
+static void RemoveAndAdd(benchmark::State& state, unsigned int nCount)
+{
+    MasternodeSetup& setup = GetSetup(nCount);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        CMasternodeBroadcast& mnb = setup.vMnb[i];
+        setup.mnodeman.Remove(mnb.vin);
+        CMasternode mn(mnb);
+        setup.mnodeman.Add(mn);
+        setup.mnodeman.AddSeenBroadcast(mnb);
+        setup.mnodeman.AddSeenPing(mnb.lastPing);
+        i = (i + STRIDE) % setup.vMnb.size();
+    }
+}
+
+namespace {
+/** nCount masternodes on a chain of nCount * 1.25 blocks, each block paying the next masternode in turn */
+class LastPaidSetup
+{
+public:
+    std::vector<uint256> vHash;
+    std::vector<CBlockIndex> vBlock;
+    std::vector<CMasternode> vMn;
+    int nDepth;
+
+    LastPaidSetup(unsigned int nCount) : vHash(nCount * 5 / 4), vBlock(nCount * 5 / 4), vMn(nCount), nDepth(nCount * 5 / 4)
+    {
+        std::vector<CScript> vPayee;
+        for (unsigned int i = 0; i < nCount; i++) {
+            std::vector<unsigned char> vch(33);
+            GetRandBytes(&vch[1], 32);
+            vch[0] = 0x02;
+            vMn[i].vin = CTxIn(COutPoint(GetRandHash(), 0));
+            vMn[i].pubKeyCollateralAddress = CPubKey(vch);
+            vPayee.push_back(GetScriptForDestination(vMn[i].pubKeyCollateralAddress.GetID()));
+        }
+        for (size_t i = 0; i < vBlock.size(); i++) {
+            vHash[i] = GetRandHash();
+            vBlock[i].phashBlock = &vHash[i];
+            vBlock[i].nHeight = i;
+            vBlock[i].nTime = 1500000000 + i * 60;
+            vBlock[i].pprev = i ? &vBlock[i - 1] : NULL;
+        }
+        chainActive.SetTip(&vBlock.back());
+        mapCacheBlockHashes.clear();
+        masternodePayments.Clear();
+        for (size_t i = 101; i < vBlock.size(); i++) {
+            for (int j = 0; j < MNPAYMENTS_PAID_VOTES; j++) {
+                CMasternodePaymentWinner winner(CTxIn(COutPoint(GetRandHash(), 0)));
+                winner.nBlockHeight = i;
+                winner.payee = vPayee[i % nCount];
+                masternodePayments.AddWinningMasternode(winner);
+            }
+        }
+    }
+};
+
+LastPaidSetup& GetLastPaidSetup(unsigned int nCount)
+{
+    static std::map<unsigned int, LastPaidSetup*> mapSetup;
+    if (!mapSetup.count(nCount))
+        mapSetup[nCount] = new LastPaidSetup(nCount);
+    LastPaidSetup& setup = *mapSetup[nCount];
+    chainActive.SetTip(&setup.vBlock.back());
+    return setup;
+}
+
+/** Puts the active chain back the way the other benchmarks expect it */
+struct ResetTip {
+    CBlockIndex* pindexOld;
+    ResetTip() : pindexOld(chainActive.Tip()) {}
+    ~ResetTip() { chainActive.SetTip(pindexOld); }
+};
+}
+
+// What the payment queue asks for every enabled masternode
+static void LastPaid(benchmark::State& state, unsigned int nCount)
+{
+    ResetTip reset;
+    LastPaidSetup& setup = GetLastPaidSetup(nCount);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        setup.vMn[i].GetLastPaid(setup.nDepth);
+        i = (i + STRIDE) % setup.vMn.size();
+    }
+}
+
+// The walk back from the tip GetLastPaid used to do, for comparison.
+static void LastPaidChainWalk(benchmark::State& state, unsigned int nCount)
+{
+    ResetTip reset;
+    LastPaidSetup& setup = GetLastPaidSetup(nCount);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        CScript mnpayee = GetScriptForDestination(setup.vMn[i].pubKeyCollateralAddress.GetID());
+        int n = 0;
+        for (const CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->nHeight > 0 && n++ < setup.nDepth; pindex = pindex->pprev) {
+            if (masternodePayments.mapMasternodeBlocks.count(pindex->nHeight) &&
+                masternodePayments.mapMasternodeBlocks[pindex->nHeight].HasPayeeWithVotes(mnpayee, 2))
+                break;
+        }
+        i = (i + STRIDE) % setup.vMn.size();
+    }
+}
+
+namespace {
+/** nCount enabled masternodes on a short chain, swiftTX votes and mnw ask for their ranks at the last few heights */
+class RankSetup
+{
+public:
+    std::vector<uint256> vHash;
+    std::vector<CBlockIndex> vBlock;
+    CMasternodeMan mnodeman;
+    std::vector<CMasternode> vMasternodes;
+
+    RankSetup(unsigned int nCount) : vHash(200), vBlock(200)
+    {
+        for (size_t i = 0; i < vBlock.size(); i++) {
+            vHash[i] = GetRandHash();
+            vBlock[i].phashBlock = &vHash[i];
+            vBlock[i].nHeight = i;
+            vBlock[i].nTime = 1500000000 + i * 60;
+            vBlock[i].pprev = i ? &vBlock[i - 1] : NULL;
+        }
+        for (unsigned int i = 0; i < nCount; i++) {
+            CMasternode mn;
+            mn.vin = CTxIn(COutPoint(GetRandHash(), 0));
+            mn.sigTime = GetAdjustedTime() - MASTERNODE_MIN_MNP_SECONDS - 1;
+            mn.lastPing.vin = mn.vin;
+            mn.lastPing.sigTime = GetAdjustedTime();
+            mnodeman.Add(mn);
+        }
+        vMasternodes = mnodeman.GetFullMasternodeVector();
+    }
+};
+
+RankSetup& GetRankSetup(unsigned int nCount)
+{
+    static std::map<unsigned int, RankSetup*> mapSetup;
+    if (!mapSetup.count(nCount))
+        mapSetup[nCount] = new RankSetup(nCount);
+    RankSetup& setup = *mapSetup[nCount];
+    chainActive.SetTip(&setup.vBlock.back());
+    mapCacheBlockHashes.clear();
+    return setup;
+}
+
+struct CompareScoreTxIn {
+    bool operator()(const std::pair<int64_t, CTxIn>& t1,
+        const std::pair<int64_t, CTxIn>& t2) const
+    {
+        return t1.first < t2.first;
+    }
+};
+}
+
+// The rank of a voting masternode at one of the last 5 heights
+static void Rank(benchmark::State& state, unsigned int nCount)
+{
+    ResetTip reset;
+    RankSetup& setup = GetRankSetup(nCount);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        setup.mnodeman.GetMasternodeRank(setup.vMasternodes[i].vin, 195 + i % 5);
+        i = (i + STRIDE) % setup.vMasternodes.size();
+    }
+}
+
+// Scoring and sorting every masternode for each rank, as GetMasternodeRank used to, for comparison.
+static void RankSorting(benchmark::State& state, unsigned int nCount)
+{
+    ResetTip reset;
+    RankSetup& setup = GetRankSetup(nCount);
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        std::vector<std::pair<int64_t, CTxIn> > vecMasternodeScores;
+        BOOST_FOREACH (CMasternode& mn, setup.vMasternodes) {
+            mn.Check();
+            if (!mn.IsEnabled()) continue;
+            uint256 n = mn.CalculateScore(1, 195 + i % 5);
+            vecMasternodeScores.push_back(std::make_pair(n.GetCompact(false), mn.vin));
+        }
+        sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
+        BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
+            if (s.second.prevout == setup.vMasternodes[i].vin.prevout) break;
+        }
+        i = (i + STRIDE) % setup.vMasternodes.size();
+    }
+}
+
+namespace {
+/** nCount collaterals confirmed at height 1 of a 100 block chain, in a coins view of their own */
+class CollateralSetup
+{
+public:
+    CCoinsView viewDummy;
+    CCoinsViewCache view;
+    uint256 hashTip;
+    CBlockIndex indexTip;
+    std::vector<COutPoint> vOutpoints;
+
+    CollateralSetup(unsigned int nCount) : view(&viewDummy)
+    {
+        SelectParams(CBaseChainParams::REGTEST);
+        hashTip = GetRandHash();
+        indexTip.phashBlock = &hashTip;
+        indexTip.nHeight = 100;
+        view.SetBestBlock(hashTip);
+
+        std::vector<unsigned char> vch(33);
+        GetRandBytes(&vch[1], 32);
+        vch[0] = 0x02;
+        // the collateral and some change, in a transaction each
+        CMutableTransaction tx;
+        tx.vout.resize(2);
+        tx.vout[0].scriptPubKey = GetScriptForDestination(CPubKey(vch).GetID());
+        tx.vout[0].nValue = GetMasterNodeCollateral(0) * COIN;
+        tx.vout[1].scriptPubKey = tx.vout[0].scriptPubKey;
+        tx.vout[1].nValue = COIN;
+        for (unsigned int i = 0; i < nCount; i++) {
+            uint256 hash = GetRandHash();
+            view.ModifyCoins(hash)->FromTx(tx, 1);
+            vOutpoints.push_back(COutPoint(hash, 0));
+        }
+    }
+};
+
+CollateralSetup& GetCollateralSetup(unsigned int nCount)
+{
+    static std::map<unsigned int, CollateralSetup*> mapSetup;
+    if (!mapSetup.count(nCount))
+        mapSetup[nCount] = new CollateralSetup(nCount);
+    return *mapSetup[nCount];
+}
+
+/** Makes a CollateralSetup the chain state while a benchmark runs */
+struct UseCollateralSetup {
+    CollateralSetup& setup;
+    CCoinsViewCache* pcoinsOld;
+    ResetTip reset;
+    UseCollateralSetup(CollateralSetup& setupIn) : setup(setupIn), pcoinsOld(pcoinsTip)
+    {
+        pcoinsTip = &setup.view;
+        mapBlockIndex[setup.hashTip] = &setup.indexTip;
+        chainActive.SetTip(&setup.indexTip);
+    }
+    ~UseCollateralSetup()
+    {
+        pcoinsTip = pcoinsOld;
+        mapBlockIndex.erase(setup.hashTip);
+    }
+};
+}
+
+// What an mnb costs under cs_main to check its collateral, and what marking a collateral spent costs
+static void Collateral(benchmark::State& state, unsigned int nCount)
+{
+    UseCollateralSetup use(GetCollateralSetup(nCount));
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        LOCK(cs_main);
+        int nHeight;
+        bool fUnspent = GetCollateralHeight(use.setup.vOutpoints[i], nHeight);
+        assert(fUnspent);
+        i = (i + STRIDE) % use.setup.vOutpoints.size();
+    }
+}
+
+// The transaction spending the collateral that mnb and every CMasternode::Check() ran through
+// AcceptableInputs, for comparison.
+static void CollateralAcceptableInputs(benchmark::State& state, unsigned int nCount)
+{
+    UseCollateralSetup use(GetCollateralSetup(nCount));
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        CValidationState stateDummy;
+        CMutableTransaction tx = CMutableTransaction();
+        CTxOut vout = CTxOut((GetMasterNodeCollateral(chainActive.Height())-0.01) * COIN, obfuScationPool.collateralPubKey);
+        tx.vin.push_back(CTxIn(use.setup.vOutpoints[i]));
+        tx.vout.push_back(vout);
+        LOCK(cs_main);
+        bool fAccepted = AcceptableInputs(mempool, stateDummy, CTransaction(tx), false, NULL);
+        assert(fAccepted);
+        i = (i + STRIDE) % use.setup.vOutpoints.size();
+    }
+}
+
+static void MasternodeFindByVin5k(benchmark::State& state) { FindByVin(state, 5000); }
+static void MasternodeFindByVin20k(benchmark::State& state) { FindByVin(state, 20000); }
+static void MasternodeFindByVinLinear5k(benchmark::State& state) { FindByVinLinear(state, 5000); }
+static void MasternodeFindByVinLinear20k(benchmark::State& state) { FindByVinLinear(state, 20000); }
+static void MasternodeFindByPubKey5k(benchmark::State& state) { FindByPubKey(state, 5000); }
+static void MasternodeFindByPubKey20k(benchmark::State& state) { FindByPubKey(state, 20000); }
+static void MasternodeFindByPayee5k(benchmark::State& state) { FindByPayee(state, 5000); }
+static void MasternodeFindByPayee20k(benchmark::State& state) { FindByPayee(state, 20000); }
+static void MasternodeFindByPayeeLinear5k(benchmark::State& state) { FindByPayeeLinear(state, 5000); }
+static void MasternodeFindByPayeeLinear20k(benchmark::State& state) { FindByPayeeLinear(state, 20000); }
+static void MasternodeRemoveAndAdd5k(benchmark::State& state) { RemoveAndAdd(state, 5000); }
+static void MasternodeRemoveAndAdd20k(benchmark::State& state) { RemoveAndAdd(state, 20000); }
+
+static void MasternodeLastPaid5k(benchmark::State& state) { LastPaid(state, 5000); }
+static void MasternodeLastPaid20k(benchmark::State& state) { LastPaid(state, 20000); }
+static void MasternodeLastPaidChainWalk5k(benchmark::State& state) { LastPaidChainWalk(state, 5000); }
+static void MasternodeLastPaidChainWalk20k(benchmark::State& state) { LastPaidChainWalk(state, 20000); }
+
+static void MasternodeCollateral5k(benchmark::State& state) { Collateral(state, 5000); }
+static void MasternodeCollateralAcceptableInputs5k(benchmark::State& state) { CollateralAcceptableInputs(state, 5000); }
+
+static void MasternodeRank5k(benchmark::State& state) { Rank(state, 5000); }
+static void MasternodeRank20k(benchmark::State& state) { Rank(state, 20000); }
+static void MasternodeRankSorting5k(benchmark::State& state) { RankSorting(state, 5000); }
+static void MasternodeRankSorting20k(benchmark::State& state) { RankSorting(state, 20000); }
+
+BENCHMARK(MasternodeFindByVin5k);
+BENCHMARK(MasternodeFindByVin20k);
+BENCHMARK(MasternodeFindByVinLinear5k);
+BENCHMARK(MasternodeFindByVinLinear20k);
+BENCHMARK(MasternodeFindByPubKey5k);
+BENCHMARK(MasternodeFindByPubKey20k);
+BENCHMARK(MasternodeFindByPayee5k);
+BENCHMARK(MasternodeFindByPayee20k);
+BENCHMARK(MasternodeFindByPayeeLinear5k);
+BENCHMARK(MasternodeFindByPayeeLinear20k);
+BENCHMARK(MasternodeRemoveAndAdd5k);
+BENCHMARK(MasternodeRemoveAndAdd20k);
+BENCHMARK(MasternodeLastPaid5k);
+BENCHMARK(MasternodeLastPaid20k);
+BENCHMARK(MasternodeLastPaidChainWalk5k);
+BENCHMARK(MasternodeLastPaidChainWalk20k);
+BENCHMARK(MasternodeRank5k);
+BENCHMARK(MasternodeRank20k);
+BENCHMARK(MasternodeRankSorting5k);
+BENCHMARK(MasternodeRankSorting20k);
+BENCHMARK(MasternodeCollateral5k);
+BENCHMARK(MasternodeCollateralAcceptableInputs5k);
@@ -0,0 +1,137 @@
+// Copyright (c) 2018-2019 The BaaS developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "key.h"
+#include "keystore.h"
+#include "main.h"
+#include "random.h"
+#include "script/sign.h"
+#include "script/standard.h"
+#include "txdb.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+// Number of transactions in one synthetic flood. Divide by the reported
+// average time per iteration to get the sustained accept rate.
+static const unsigned int FLOOD_SIZE = 1000;
+
+namespace {
+/** In-memory chain state with one funding output per flood transaction */
+class FloodSetup
+{
+    boost::filesystem::path pathTemp;
+    CCoinsViewDB* pcoinsdbview;
+    boost::thread_group threadGroup;
+
+public:
+    std::vector<CTransaction> vtx;
+
+    FloodSetup()
+    {
+        SelectParams(CBaseChainParams::REGTEST);
+        pathTemp = GetTempPath() / strprintf("bench_baas_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        // Every iteration verifies the same signatures again
+        mapArgs["-maxsigcachesize"] = "0";
+        pblocktree = new CBlockTreeDB(1 << 20, true);
+        pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+        pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+        InitBlockIndex();
+
+        nScriptCheckThreads = boost::thread::hardware_concurrency();
+        if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+            nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+
+        CBasicKeyStore keystore;
+        CKey key;
+        key.MakeNewKey(true);
+        keystore.AddKey(key);
+        CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+        CMutableTransaction txFunding;
+        txFunding.vout.resize(FLOOD_SIZE);
+        for (unsigned int i = 0; i < FLOOD_SIZE; i++) {
+            txFunding.vout[i].scriptPubKey = scriptPubKey;
+            txFunding.vout[i].nValue = 100 * COIN;
+        }
+        uint256 hashFunding = GetRandHash();
+        {
+            LOCK(cs_main);
+            pcoinsTip->ModifyCoins(hashFunding)->FromTx(txFunding, 0);
+        }
+
+        for (unsigned int i = 0; i < FLOOD_SIZE; i++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(hashFunding, i);
+            tx.vout.resize(1);
+            tx.vout[0].scriptPubKey = scriptPubKey;
+            tx.vout[0].nValue = 100 * COIN - 10000;
+            SignSignature(keystore, scriptPubKey, tx, 0);
+            vtx.push_back(tx);
+        }
+    }
+
+    ~FloodSetup()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        mempool.clear();
+        delete pcoinsTip;
+        delete pcoinsdbview;
+        delete pblocktree;
+        boost::filesystem::remove_all(pathTemp);
+    }
+};
+
+FloodSetup& GetFloodSetup()
+{
+    static FloodSetup setup;
+    return setup;
+}
+}
+
+// Admit the flood one transaction at a time, as the tx handler used to
+static void MempoolAcceptSerial(benchmark::State& state)
+{
+    const std::vector<CTransaction>& vtx = GetFloodSetup().vtx;
+    while (state.KeepRunning()) {
+        LOCK(cs_main);
+        BOOST_FOREACH (const CTransaction& tx, vtx) {
+            CValidationState stateDummy;
+            AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL);
+        }
+        assert(mempool.size() == vtx.size());
+        mempool.clear();
+    }
+}
+
+// Admit the flood in batches of MAX_TX_BATCH_SIZE, as the tx handler does now
+static void MempoolAcceptBatch(benchmark::State& state)
+{
+    const std::vector<CTransaction>& vtx = GetFloodSetup().vtx;
+    while (state.KeepRunning()) {
+        LOCK(cs_main);
+        for (unsigned int i = 0; i < vtx.size(); i += MAX_TX_BATCH_SIZE) {
+            std::vector<CTransaction> vBatch(vtx.begin() + i, vtx.begin() + std::min<size_t>(i + MAX_TX_BATCH_SIZE, vtx.size()));
+            std::vector<CValidationState> vState;
+            std::vector<bool> vAccepted, vMissingInputs;
+            AcceptToMemoryPoolBatch(mempool, vBatch, vState, vAccepted, vMissingInputs, false);
+        }
+        assert(mempool.size() == vtx.size());
+        mempool.clear();
+    }
+}
+
+BENCHMARK(MempoolAcceptSerial);
+BENCHMARK(MempoolAcceptBatch);
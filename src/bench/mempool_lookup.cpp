@@ -0,0 +1,109 @@
+// Copyright (c) 2018-2019 The BaaS developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "amount.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "txmempool.h"
+#include "utiltime.h"
+
+#include <map>
+
+// Size of the synthetic pool; the lookup cost should not grow with it.
+static const unsigned int POOL_SIZE = 100000;
+
+namespace {
+/** A pool of POOL_SIZE unsigned transactions, half of them spending another pool transaction */
+class LookupSetup
+{
+public:
+    CTxMemPool pool;
+    std::vector<uint256> vHash;
+    std::vector<COutPoint> vSpent;
+    std::map<COutPoint, CInPoint> mapNextTxOrdered;
+
+    LookupSetup() : pool(CFeeRate(0))
+    {
+        vHash.reserve(POOL_SIZE);
+        vSpent.reserve(POOL_SIZE);
+        for (unsigned int i = 0; i < POOL_SIZE; i++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            if (i % 2 && !vHash.empty())
+                tx.vin[0].prevout = COutPoint(vHash[GetRand(vHash.size())], GetRand(2));
+            else
+                tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            tx.vout.resize(2);
+            tx.vout[0].nValue = tx.vout[1].nValue = CENT;
+            CTransaction txFinal(tx);
+            if (pool.mapNextTx.count(txFinal.vin[0].prevout))
+                continue;
+            pool.addUnchecked(txFinal.GetHash(), CTxMemPoolEntry(txFinal, 0, GetTime(), 0.0, 1));
+            vHash.push_back(txFinal.GetHash());
+            vSpent.push_back(txFinal.vin[0].prevout);
+        }
+        mapNextTxOrdered.insert(pool.mapNextTx.begin(), pool.mapNextTx.end());
+    }
+};
+
+LookupSetup& GetSetup()
+{
+    static LookupSetup setup;
+    return setup;
+}
+}
+
+static void MempoolLookupExists(benchmark::State& state)
+{
+    LookupSetup& setup = GetSetup();
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        setup.pool.exists(setup.vHash[i]);
+        if (++i == setup.vHash.size())
+            i = 0;
+    }
+}
+
+static void MempoolLookupNextTx(benchmark::State& state)
+{
+    LookupSetup& setup = GetSetup();
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        setup.pool.mapNextTx.count(setup.vSpent[i]);
+        if (++i == setup.vSpent.size())
+            i = 0;
+    }
+}
+
+// The same spends in the ordered map mapNextTx used to be, for comparison.
+static void MempoolLookupNextTxOrdered(benchmark::State& state)
+{
+    LookupSetup& setup = GetSetup();
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        setup.mapNextTxOrdered.count(setup.vSpent[i]);
+        if (++i == setup.vSpent.size())
+            i = 0;
+    }
+}
+
+static void MempoolPruneSpent(benchmark::State& state)
+{
+    LookupSetup& setup = GetSetup();
+    size_t i = 0;
+    while (state.KeepRunning()) {
+        CCoins coins;
+        coins.vout.resize(2);
+        setup.pool.pruneSpent(setup.vHash[i], coins);
+        if (++i == setup.vHash.size())
+            i = 0;
+    }
+}
+
+BENCHMARK(MempoolLookupExists);
+BENCHMARK(MempoolLookupNextTx);
+BENCHMARK(MempoolLookupNextTxOrdered);
+BENCHMARK(MempoolPruneSpent);
@@ -0,0 +1,69 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018-2019 The BaaS developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "bloom.h"
+#include "mruset.h"
+#include "net.h"
+#include "protocol.h"
+#include "random.h"
+
+#include <iostream>
+
+// What a peer's inventory known-set sees: an insert and a lookup for every announced item.
+static void RollingBloom(benchmark::State& state)
+{
+    CRollingBloomFilter filter(INVENTORY_KNOWN_SIZE, 0.000001);
+    uint256 hash = GetRandHash();
+    uint64_t nCount = 0;
+    while (state.KeepRunning()) {
+        *(uint64_t*)hash.begin() = nCount++;
+        filter.insert(hash);
+        *(uint64_t*)hash.begin() = nCount * 7919;
+        filter.contains(hash);
+    }
+}
+
+// The mruset<CInv> the inventory known-set used to be, for comparison.
+static void RollingBloomMruset(benchmark::State& state)
+{
+    mruset<CInv> setKnown(INVENTORY_KNOWN_SIZE);
+    uint256 hash = GetRandHash();
+    uint64_t nCount = 0;
+    while (state.KeepRunning()) {
+        *(uint64_t*)hash.begin() = nCount++;
+        setKnown.insert(CInv(MSG_TX, hash));
+        *(uint64_t*)hash.begin() = nCount * 7919;
+        setKnown.count(CInv(MSG_TX, hash));
+    }
+}
+
+/** Heap bytes of a full mruset: a red-black tree node (three pointers, the colour and the
+ *  malloc header) per item, rounded up to 16 bytes, plus its copy in the deque. */
+template <typename T>
+static size_t MrusetUsage(size_t nItems)
+{
+    size_t nNode = ((sizeof(T) + 4 * sizeof(void*) + sizeof(void*) + 15) / 16) * 16;
+    return nItems * (nNode + sizeof(T));
+}
+
+// Memory held by one peer's inventory and address known-sets, before and after.
+static void RollingBloomMemoryPerPeer(benchmark::State& state)
+{
+    CRollingBloomFilter addrKnown(ADDR_KNOWN_SIZE, 0.001);
+    CRollingBloomFilter filterInventoryKnown(INVENTORY_KNOWN_SIZE, 0.000001);
+    size_t nBloom = addrKnown.GetMemoryUsage() + filterInventoryKnown.GetMemoryUsage();
+    // setAddrKnown kept 5000 addresses, setInventoryKnown SendBufferSize() / 1000 = 1000 items
+    size_t nMruset = MrusetUsage<CAddress>(5000) + MrusetUsage<CInv>(1000);
+    std::cout << "RollingBloomMemoryPerPeer, rolling bloom " << nBloom << " bytes, mruset " << nMruset << " bytes when full" << std::endl;
+    while (state.KeepRunning()) {
+        addrKnown.insert(GetRandHash());
+    }
+}
+
+BENCHMARK(RollingBloom);
+BENCHMARK(RollingBloomMruset);
+BENCHMARK(RollingBloomMemoryPerPeer);
@@ -0,0 +1,215 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018-2019 The BaaS developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <ios>
+#include <limits>
+#include <vector>
+
+class CTxMemPool;
+
+/** Transactions of a block a peer asks for by index ("getblocktxn") */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<uint16_t> indexes;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, blockhash, nType, nVersion);
+        // Indexes are sent as the gap from the previous one
+        WriteCompactSize(s, indexes.size());
+        for (size_t i = 0; i < indexes.size(); i++)
+            WriteCompactSize(s, indexes[i] - (i == 0 ? 0 : indexes[i - 1] + 1));
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, blockhash, nType, nVersion);
+        uint64_t nIndexes = ReadCompactSize(s);
+        indexes.clear();
+        while (indexes.size() < nIndexes) {
+            uint64_t nIndex = ReadCompactSize(s);
+            if (!indexes.empty())
+                nIndex += (uint64_t)indexes.back() + 1;
+            if (nIndex > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("index overflowed 16 bits");
+            indexes.push_back(nIndex);
+        }
+    }
+};
+
+/** The answer to a BlockTransactionsRequest ("blocktxn") */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+/** A transaction sent in full inside a compact block, with its position in the block */
+struct PrefilledTransaction {
+    uint16_t index;
+    CTransaction tx;
+};
+
+/**
+ * A block as relayed with compact block relay ("cmpctblock"): the header, the
+ * transactions the receiver cannot have (coinbase, and the coinstake of a
+ * proof-of-stake block) and 6-byte short IDs for the rest, plus the block
+ * signature. Short IDs are SipHash-2-4 of the txid, keyed by the header and
+ * a per-message nonce, so collisions cannot be planned across peers.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class PartiallyDownloadedBlock;
+
+    static const int SHORTTXIDS_LENGTH = 6;
+
+protected:
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() {}
+
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        ::Serialize(s, header, nType, nVersion);
+        ::Serialize(s, nonce, nType, nVersion);
+
+        WriteCompactSize(s, shorttxids.size());
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t lsb = shorttxids[i] & 0xffffffff;
+            uint16_t msb = (shorttxids[i] >> 32) & 0xffff;
+            ::Serialize(s, lsb, nType, nVersion);
+            ::Serialize(s, msb, nType, nVersion);
+        }
+
+        // Like BlockTransactionsRequest, indexes are the gap from the previous one
+        WriteCompactSize(s, prefilledtxn.size());
+        for (size_t i = 0; i < prefilledtxn.size(); i++) {
+            WriteCompactSize(s, prefilledtxn[i].index - (i == 0 ? 0 : prefilledtxn[i - 1].index + 1));
+            ::Serialize(s, prefilledtxn[i].tx, nType, nVersion);
+        }
+
+        ::Serialize(s, vchBlockSig, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        ::Unserialize(s, header, nType, nVersion);
+        ::Unserialize(s, nonce, nType, nVersion);
+
+        uint64_t nShortTxIDs = ReadCompactSize(s);
+        shorttxids.clear();
+        while (shorttxids.size() < nShortTxIDs) {
+            uint32_t lsb = 0;
+            uint16_t msb = 0;
+            ::Unserialize(s, lsb, nType, nVersion);
+            ::Unserialize(s, msb, nType, nVersion);
+            shorttxids.push_back(((uint64_t)msb << 32) | lsb);
+        }
+
+        uint64_t nPrefilled = ReadCompactSize(s);
+        prefilledtxn.clear();
+        while (prefilledtxn.size() < nPrefilled) {
+            uint64_t nIndex = ReadCompactSize(s);
+            if (!prefilledtxn.empty())
+                nIndex += (uint64_t)prefilledtxn.back().index + 1;
+            if (nIndex > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("index overflowed 16 bits");
+            prefilledtxn.push_back(PrefilledTransaction());
+            prefilledtxn.back().index = nIndex;
+            ::Unserialize(s, prefilledtxn.back().tx, nType, nVersion);
+        }
+
+        ::Unserialize(s, vchBlockSig, nType, nVersion);
+
+        FillShortTxIDSelector();
+    }
+};
+
+enum ReadStatus {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // Invalid object, peer is sending bogus crap
+    READ_STATUS_FAILED,  // Failed to process object, fall back to asking for the full block
+};
+
+/** A compact block being filled in from the mempool and a "blocktxn" answer */
+class PartiallyDownloadedBlock
+{
+protected:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vHave;
+    size_t prefilled_count, mempool_count;
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+
+public:
+    PartiallyDownloadedBlock() : prefilled_count(0), mempool_count(0) {}
+
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool);
+    bool IsTxAvailable(size_t index) const;
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const;
+
+    const CBlockHeader& GetHeader() const { return header; }
+    size_t GetMempoolCount() const { return mempool_count; }
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
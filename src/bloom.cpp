@@ -10,6 +10,7 @@
 #include "chainparams.h"
 #include "hash.h"
 #include "primitives/transaction.h"
+#include "random.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "streams.h"
@@ -17,6 +18,9 @@
 #include <math.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <limits>
+
 #include <boost/foreach.hpp>
 
 #define LN2SQUARED 0.4804530139182014246671025263266649717305529515945455
@@ -232,3 +236,107 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    double logFpRate = log(fpRate);
+    /* The optimal number of hash functions is log(fpRate) / log(0.5), but
+     * restrict it to the range 1-50. */
+    nHashFuncs = max(1, min((int)round(logFpRate / log(0.5)), 50));
+    /* In this rolling bloom filter, we'll store between 2 and 3 generations of nElements / 2 entries. */
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    /* The maximum fpRate = pow(1.0 - exp(-nHashFuncs * nMaxElements / nFilterBits), nHashFuncs)
+     * =>          nFilterBits = -nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs))
+     */
+    uint32_t nFilterBits = (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    /* For each position we need to store 2 bits. These are kept in separate
+     * integers: position P corresponds to bit (P & 63) of the integers
+     * data[(P >> 6) * 2] and data[(P >> 6) * 2 + 1]. */
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+uint64_t CRollingBloomFilter::Hash(const vector<unsigned char>& vKey) const
+{
+    return CSipHasher(nSalt0, nSalt1).Write(vKey.empty() ? NULL : &vKey[0], vKey.size()).Finalize();
+}
+
+uint64_t CRollingBloomFilter::Hash(const uint256& hash) const
+{
+    return SipHashUint256(nSalt0, nSalt1, hash);
+}
+
+void CRollingBloomFilter::insertHash(uint64_t nHash)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        uint64_t nGenerationMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        /* Wipe old entries that used this generation number. */
+        for (uint32_t p = 0; p < data.size(); p += 2) {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    // The positions are h1 + n * h2 (Kirsch and Mitzenmacher), one SipHash for all of them
+    uint32_t h1 = (uint32_t)nHash, h2 = (uint32_t)(nHash >> 32) | 1;
+    for (int n = 0; n < nHashFuncs; n++) {
+        uint32_t h = h1 + n * h2;
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % data.size();
+        /* The lowest bit of pos is ignored, and set to zero for the first bit, and to one for the second. */
+        data[pos & ~1] = (data[pos & ~1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration & 1)) << bit;
+        data[pos | 1] = (data[pos | 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration >> 1)) << bit;
+    }
+}
+
+bool CRollingBloomFilter::containsHash(uint64_t nHash) const
+{
+    uint32_t h1 = (uint32_t)nHash, h2 = (uint32_t)(nHash >> 32) | 1;
+    for (int n = 0; n < nHashFuncs; n++) {
+        uint32_t h = h1 + n * h2;
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % data.size();
+        /* If the relevant bit is not set in either data[pos & ~1] or data[pos | 1], the filter does not contain the item */
+        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+void CRollingBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    insertHash(Hash(vKey));
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    insertHash(Hash(hash));
+}
+
+bool CRollingBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    return containsHash(Hash(vKey));
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    return containsHash(Hash(hash));
+}
+
+void CRollingBloomFilter::reset()
+{
+    nSalt0 = GetRand(std::numeric_limits<uint64_t>::max());
+    nSalt1 = GetRand(std::numeric_limits<uint64_t>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
@@ -105,4 +105,47 @@ public:
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set,
+ * used for what a peer already knows about. Construct it with the number of items
+ * to keep track of, and a false-positive rate.
+ *
+ * contains(item) will always return true if item was one of the last N to 1.5*N
+ * insert()'ed, but may also return true for items that were not inserted. Memory
+ * is allocated once: about 3/(log(256)*log(2)) * log(1/fpRate) * nElements bytes.
+ *
+ * Entries are kept in three generations of N/2 items; starting a new generation
+ * wipes the oldest one. Positions come from one SipHash of the item with a random
+ * salt, so peers cannot aim false positives at a node. reset() also changes the salt.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    void reset();
+
+    //! Bytes used by the filter data
+    size_t GetMemoryUsage() const { return data.size() * sizeof(uint64_t); }
+
+private:
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    //! Two bits per position: 0 is unset, 1 to 3 the generation that set it
+    std::vector<uint64_t> data;
+    uint64_t nSalt0, nSalt1;
+    int nHashFuncs;
+
+    uint64_t Hash(const std::vector<unsigned char>& vKey) const;
+    uint64_t Hash(const uint256& hash) const;
+    void insertHash(uint64_t nHash);
+    bool containsHash(uint64_t nHash) const;
+};
+
 #endif // BITCOIN_BLOOM_H
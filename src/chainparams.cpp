@@ -168,7 +168,7 @@ public:
         fRequireStandard = true;
         fMineBlocksOnDemand = false;
         fTestnetToBeDeprecatedFieldRPC = false;
-        fHeadersFirstSyncingActive = false;
+        fHeadersFirstSyncingActive = true;
 
         nPoolMaxTransactions = 3;
         strSporkKey = "0424fc48689e5a9a2784ece09006bc0d306c457f85f61134d369e6aa59a9892c98d4e54b6975bbb87e0071d5236bf0270627032328026931fef2a528fd8138a5a0";
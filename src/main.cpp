@@ -10,6 +10,7 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "blocksignature.h"
 #include "chainparams.h"
 #include "checkpoints.h"
@@ -73,6 +74,7 @@ bool fCheckBlockIndex = false;
 bool fVerifyingBlocks = false;
 unsigned int nCoinCacheSize = 5000;
 bool fAlerts = DEFAULT_ALERTS;
+bool fCompactBlocks = DEFAULT_COMPACT_BLOCKS;
 bool fClearSpendCache = false;
 
 unsigned int nStakeMinAge = 60 * 60;
@@ -87,13 +89,36 @@ CFeeRate minRelayTxFee = CFeeRate(10000);
 CTxMemPool mempool(::minRelayTxFee);
 
 struct COrphanTx {
-    CTransaction tx;
+    vector<unsigned char> vchTx; //! serialized, a fraction of the memory of a CTransaction
     NodeId fromPeer;
+    int64_t nTimeExpire;
 };
 map<uint256, COrphanTx> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+/** Orphans of each peer, oldest first, and their serialized size */
+struct COrphanPeer {
+    list<uint256> listOrphans;
+    size_t nBytes;
+    COrphanPeer() : nBytes(0) {}
+};
+map<NodeId, COrphanPeer> mapOrphanTransactionsByPeer;
+size_t nOrphanTransactionsBytes = 0;
+static int64_t nNextOrphanSweep = 0;
+/** Orphans with a newly arrived parent, waiting for ProcessOrphanWork */
+static deque<uint256> queueOrphanWork;
+static set<uint256> setOrphanWork;
+static std::atomic<bool> fOrphanWorkPending(false);
 map<uint256, int64_t> mapRejectedBlocks;
 
+/** Transactions received from peers, waiting for ProcessQueuedTransactions */
+struct CQueuedTx {
+    CTransaction tx;
+    CNode* pfrom; //! referenced until the transaction has been processed
+};
+CCriticalSection cs_vTxQueue;
+vector<CQueuedTx> vTxQueue;
+set<uint256> setTxQueued;
+
 
 void EraseOrphansFor(NodeId peer);
 
@@ -174,6 +199,19 @@ int nQueuedValidatedHeaders = 0;
 /** Number of preferable block download peers. */
 int nPreferredDownload = 0;
 
+/** Number of peers we asked to push new blocks to us as compact blocks. */
+int nHighBandwidthCompactPeers = 0;
+
+/** Blocks received ahead of their parent's data, kept until the parent is accepted. Protected by cs_main. */
+struct CPendingBlock {
+    CBlock block;
+    NodeId fromPeer;
+    size_t nSize;
+};
+map<uint256, CPendingBlock> mapPendingBlocks;
+multimap<uint256, uint256> mapPendingBlocksByPrev;
+size_t nPendingBlocksBytes = 0;
+
 /** Dirty block index entries. */
 set<CBlockIndex*> setDirtyBlockIndex;
 
@@ -304,6 +342,14 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer understands compact blocks ("sendcmpct").
+    bool fSupportsCompactBlocks;
+    //! Whether this peer wants new blocks pushed as "cmpctblock" instead of announced by inv.
+    bool fPreferCompactBlocks;
+    //! Whether we asked this peer to push new blocks to us as compact blocks.
+    bool fHighBandwidthCompactTo;
+    //! The compact block from this peer waiting for the missing transactions ("blocktxn").
+    PartiallyDownloadedBlock partialBlock;
 
     CNodeBlocks nodeBlocks;
 
@@ -319,6 +365,9 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        fSupportsCompactBlocks = false;
+        fPreferCompactBlocks = false;
+        fHighBandwidthCompactTo = false;
     }
 };
 
@@ -380,6 +429,7 @@ void FinalizeNode(NodeId nodeid)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    nHighBandwidthCompactPeers -= state->fHighBandwidthCompactTo;
 
     mapNodeState.erase(nodeid);
 }
@@ -531,7 +581,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             if (pindex->nStatus & BLOCK_HAVE_DATA) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
-            } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
+            } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0 && mapPendingBlocks.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
                 if (pindex->nHeight > nWindowEnd) {
                     // We reached the end of the window.
@@ -576,6 +626,7 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.GetHeight.connect(&GetHeight);
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
+    nodeSignals.ProcessQueuedTransactions.connect(&ProcessQueuedTransactions);
     nodeSignals.InitializeNode.connect(&InitializeNode);
     nodeSignals.FinalizeNode.connect(&FinalizeNode);
 }
@@ -585,6 +636,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.GetHeight.disconnect(&GetHeight);
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
+    nodeSignals.ProcessQueuedTransactions.disconnect(&ProcessQueuedTransactions);
     nodeSignals.InitializeNode.disconnect(&InitializeNode);
     nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
 }
@@ -612,6 +664,14 @@ CSporkDB* pSporkDB = NULL;
 // mapOrphanTransactions
 //
 
+static CTransaction GetOrphanTx(const COrphanTx& orphan)
+{
+    CDataStream ss(orphan.vchTx, SER_NETWORK, PROTOCOL_VERSION);
+    CTransaction tx;
+    ss >> tx;
+    return tx;
+}
+
 bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
     uint256 hash = tx.GetHash();
@@ -631,13 +691,21 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << tx;
+    orphan.vchTx.assign(ss.begin(), ss.end());
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
     BOOST_FOREACH (const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+    COrphanPeer& orphanPeer = mapOrphanTransactionsByPeer[peer];
+    orphanPeer.listOrphans.push_back(hash);
+    orphanPeer.nBytes += orphan.vchTx.size();
+    nOrphanTransactionsBytes += orphan.vchTx.size();
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u bytes %u)\n", hash.ToString(),
+        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanTransactionsBytes);
     return true;
 }
 
@@ -646,7 +714,7 @@ void static EraseOrphanTx(uint256 hash)
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return;
-    BOOST_FOREACH (const CTxIn& txin, it->second.tx.vin) {
+    BOOST_FOREACH (const CTxIn& txin, GetOrphanTx(it->second).vin) {
         map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
@@ -654,34 +722,69 @@ void static EraseOrphanTx(uint256 hash)
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.find(it->second.fromPeer);
+    if (itPeer != mapOrphanTransactionsByPeer.end()) {
+        itPeer->second.listOrphans.remove(hash);
+        itPeer->second.nBytes -= it->second.vchTx.size();
+        if (itPeer->second.listOrphans.empty())
+            mapOrphanTransactionsByPeer.erase(itPeer);
+    }
+    nOrphanTransactionsBytes -= it->second.vchTx.size();
     mapOrphanTransactions.erase(it);
 }
 
 void EraseOrphansFor(NodeId peer)
 {
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end()) {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer) {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.find(peer);
+    if (itPeer == mapOrphanTransactionsByPeer.end())
+        return;
+    // EraseOrphanTx drops the peer entry along with its last orphan
+    list<uint256> listOrphans = itPeer->second.listOrphans;
+    BOOST_FOREACH (const uint256& hash, listOrphans)
+        EraseOrphanTx(hash);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", listOrphans.size(), peer);
 }
 
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+/**
+ * Expire old orphans, trim every peer to nMaxPerPeer orphans, then evict the
+ * oldest orphans of the peer using the most memory until the pool fits in
+ * nMaxOrphans transactions and nMaxBytes bytes. Returns the number of
+ * orphans evicted, not counting expired ones.
+ */
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxBytes, unsigned int nMaxPerPeer)
 {
+    int64_t nNow = GetTime();
+    if (nNextOrphanSweep <= nNow) {
+        int nExpired = 0;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end()) {
+            map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphanTx(maybeErase->first);
+                ++nExpired;
+            }
+        }
+        nNextOrphanSweep = nNow + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nExpired > 0) LogPrint("mempool", "Erased %d expired orphan tx\n", nExpired);
+    }
+
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans) {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.begin();
+    while (itPeer != mapOrphanTransactionsByPeer.end()) {
+        const COrphanPeer& orphanPeer = (itPeer++)->second;
+        unsigned int nExcess = orphanPeer.listOrphans.size() > nMaxPerPeer ? orphanPeer.listOrphans.size() - nMaxPerPeer : 0;
+        // The last erase may remove the peer entry itself, itPeer already moved past it
+        for (unsigned int i = 0; i < nExcess; i++, nEvicted++)
+            EraseOrphanTx(orphanPeer.listOrphans.front());
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsBytes > nMaxBytes) {
+        map<NodeId, COrphanPeer>::iterator itLargest = mapOrphanTransactionsByPeer.begin();
+        for (itPeer = mapOrphanTransactionsByPeer.begin(); itPeer != mapOrphanTransactionsByPeer.end(); ++itPeer) {
+            if (itPeer->second.nBytes > itLargest->second.nBytes)
+                itLargest = itPeer;
+        }
+        EraseOrphanTx(itLargest->second.listOrphans.front());
         ++nEvicted;
     }
     return nEvicted;
@@ -1053,7 +1156,14 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+/**
+ * Everything AcceptToMemoryPool checks before verifying scripts. On success the
+ * inputs of tx have been pulled from viewInputs into view, which is left detached
+ * on viewDummy, and entry describes the transaction as it would enter the pool.
+ * setSpentInBatch holds outpoints claimed by not yet committed transactions of the
+ * same AcceptToMemoryPoolBatch call and is treated like pool.mapNextTx.
+ */
+static bool AcceptToMemoryPoolPreChecks(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, CCoinsView& viewInputs, const set<COutPoint>& setSpentInBatch, CCoinsViewCache& view, CCoinsView& viewDummy, CTxMemPoolEntry& entry, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1108,19 +1218,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     LOCK(pool.cs); // protect pool.mapNextTx
     for (unsigned int i = 0; i < tx.vin.size(); i++) {
         COutPoint outpoint = tx.vin[i].prevout;
-        if (pool.mapNextTx.count(outpoint)) {
+        if (pool.mapNextTx.count(outpoint) || setSpentInBatch.count(outpoint)) {
             // Disable replacement feature for now
             return false;
 		}
 	}
 
-    CCoinsView dummy;
-    CCoinsViewCache view(&dummy);
-
     CAmount nValueIn = 0;
-    LOCK(pool.cs);
-    CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
-    view.SetBackend(viewMemPool);
+    view.SetBackend(viewInputs);
 
     // do we already have it?
     if (view.HaveCoins(hash))
@@ -1148,7 +1253,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     nValueIn = view.GetValueIn(tx);
 
     // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
-    view.SetBackend(dummy);
+    view.SetBackend(viewDummy);
 
     // Check for non-standard pay-to-script-hash in inputs
     if (Params().RequireStandard() && !AreInputsStandard(tx, view))
@@ -1171,7 +1276,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     CAmount nFees = nValueIn - nValueOut;
     double dPriority = view.GetPriority(tx, chainActive.Height());
 
-    CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+    entry = CTxMemPoolEntry(tx, nFees, GetTime(), dPriority, chainActive.Height());
     unsigned int nSize = entry.GetTxSize();
 
     // Don't accept it if it can't get into a block
@@ -1216,6 +1321,22 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
             hash.ToString(),
             nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+    return true;
+}
+
+static bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    AssertLockHeld(cs_main);
+
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+    CTxMemPoolEntry entry;
+    if (!AcceptToMemoryPoolPreChecks(pool, state, tx, viewMemPool, set<COutPoint>(), view, dummy, entry, fLimitFree, pfMissingInputs, fRejectInsaneFee, ignoreFees))
+        return false;
+
+    uint256 hash = tx.GetHash();
+
     // Check against previous transactions
     // This is done last to help prevent CPU exhaustion denial-of-service attacks.
     if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
@@ -1243,6 +1364,152 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     return true;
 }
 
+/** Count the outcome of one admission attempt in the getmempoolstats counters */
+static void RecordAcceptResult(CTxMemPool& pool, bool fAccepted, const CValidationState& state, bool fMissingInputs, int64_t nMicros)
+{
+    if (fAccepted)
+        pool.stats.RecordAccept(nMicros);
+    else if (fMissingInputs)
+        pool.stats.RecordReject("missing-inputs", nMicros);
+    else if (state.GetRejectReason().empty())
+        pool.stats.RecordReject("unknown", nMicros);
+    else
+        pool.stats.RecordReject(state.GetRejectReason(), nMicros);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    int64_t nTimeStart = GetTimeMicros();
+    bool fMissingInputs = false;
+    bool fAccepted = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, &fMissingInputs, fRejectInsaneFee, ignoreFees);
+    RecordAcceptResult(pool, fAccepted, state, fMissingInputs, GetTimeMicros() - nTimeStart);
+    if (pfMissingInputs)
+        *pfMissingInputs = fMissingInputs;
+    return fAccepted;
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+unsigned int AcceptToMemoryPoolBatch(CTxMemPool& pool, const vector<CTransaction>& vtx, vector<CValidationState>& vState, vector<bool>& vAccepted, vector<bool>& vMissingInputs, bool fLimitFree, bool fRejectInsaneFee)
+{
+    AssertLockHeld(cs_main);
+    int64_t nTimeStart = GetTimeMicros();
+    vState.assign(vtx.size(), CValidationState());
+    vAccepted.assign(vtx.size(), false);
+    vMissingInputs.assign(vtx.size(), false);
+
+    // One view of chain and pool is shared by the whole batch. Outputs of the
+    // candidates are added to it as they pass the pre-checks, so a transaction
+    // may spend an output created earlier in the same batch.
+    LOCK(pool.cs);
+    CCoinsView dummy;
+    CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+    CCoinsViewCache viewBatch(&viewMemPool);
+    set<COutPoint> setSpentInBatch;
+
+    vector<CTxMemPoolEntry> vEntry(vtx.size());
+    vector<std::unique_ptr<CCoinsViewCache> > vView(vtx.size());
+    vector<unsigned int> vCandidates;
+    vCandidates.reserve(vtx.size());
+
+    // Scripts of the candidates are handed to the script check threads while the
+    // remaining transactions are still being pre-checked. Without script check
+    // threads they are verified in place, exactly like AcceptToMemoryPool does.
+    bool fParallel = nScriptCheckThreads > 0;
+    bool fScriptsOk = true;
+    {
+        CCheckQueueControl<CScriptCheck> control(fParallel ? &scriptcheckqueue : NULL);
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            const CTransaction& tx = vtx[i];
+            bool fMissingInputs = false;
+            vView[i].reset(new CCoinsViewCache(&dummy));
+            if (!AcceptToMemoryPoolPreChecks(pool, vState[i], tx, viewBatch, setSpentInBatch, *vView[i], dummy, vEntry[i], fLimitFree, &fMissingInputs, fRejectInsaneFee, false)) {
+                vMissingInputs[i] = fMissingInputs;
+                vView[i].reset();
+                continue;
+            }
+
+            vector<CScriptCheck> vChecks;
+            if (!CheckInputs(tx, vState[i], *vView[i], true, STANDARD_SCRIPT_VERIFY_FLAGS, true, fParallel ? &vChecks : NULL)) {
+                error("AcceptToMemoryPool: : ConnectInputs failed %s", tx.GetHash().ToString());
+                vView[i].reset();
+                continue;
+            }
+            control.Add(vChecks);
+
+            BOOST_FOREACH (const CTxIn& txin, tx.vin)
+                setSpentInBatch.insert(txin.prevout);
+            viewBatch.ModifyCoins(tx.GetHash())->FromTx(tx, MEMPOOL_HEIGHT);
+            vCandidates.push_back(i);
+        }
+        fScriptsOk = control.Wait();
+    }
+
+    // Re-check against the mandatory flags, see AcceptToMemoryPool. These mostly
+    // hit the signature cache filled by the standard checks above.
+    if (fScriptsOk && fParallel && !vCandidates.empty()) {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        BOOST_FOREACH (unsigned int i, vCandidates) {
+            vector<CScriptCheck> vChecks;
+            CheckInputs(vtx[i], vState[i], *vView[i], true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, &vChecks);
+            control.Add(vChecks);
+        }
+        fScriptsOk = control.Wait();
+    }
+
+    // Commit in batch order. If any parallel script check failed we do not know
+    // which one, so every candidate is verified again on this thread; the
+    // signature cache keeps that cheap for the valid ones. Descendants of a
+    // rejected candidate become orphans, as they would have been had the
+    // transactions arrived one by one.
+    unsigned int nAccepted = 0;
+    set<uint256> setRejected;
+    BOOST_FOREACH (unsigned int i, vCandidates) {
+        const CTransaction& tx = vtx[i];
+        uint256 hash = tx.GetHash();
+
+        bool fOrphaned = false;
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            if (setRejected.count(txin.prevout.hash)) {
+                fOrphaned = true;
+                break;
+            }
+        }
+        if (fOrphaned) {
+            vMissingInputs[i] = true;
+            setRejected.insert(hash);
+            continue;
+        }
+
+        if (!fScriptsOk || !fParallel) {
+            if (fParallel && !CheckInputs(tx, vState[i], *vView[i], true, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
+                error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
+                setRejected.insert(hash);
+                continue;
+            }
+            if (!CheckInputs(tx, vState[i], *vView[i], true, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
+                error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
+                setRejected.insert(hash);
+                continue;
+            }
+        }
+
+        pool.addUnchecked(hash, vEntry[i]);
+        SyncWithWallets(tx, NULL);
+        vAccepted[i] = true;
+        nAccepted++;
+    }
+
+    // Every transaction of the batch is charged an equal share of its time
+    if (!vtx.empty()) {
+        int64_t nMicros = (GetTimeMicros() - nTimeStart) / vtx.size();
+        for (unsigned int i = 0; i < vtx.size(); i++)
+            RecordAcceptResult(pool, vAccepted[i], vState[i], vMissingInputs[i], nMicros);
+    }
+
+    return nAccepted;
+}
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
 {
     AssertLockHeld(cs_main);
@@ -2035,8 +2302,6 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck()
 {
     RenameThread("baas-scriptch");
@@ -2049,7 +2314,7 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, bool fAlreadyChecked)
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, bool fAlreadyChecked, bool fSkipMempoolScripts)
 {
     AssertLockHeld(cs_main);
     // Check it again in case a previous version let a bad block in
@@ -2138,9 +2403,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 nFees += view.GetValueIn(tx) - tx.GetValueOut();
             nValueIn += view.GetValueIn(tx);
 
+            // The coinstake never comes from the mempool, so it is always checked
+            bool fTxScriptChecks = fScriptChecks && !(fSkipMempoolScripts && mempool.exists(tx.GetHash()));
             std::vector<CScriptCheck> vChecks;
             unsigned int flags = SCRIPT_VERIFY_P2SH;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fTxScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
@@ -2335,6 +2602,13 @@ void static UpdateTip(CBlockIndex* pindexNew)
     }
 }
 
+/** Tell listeners about transactions that left the mempool. Called once mempool.cs is released. */
+static void NotifyRemovedFromMempool(const list<CTransaction>& removed, MemPoolRemovalReason reason)
+{
+    BOOST_FOREACH (const CTransaction& tx, removed)
+        GetMainSignals().TransactionRemovedFromMempool(tx, reason);
+}
+
 /** Disconnect chainActive's tip. */
 bool static DisconnectTip(CValidationState& state)
 {
@@ -2358,14 +2632,15 @@ bool static DisconnectTip(CValidationState& state)
     if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
         return false;
     // Resurrect mempool transactions from the disconnected block.
+    list<CTransaction> removed;
     BOOST_FOREACH (const CTransaction& tx, block.vtx) {
         // ignore validation errors in resurrected transactions
-        list<CTransaction> removed;
         CValidationState stateDummy;
         if (tx.IsCoinBase() || tx.IsCoinStake() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
-            mempool.remove(tx, removed, true);
+            mempool.remove(tx, removed, true, MemPoolRemovalReason::REORG);
     }
-    mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
+    mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight, removed);
+    NotifyRemovedFromMempool(removed, MemPoolRemovalReason::REORG);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
@@ -2440,7 +2715,10 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
 
     // Remove conflicting transactions from the mempool.
     list<CTransaction> txConflicted;
-    mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted);
+    list<CTransaction> txConfirmed;
+    mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, txConfirmed);
+    NotifyRemovedFromMempool(txConfirmed, MemPoolRemovalReason::BLOCK);
+    NotifyRemovedFromMempool(txConflicted, MemPoolRemovalReason::CONFLICT);
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
@@ -2496,6 +2774,7 @@ bool DisconnectBlockAndInputs(CValidationState& state, CTransaction txLock)
     //remove anything conflicting in the memory pool
     list<CTransaction> txConflicted;
     mempool.removeConflicts(txLock, txConflicted);
+    NotifyRemovedFromMempool(txConflicted, MemPoolRemovalReason::CONFLICT);
 
 
     // List of what to disconnect (typically nothing)
@@ -2689,6 +2968,26 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
     return true;
 }
 
+/** The compact block message of the last new block, shared by every peer it is sent to. Guarded by cs_main. */
+static uint256 hashLastCmpctBlockMessage;
+static CNetSendBufferRef lastCmpctBlockMessage;
+
+/** Get the "cmpctblock" message for a block, reading it from disk unless pblock is given. Requires cs_main. */
+static CNetSendBufferRef GetCompactBlockMessage(const CBlockIndex* pindex, const CBlock* pblock = NULL)
+{
+    if (hashLastCmpctBlockMessage != pindex->GetBlockHash()) {
+        CBlock block;
+        if (pblock == NULL) {
+            if (!ReadBlockFromDisk(block, pindex))
+                assert(!"cannot load block from disk");
+            pblock = &block;
+        }
+        lastCmpctBlockMessage = MakeNetMessage("cmpctblock", CBlockHeaderAndShortTxIDs(*pblock));
+        hashLastCmpctBlockMessage = pindex->GetBlockHash();
+    }
+    return lastCmpctBlockMessage;
+}
+
 /**
  * Make the best chain active, in multiple steps. The result is either failure
  * or an activated best chain. pblock is either NULL or a pointer to a block
@@ -2730,10 +3029,30 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
             {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                LOCK2(cs_main, cs_vNodes);
+                // Peers that asked for it get the block right away as a compact block,
+                // saving them the inv and getdata round trip
+                CNetSendBufferRef msgCmpctBlock;
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    CNodeState* nodestate = State(pnode->GetId());
+                    if (nodestate != NULL && nodestate->fPreferCompactBlocks && pindexNewTip == chainActive.Tip()) {
+                        bool fKnown;
+                        {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = pnode->filterInventoryKnown.contains(hashNewTip);
+                            if (!fKnown)
+                                pnode->filterInventoryKnown.insert(hashNewTip);
+                        }
+                        if (fKnown)
+                            continue;
+                        if (!msgCmpctBlock)
+                            msgCmpctBlock = GetCompactBlockMessage(pindexNewTip, pblock && pblock->GetHash() == hashNewTip ? pblock : NULL);
+                        pnode->PushMessageBuffer(msgCmpctBlock);
+                    } else
                         pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                }
             }
             // Notify external listeners about the new tip.
             // Note: uiInterface, should switch main signals.
@@ -2820,6 +3139,36 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex)
     return true;
 }
 
+/** Compute the proof-of-stake fields of a block index entry from its parent's. */
+static void SetBlockIndexStake(CBlockIndex* pindexNew)
+{
+    const uint256 hash = pindexNew->GetBlockHash();
+
+    // ppcoin: compute chain trust score
+    pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
+
+    // ppcoin: compute stake entropy bit for stake modifier
+    if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
+        LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
+
+    // ppcoin: record proof-of-stake hash value
+    if (pindexNew->IsProofOfStake()) {
+        if (!mapProofOfStake.count(hash))
+            LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
+        pindexNew->hashProofOfStake = mapProofOfStake[hash];
+    }
+
+    // ppcoin: compute stake modifier
+    uint64_t nStakeModifier = 0;
+    bool fGeneratedStakeModifier = false;
+    if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
+        LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
+    pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+    pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
+    if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
+        LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, std::to_string(nStakeModifier));
+}
+
 CBlockIndex* AddToBlockIndex(const CBlock& block)
 {
     // Check for duplicate
@@ -2851,29 +3200,10 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
-        // ppcoin: compute stake entropy bit for stake modifier
-        if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
-            LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
-
-        // ppcoin: record proof-of-stake hash value
-        if (pindexNew->IsProofOfStake()) {
-            if (!mapProofOfStake.count(hash))
-                LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
-            pindexNew->hashProofOfStake = mapProofOfStake[hash];
-        }
-
-        // ppcoin: compute stake modifier
-        uint64_t nStakeModifier = 0;
-        bool fGeneratedStakeModifier = false;
-        if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
-            LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
-        pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-        pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
-        if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
-            LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, std::to_string(nStakeModifier));
+        // A header alone does not tell proof-of-stake blocks apart; the stake fields
+        // are filled in by AcceptBlock once the block itself arrives.
+        if (!block.vtx.empty())
+            SetBlockIndexStake(pindexNew);
     }
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
@@ -3198,6 +3528,18 @@ bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& sta
         return state.DoS(100, error("%s : incorrect proof of work", __func__),
                 REJECT_INVALID, "bad-diffbits");
 
+    // Past the last proof-of-work block every block must be proof-of-stake, so its target and
+    // timestamp limits are known before the block itself has been downloaded.
+    if (nHeight > Params().LAST_POW_BLOCK()) {
+        if (block.nBits != GetNextWorkRequired(pindexPrev, &block))
+            return state.DoS(100, error("%s : incorrect proof of stake target at %d", __func__, nHeight),
+                REJECT_INVALID, "bad-diffbits");
+
+        if (Params().NetworkID() != CBaseChainParams::REGTEST && block.GetBlockTime() > GetAdjustedTime() + 180)
+            return state.Invalid(error("%s : block timestamp too far in the future", __func__),
+                REJECT_INVALID, "time-too-new");
+    }
+
 
     //If this is a reorg, check that it is not too deep
     if (chainActive.Height() - nHeight >= Params().MaxReorganizationDepth())
@@ -3386,9 +3728,27 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
             mapProofOfStake.insert(make_pair(hash, hashProofOfStake));
     }
 
+    bool fHeaderOnly = false;
+    BlockMap::iterator miSelf = mapBlockIndex.find(block.GetHash());
+    if (miSelf != mapBlockIndex.end() && !(miSelf->second->nStatus & BLOCK_HAVE_DATA))
+        fHeaderOnly = true;
+
     if (!AcceptBlockHeader(block, state, &pindex))
         return false;
 
+    if (fHeaderOnly) {
+        // The entry was created from a "headers" message; complete its stake fields now
+        // that the coinstake is known and the parent's stake modifier is final.
+        if (isPoS && !pindex->IsProofOfStake()) {
+            pindex->SetProofOfStake();
+            pindex->prevoutStake = block.vtx[1].vin[0].prevout;
+            pindex->nStakeTime = block.nTime;
+            setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+        }
+        SetBlockIndexStake(pindex);
+        setDirtyBlockIndex.insert(pindex);
+    }
+
     if (pindex->nStatus & BLOCK_HAVE_DATA) {
         // TODO: deal better with duplicate blocks.
         // return state.DoS(20, error("AcceptBlock() : already have block %d %s", pindex->nHeight, pindex->GetBlockHash().ToString()), REJECT_DUPLICATE, "duplicate");
@@ -3596,6 +3956,76 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
+/** Whether blocks are fetched from this peer headers-first. */
+static bool IsHeadersFirstPeer(const CNode* pnode)
+{
+    return Params().HeadersFirstSyncingActive() && pnode->nVersion >= HEADERS_FIRST_VERSION;
+}
+
+/** Keep a block whose parent has not been accepted yet. Returns false if it was dropped. Requires cs_main. */
+static bool AddPendingBlock(const CBlock& block, NodeId peer)
+{
+    const uint256 hash = block.GetHash();
+    if (mapPendingBlocks.count(hash))
+        return true;
+
+    size_t nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    if (nPendingBlocksBytes + nSize > MAX_PENDING_BLOCKS_SIZE) {
+        LogPrint("net", "dropped pending block %s, %u bytes already waiting\n", hash.ToString(), nPendingBlocksBytes);
+        return false;
+    }
+
+    CPendingBlock& pending = mapPendingBlocks[hash];
+    pending.block = block;
+    pending.fromPeer = peer;
+    pending.nSize = nSize;
+    mapPendingBlocksByPrev.insert(make_pair(block.hashPrevBlock, hash));
+    nPendingBlocksBytes += nSize;
+    return true;
+}
+
+/** Process the blocks that were waiting for hashParent, then the ones waiting for those.
+ *  Blocks descending from one that was not accepted are dropped. */
+static void ProcessPendingBlocks(const uint256& hashParent)
+{
+    std::deque<uint256> queueParents(1, hashParent);
+    while (!queueParents.empty()) {
+        const uint256 hashPrev = queueParents.front();
+        queueParents.pop_front();
+
+        vector<CPendingBlock> vChildren;
+        bool fParentAccepted = false;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(hashPrev);
+            if (mi != mapBlockIndex.end())
+                fParentAccepted = (mi->second->nStatus & BLOCK_HAVE_DATA) && !(mi->second->nStatus & BLOCK_FAILED_MASK);
+
+            pair<multimap<uint256, uint256>::iterator, multimap<uint256, uint256>::iterator> range = mapPendingBlocksByPrev.equal_range(hashPrev);
+            for (multimap<uint256, uint256>::iterator it = range.first; it != range.second; ++it) {
+                map<uint256, CPendingBlock>::iterator itPending = mapPendingBlocks.find(it->second);
+                nPendingBlocksBytes -= itPending->second.nSize;
+                vChildren.push_back(itPending->second);
+                mapPendingBlocks.erase(itPending);
+            }
+            mapPendingBlocksByPrev.erase(range.first, range.second);
+        }
+
+        BOOST_FOREACH (CPendingBlock& pending, vChildren) {
+            if (fParentAccepted) {
+                CValidationState state;
+                ProcessNewBlock(state, NULL, &pending.block);
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0) {
+                    LOCK(cs_main);
+                    Misbehaving(pending.fromPeer, nDoS);
+                }
+            }
+            queueParents.push_back(pending.block.GetHash());
+        }
+    }
+}
+
 bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDiskBlockPos* dbp)
 {
     // Preliminary checks
@@ -3610,7 +4040,10 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
         //if we get this far, check if the prev block is our prev block, if not then request sync and return false
         BlockMap::iterator mi = mapBlockIndex.find(pblock->hashPrevBlock);
         if (mi == mapBlockIndex.end()) {
-            pfrom->PushMessage("getblocks", chainActive.GetLocator(), uint256(0));
+            if (IsHeadersFirstPeer(pfrom))
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), pblock->GetHash());
+            else
+                pfrom->PushMessage("getblocks", chainActive.GetLocator(), uint256(0));
             return false;
         }
     }
@@ -3678,7 +4111,7 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     return true;
 }
 
-bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex* const pindexPrev, bool fCheckPOW, bool fCheckMerkleRoot)
+bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex* const pindexPrev, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckMempoolScripts)
 {
     AssertLockHeld(cs_main);
     assert(pindexPrev && pindexPrev == chainActive.Tip());
@@ -3695,7 +4128,7 @@ bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex
         return false;
     if (!ContextualCheckBlock(block, state, pindexPrev))
         return false;
-    if (!ConnectBlock(block, state, &indexDummy, viewNew, true))
+    if (!ConnectBlock(block, state, &indexDummy, viewNew, true, false, !fCheckMempoolScripts))
         return false;
     assert(state.IsValid());
 
@@ -4345,6 +4778,11 @@ bool static AlreadyHave(const CInv& inv)
     case MSG_TX: {
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
+        {
+            LOCK(cs_vTxQueue);
+            if (setTxQueued.count(inv.hash))
+                return true;
+        }
         return txInMap || mapOrphanTransactions.count(inv.hash) ||
                pcoinsTip->HaveCoins(inv.hash);
     }
@@ -4377,6 +4815,10 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/** The block message last served to a peer, kept to answer other peers asking for the same block. Guarded by cs_main. */
+static uint256 hashLastBlockMessage;
+static CNetSendBufferRef lastBlockMessage;
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -4395,7 +4837,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -4412,16 +4854,38 @@ void static ProcessGetData(CNode* pfrom)
                         }
                     }
                 }
+                // Close to the upload target, old blocks only go to whitelisted peers; the
+                // peer can fetch them elsewhere. New blocks are still relayed to everyone.
+                if (send && !pfrom->fWhitelisted && pindexBestHeader != NULL &&
+                    pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > HISTORICAL_BLOCK_AGE &&
+                    CNode::OutboundTargetReached(true)) {
+                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
                 // Don't send not-validated blocks
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    // Compact blocks are only worth it near the tip, where the peer's
+                    // mempool holds the transactions: older ones are sent in full
+                    if (inv.type == MSG_CMPCT_BLOCK && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+                        pfrom->PushMessageBuffer(GetCompactBlockMessage(mi->second));
+                    } else if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
+                        // A new block is fetched by most peers at once: read and serialize
+                        // it for the first one and send the others the same message
+                        if (hashLastBlockMessage != inv.hash) {
+                            CBlock block;
+                            if (!ReadBlockFromDisk(block, (*mi).second))
+                                assert(!"cannot load block from disk");
+                            lastBlockMessage = MakeNetMessage("block", block);
+                            hashLastBlockMessage = inv.hash;
+                        }
+                        pfrom->PushMessageBuffer(lastBlockMessage);
+                    } else // MSG_FILTERED_BLOCK)
                     {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
@@ -4434,7 +4898,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -4453,84 +4917,57 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
             } else if (inv.IsKnownType()) {
-                // Send stream from relay memory
-                bool pushed = false;
+                // Send message from relay memory
+                CNetSendBufferRef msg;
+                bool fRelayMemory = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CNetSendBufferRef>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
+                        msg = (*mi).second;
+                        fRelayMemory = true;
                     }
                 }
 
-                if (!pushed && inv.type == MSG_TX) {
+                if (!msg && inv.type == MSG_TX) {
                     CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
-                        pushed = true;
-                    }
+                    if (mempool.lookup(inv.hash, tx))
+                        msg = MakeNetMessage("tx", tx);
                 }
-                if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
-                    if (mapTxLockVote.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockVote[inv.hash];
-                        pfrom->PushMessage("txlvote", ss);
-                        pushed = true;
-                    }
+                if (!msg && inv.type == MSG_TXLOCK_VOTE) {
+                    if (mapTxLockVote.count(inv.hash))
+                        msg = MakeNetMessage("txlvote", mapTxLockVote[inv.hash]);
                 }
-                if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
-                    if (mapTxLockReq.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockReq[inv.hash];
-                        pfrom->PushMessage("ix", ss);
-                        pushed = true;
-                    }
+                if (!msg && inv.type == MSG_TXLOCK_REQUEST) {
+                    if (mapTxLockReq.count(inv.hash))
+                        msg = MakeNetMessage("ix", mapTxLockReq[inv.hash]);
                 }
-                if (!pushed && inv.type == MSG_SPORK) {
-                    if (mapSporks.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapSporks[inv.hash];
-                        pfrom->PushMessage("spork", ss);
-                        pushed = true;
-                    }
+                if (!msg && inv.type == MSG_SPORK) {
+                    if (mapSporks.count(inv.hash))
+                        msg = MakeNetMessage("spork", mapSporks[inv.hash]);
                 }
-                if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
-                    if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << masternodePayments.mapMasternodePayeeVotes[inv.hash];
-                        pfrom->PushMessage("mnw", ss);
-                        pushed = true;
-                    }
+                if (!msg && inv.type == MSG_MASTERNODE_WINNER) {
+                    if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash))
+                        msg = MakeNetMessage("mnw", masternodePayments.mapMasternodePayeeVotes[inv.hash]);
                 }
 
-                if (!pushed && inv.type == MSG_MASTERNODE_ANNOUNCE) {
-                    if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodeBroadcast[inv.hash];
-                        pfrom->PushMessage("mnb", ss);
-                        pushed = true;
-                    }
+                if (!msg && inv.type == MSG_MASTERNODE_ANNOUNCE) {
+                    if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash))
+                        msg = MakeNetMessage("mnb", mnodeman.mapSeenMasternodeBroadcast[inv.hash]);
                 }
 
-                if (!pushed && inv.type == MSG_MASTERNODE_PING) {
-                    if (mnodeman.mapSeenMasternodePing.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodePing[inv.hash];
-                        pfrom->PushMessage("mnp", ss);
-                        pushed = true;
-                    }
+                if (!msg && inv.type == MSG_MASTERNODE_PING) {
+                    if (mnodeman.mapSeenMasternodePing.count(inv.hash))
+                        msg = MakeNetMessage("mnp", mnodeman.mapSeenMasternodePing[inv.hash]);
                 }
-                if (!pushed) {
+
+                if (msg) {
+                    // Everything here is announced by inv, so other peers are likely
+                    // to ask for the same item: keep the message for them
+                    if (!fRelayMemory)
+                        AddRelayMessage(inv, msg);
+                    pfrom->PushMessageBuffer(msg);
+                } else {
                     vNotFound.push_back(inv);
                 }
             }
@@ -4538,7 +4975,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -4557,6 +4994,75 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Accept a block received from a peer, whole ("block") or rebuilt from a compact block. */
+static void ProcessBlockMessage(CNode* pfrom, CBlock& block, const string& strCommand)
+{
+    uint256 hashBlock = block.GetHash();
+    CInv inv(MSG_BLOCK, hashBlock);
+    LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+
+    bool fPrevKnown = false;
+    bool fPrevPending = false;
+    bool fHaveData = false;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+        fPrevKnown = miPrev != mapBlockIndex.end();
+        fPrevPending = fPrevKnown && !(miPrev->second->nStatus & BLOCK_HAVE_DATA);
+        fHaveData = mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
+        if (!fPrevKnown || (fPrevPending && !fHaveData))
+            MarkBlockAsReceived(hashBlock);
+        // The parent is still being downloaded, possibly from another peer. Stake checks
+        // need it in the chain, so hold on to this block until it has been accepted.
+        if (fPrevPending && !fHaveData)
+            AddPendingBlock(block, pfrom->GetId());
+    }
+
+    if (!fPrevKnown && IsHeadersFirstPeer(pfrom)) {
+        // Fetch the missing headers first, the block is downloaded again once they connect
+        LOCK(cs_main);
+        pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), hashBlock);
+    } else if (!fPrevKnown) {
+        //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
+        if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
+            //we already asked for this block, so lets work backwards and ask for the previous block
+            pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
+            pfrom->vBlockRequested.push_back(block.hashPrevBlock);
+        } else {
+            //ask to sync to this block
+            pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
+            pfrom->vBlockRequested.push_back(hashBlock);
+        }
+    } else {
+        pfrom->AddInventoryKnown(inv);
+
+        CValidationState state;
+        if (fPrevPending && !fHaveData) {
+            LogPrint("net", "%s : Parent of block %s not accepted yet, keeping it pending\n", __func__, hashBlock.GetHex());
+        } else if (!fHaveData) {
+            ProcessNewBlock(state, pfrom, &block);
+            int nDoS;
+            if (state.IsValid())
+                pfrom->nLastBlockTime = GetTime();
+            if(state.IsInvalid(nDoS)) {
+                pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+                if(nDoS > 0) {
+                    TRY_LOCK(cs_main, lockMain);
+                    if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
+                }
+            }
+            //disconnect this node if its old protocol version
+            pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+
+            ProcessPendingBlocks(hashBlock);
+        } else {
+            LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+        }
+    }
+}
+
 bool fRequestedSporksIDB = false;
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
@@ -4622,6 +5128,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pfrom->fInbound)
             pfrom->PushVersion();
 
+        // Masternodes connecting to us are kept when inbound slots run out
+        if (pfrom->fInbound && !fLiteMode)
+            pfrom->fMasternode = mnodeman.Find((CNetAddr)pfrom->addr) != NULL;
+
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
@@ -4698,6 +5208,33 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (fCompactBlocks && pfrom->nVersion >= COMPACT_BLOCKS_VERSION) {
+            // Ask a few outbound peers to push new blocks to us as compact blocks right
+            // away; the others announce them by inv and are asked for a compact block
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            bool fHighBandwidth = !pfrom->fInbound && nHighBandwidthCompactPeers < MAX_HIGH_BANDWIDTH_COMPACT_PEERS;
+            if (fHighBandwidth) {
+                nodestate->fHighBandwidthCompactTo = true;
+                nHighBandwidthCompactPeers++;
+            }
+            uint64_t nCmpctBlockVersion = 1;
+            pfrom->PushMessage("sendcmpct", fHighBandwidth, nCmpctBlockVersion);
+        }
+    }
+
+
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCmpctBlock = false;
+        uint64_t nCmpctBlockVersion = 0;
+        vRecv >> fAnnounceUsingCmpctBlock >> nCmpctBlockVersion;
+        if (nCmpctBlockVersion == 1) {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            nodestate->fSupportsCompactBlocks = true;
+            nodestate->fPreferCompactBlocks = fAnnounceUsingCmpctBlock;
+        }
     }
 
 
@@ -4727,7 +5264,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the addrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -4787,7 +5324,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
-                if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
+                if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash) && IsHeadersFirstPeer(pfrom)) {
+                    // First request the headers preceding the announced block; the download window
+                    // then fetches it. Only when we are close to synced is the block requested right
+                    // away as well, to save a round trip for a new block on top of our tip.
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                    CNodeState* nodestate = State(pfrom->GetId());
+                    if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20 &&
+                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        // A new block on top of our tip is mostly made of transactions we already have
+                        if (fCompactBlocks && nodestate->fSupportsCompactBlocks)
+                            vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                        else
+                            vToFetch.push_back(inv);
+                        MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                    }
+                    LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                } else if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
                     // Add this to the list of blocks to request
                     vToFetch.push_back(inv);
                     LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
@@ -4828,7 +5381,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    else if (strCommand == "getblocks" || (strCommand == "getheaders" && !IsHeadersFirstPeer(pfrom))) {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -4860,7 +5413,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -4899,107 +5452,27 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
 
     else if (strCommand == "tx") {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
-        //masternode signed transaction
-        bool ignoreFees = false;
-        CTxIn vin;
-        vector<unsigned char> vchSig;
-
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-
-        mapAlreadyAskedFor.erase(inv);
-
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
-                     pfrom->id, pfrom->cleanSubVer,
-                     tx.GetHash().ToString(),
-                     mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for(unsigned int i = 0; i < vWorkQueue.size(); i++) {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if(itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for(set<uint256>::iterator mi = itByPrev->second.begin();
-                    mi != itByPrev->second.end();
-                    ++mi) {
-                    const uint256 &orphanHash = *mi;
-                    const CTransaction &orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if(setMisbehaving.count(fromPeer))
-                        continue;
-                    if(AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    } else if(!fMissingInputs2) {
-                        int nDos = 0;
-                        if(stateDummy.IsInvalid(nDos) && nDos > 0) {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
+        // Admission is deferred to ProcessQueuedTransactions, which validates
+        // everything received during one message handler pass as a batch.
+        bool fQueueFull = false;
+        {
+            LOCK(cs_vTxQueue);
+            if (setTxQueued.insert(inv.hash).second) {
+                pfrom->AddRef();
+                vTxQueue.push_back(CQueuedTx());
+                vTxQueue.back().tx = tx;
+                vTxQueue.back().pfrom = pfrom;
             }
-
-            BOOST_FOREACH (uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        } else if (fMissingInputs) {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else if (pfrom->fWhitelisted) {
-            // Always relay transactions received from whitelisted peers, even
-            // if they are already in the mempool (allowing the node to function
-            // as a gateway for nodes hidden behind it).
-
-            RelayTransaction(tx);
-        }
-
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS)) {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+            fQueueFull = vTxQueue.size() >= MAX_TX_BATCH_SIZE;
         }
+        if (fQueueFull)
+            ProcessQueuedTransactions();
     }
 
 
@@ -5066,42 +5539,146 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         CBlock block;
         vRecv >> block;
-        uint256 hashBlock = block.GetHash();
+        ProcessBlockMessage(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
         CInv inv(MSG_BLOCK, hashBlock);
-        LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+        LogPrint("cmpctblock", "received compact block %s peer=%d\n", hashBlock.ToString(), pfrom->id);
+        pfrom->AddInventoryKnown(inv);
 
-        //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
-        if (!mapBlockIndex.count(block.hashPrevBlock)) {
-            if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
-                //we already asked for this block, so lets work backwards and ask for the previous block
-                pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
-                pfrom->vBlockRequested.push_back(block.hashPrevBlock);
-            } else {
-                //ask to sync to this block
-                pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
-                pfrom->vBlockRequested.push_back(hashBlock);
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+            if (mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                return true;
+
+            if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                // Doesn't connect to anything we know: get the headers in between, the
+                // block itself is fetched again once they connect
+                if (IsHeadersFirstPeer(pfrom))
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), hashBlock);
+                else
+                    pfrom->PushMessage("getblocks", chainActive.GetLocator(), hashBlock);
+                return true;
             }
-        } else {
-            pfrom->AddInventoryKnown(inv);
 
-            CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
-                int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
+            CNodeState* nodestate = State(pfrom->GetId());
+            nodestate->partialBlock = PartiallyDownloadedBlock();
+            ReadStatus status = nodestate->partialBlock.InitData(cmpctblock, mempool);
+            if (status == READ_STATUS_INVALID) {
+                nodestate->partialBlock = PartiallyDownloadedBlock();
+                MarkBlockAsReceived(hashBlock);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid compact block %s from peer=%d", hashBlock.ToString(), pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Short IDs that cannot be told apart: fall back to the full block
+                nodestate->partialBlock = PartiallyDownloadedBlock();
+                MarkBlockAsInFlight(pfrom->GetId(), hashBlock);
+                vector<CInv> vInv(1, inv);
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            req.blockhash = hashBlock;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!nodestate->partialBlock.IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (req.indexes.empty()) {
+                status = nodestate->partialBlock.FillBlock(block, vector<CTransaction>());
+                nodestate->partialBlock = PartiallyDownloadedBlock();
+                if (status == READ_STATUS_OK) {
+                    fBlockReconstructed = true;
+                } else {
+                    MarkBlockAsInFlight(pfrom->GetId(), hashBlock);
+                    vector<CInv> vInv(1, inv);
+                    pfrom->PushMessage("getdata", vInv);
                 }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
             } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+                // Keep the block in flight from this peer while the missing transactions come in
+                MarkBlockAsInFlight(pfrom->GetId(), hashBlock);
+                pfrom->PushMessage("getblocktxn", req);
+                LogPrint("cmpctblock", "requesting %u of %u transactions of block %s from peer=%d\n", req.indexes.size(), cmpctblock.BlockTxCount(), hashBlock.ToString(), pfrom->id);
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessBlockMessage(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("cmpctblock", "peer=%d asked for transactions of unknown block %s\n", pfrom->id, req.blockhash.ToString());
+            return true;
+        }
+
+        if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Too old to be a block the peer is catching up on at the tip: send it in full
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("getblocktxn with out-of-bounds tx indexes from peer=%d", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            if (nodestate->partialBlock.GetHeader().IsNull() || nodestate->partialBlock.GetHeader().GetHash() != resp.blockhash) {
+                LogPrint("cmpctblock", "peer=%d sent us transactions for block %s we were not expecting\n", pfrom->id, resp.blockhash.ToString());
+                return true;
+            }
+
+            ReadStatus status = nodestate->partialBlock.FillBlock(block, resp.txn);
+            nodestate->partialBlock = PartiallyDownloadedBlock();
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid transactions for compact block %s from peer=%d", resp.blockhash.ToString(), pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // The block stays in flight from this peer, now as a full block
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
             }
         }
+
+        ProcessBlockMessage(pfrom, block, strCommand);
     }
 
     // This asymmetric behavior for inbound and outbound connections was introduced
@@ -5110,7 +5687,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     // Making users (which are behind NAT and can only make outgoing connections) ignore
     // getaddr message mitigates the attack.
     else if ((strCommand == "getaddr") && (pfrom->fInbound)) {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH (const CAddress& addr, vAddr)
             pfrom->PushAddress(addr);
@@ -5180,6 +5760,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     if (pingUsecTime > 0) {
                         // Successful ping time measurement, replace previous
                         pfrom->nPingUsecTime = pingUsecTime;
+                        pfrom->nMinPingUsecTime = std::min(pfrom->nMinPingUsecTime, pingUsecTime);
                     } else {
                         // This should never happen
                         sProblem = "Timing mishap";
@@ -5345,6 +5926,271 @@ int ActiveProtocol()
 }
 
 // requires LOCK(cs_vRecvMsg)
+/** Queue the orphans spending outputs of hashParent for re-evaluation by ProcessOrphanWork */
+static void AddOrphanWork(const uint256& hashParent)
+{
+    map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(hashParent);
+    if (itByPrev == mapOrphanTransactionsByPrev.end())
+        return;
+    BOOST_FOREACH (const uint256& orphanHash, itByPrev->second) {
+        if (setOrphanWork.insert(orphanHash).second)
+            queueOrphanWork.push_back(orphanHash);
+    }
+    fOrphanWorkPending = true;
+}
+
+/**
+ * Re-evaluate up to MAX_TX_BATCH_SIZE queued orphans as one batch. Children
+ * of the orphans accepted here are queued for a later call, so a parent
+ * with many descendants is resolved over several message handler passes.
+ */
+static void ProcessOrphanWork()
+{
+    AssertLockHeld(cs_main);
+
+    vector<CTransaction> vOrphans;
+    vector<NodeId> vOrphanFrom;
+    while (!queueOrphanWork.empty() && vOrphans.size() < MAX_TX_BATCH_SIZE) {
+        uint256 orphanHash = queueOrphanWork.front();
+        queueOrphanWork.pop_front();
+        setOrphanWork.erase(orphanHash);
+        // May have been evicted or resolved since it was queued
+        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(orphanHash);
+        if (it == mapOrphanTransactions.end())
+            continue;
+        vOrphans.push_back(GetOrphanTx(it->second));
+        vOrphanFrom.push_back(it->second.fromPeer);
+    }
+    if (vOrphans.empty()) {
+        fOrphanWorkPending = false;
+        return;
+    }
+
+    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+    // anyone relaying LegitTxX banned)
+    vector<CValidationState> vStateDummy;
+    vector<bool> vAccepted, vMissingInputs;
+    AcceptToMemoryPoolBatch(mempool, vOrphans, vStateDummy, vAccepted, vMissingInputs, true);
+
+    set<NodeId> setMisbehaving;
+    for (unsigned int i = 0; i < vOrphans.size(); i++) {
+        uint256 orphanHash = vOrphans[i].GetHash();
+        if (vAccepted[i]) {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(vOrphans[i]);
+            AddOrphanWork(orphanHash);
+            EraseOrphanTx(orphanHash);
+        } else if (!vMissingInputs[i]) {
+            int nDos = 0;
+            if (vStateDummy[i].IsInvalid(nDos) && nDos > 0 && setMisbehaving.insert(vOrphanFrom[i]).second) {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(vOrphanFrom[i], nDos);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            EraseOrphanTx(orphanHash);
+        }
+    }
+    mempool.check(pcoinsTip);
+    fOrphanWorkPending = !queueOrphanWork.empty();
+}
+
+/**
+ * Admit the transactions in vtx to the memory pool as one batch and queue
+ * the orphans that depended on accepted transactions for ProcessOrphanWork.
+ * vFrom holds the peer each transaction of vtx came from.
+ */
+static void AcceptTransactionBatch(const vector<CTransaction>& vtx, const vector<CNode*>& vFrom)
+{
+    AssertLockHeld(cs_main);
+
+    vector<CValidationState> vState;
+    vector<bool> vAccepted, vMissingInputs;
+    AcceptToMemoryPoolBatch(mempool, vtx, vState, vAccepted, vMissingInputs, true);
+    mempool.check(pcoinsTip);
+
+    for (unsigned int i = 0; i < vtx.size(); i++) {
+        const CTransaction& tx = vtx[i];
+        CNode* pfrom = vFrom[i];
+        CInv inv(MSG_TX, tx.GetHash());
+
+        if (vAccepted[i]) {
+            RelayTransaction(tx);
+            AddOrphanWork(inv.hash);
+
+            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
+                     pfrom->id, pfrom->cleanSubVer,
+                     tx.GetHash().ToString(),
+                     mempool.mapTx.size());
+        } else if (vMissingInputs[i]) {
+            AddOrphanTx(tx, pfrom->GetId());
+
+            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+            size_t nMaxOrphanSize = (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE)) * 1000;
+            unsigned int nMaxOrphanPeer = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantxpeer", DEFAULT_MAX_ORPHAN_TRANSACTIONS_PER_PEER));
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanSize, nMaxOrphanPeer);
+            if (nEvicted > 0)
+                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+        } else if (pfrom->fWhitelisted) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they are already in the mempool (allowing the node to function
+            // as a gateway for nodes hidden behind it).
+
+            RelayTransaction(tx);
+        }
+
+        int nDoS = 0;
+        if (vState[i].IsInvalid(nDoS)) {
+            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+                pfrom->id, pfrom->cleanSubVer,
+                vState[i].GetRejectReason());
+            pfrom->PushMessage("reject", string("tx"), vState[i].GetRejectCode(),
+                vState[i].GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+            if (nDoS > 0)
+                Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
+void ProcessQueuedTransactions()
+{
+    vector<CQueuedTx> vQueued;
+    {
+        LOCK(cs_vTxQueue);
+        vQueued.swap(vTxQueue);
+        vTxQueue.reserve(MAX_TX_BATCH_SIZE);
+    }
+    if (vQueued.empty()) {
+        if (fOrphanWorkPending) {
+            LOCK(cs_main);
+            ProcessOrphanWork();
+        }
+        return;
+    }
+
+    vector<CTransaction> vtx;
+    vector<CNode*> vFrom;
+    vtx.reserve(vQueued.size());
+    vFrom.reserve(vQueued.size());
+    BOOST_FOREACH (const CQueuedTx& queued, vQueued) {
+        vtx.push_back(queued.tx);
+        vFrom.push_back(queued.pfrom);
+    }
+
+    {
+        LOCK(cs_main);
+        BOOST_FOREACH (const CTransaction& tx, vtx)
+            mapAlreadyAskedFor.erase(CInv(MSG_TX, tx.GetHash()));
+        AcceptTransactionBatch(vtx, vFrom);
+        ProcessOrphanWork();
+    }
+
+    {
+        LOCK(cs_vTxQueue);
+        BOOST_FOREACH (const CTransaction& tx, vtx)
+            setTxQueued.erase(tx.GetHash());
+    }
+    BOOST_FOREACH (CNode* pnode, vFrom)
+        pnode->Release();
+}
+
+namespace
+{
+/**
+ * Most message handlers, and SendMessages, were written for a single message handler
+ * thread and share state that has no lock of its own, so only one of them runs at a
+ * time. A block or header message waiting for its turn goes ahead of everything else
+ * that is waiting, so a peer streaming expensive masternode traffic holds block relay
+ * up by at most the one handler already running.
+ */
+class CSerialMessageLock
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    bool fHeld;
+    int nPriorityWaiting;
+
+public:
+    CSerialMessageLock() : fHeld(false), nPriorityWaiting(0) {}
+
+    void Enter(bool fPriority)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fPriority)
+            nPriorityWaiting++;
+        try {
+            while (fHeld || (!fPriority && nPriorityWaiting > 0))
+                cond.wait(lock);
+        } catch (boost::thread_interrupted&) {
+            if (fPriority)
+                nPriorityWaiting--;
+            throw;
+        }
+        if (fPriority)
+            nPriorityWaiting--;
+        fHeld = true;
+    }
+
+    void Leave()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fHeld = false;
+        }
+        cond.notify_all();
+    }
+};
+
+CSerialMessageLock serialMessageLock;
+
+class CSerialMessageGuard
+{
+public:
+    explicit CSerialMessageGuard(bool fPriority) { serialMessageLock.Enter(fPriority); }
+    ~CSerialMessageGuard() { serialMessageLock.Leave(); }
+};
+}
+
+/** Messages whose handlers only touch the sending peer, addrman or state with its own lock */
+static bool IsConcurrentMessage(const std::string& strCommand)
+{
+    return strCommand == "ping" || strCommand == "pong" || strCommand == "addr" || strCommand == "getaddr";
+}
+
+bool IsPriorityMessage(const std::string& strCommand)
+{
+    return strCommand == "block" || strCommand == "headers" || strCommand == "cmpctblock" || strCommand == "blocktxn";
+}
+
+/**
+ * Recover the signer of masternode pings and SwiftTX votes before the message
+ * waits for the serial handlers, so the signature check itself runs in parallel.
+ */
+static void PrecomputeMessageSigners(const std::string& strCommand, const CDataStream& vRecv)
+{
+    if (fLiteMode)
+        return;
+    try {
+        CDataStream vCopy(vRecv);
+        if (strCommand == "mnp") {
+            CMasternodePing mnp;
+            vCopy >> mnp;
+            masternodeSigner.PrecomputeSigner(mnp.GetStrMessage(), mnp.vchSig);
+        } else if (strCommand == "txlvote") {
+            CConsensusVote vote;
+            vCopy >> vote;
+            masternodeSigner.PrecomputeSigner(vote.GetStrMessage(), vote.vchMasterNodeSignature);
+        }
+    } catch (std::ios_base::failure& e) {
+        // malformed; the handler itself rejects it
+    }
+}
+
 bool ProcessMessages(CNode* pfrom)
 {
     //if (fDebug)
@@ -5360,8 +6206,16 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
-    if (!pfrom->vRecvGetData.empty())
-        ProcessGetData(pfrom);
+    if (!pfrom->vRecvGetData.empty()) {
+        int64_t nStart = GetTimeMicros();
+        {
+            CSerialMessageGuard serial(false);
+            ProcessGetData(pfrom);
+        }
+        // Serving what was asked for is most of the cost of a getdata
+        static const unsigned int nGetDataType = GetNetMessageTypeIndex("getdata");
+        pfrom->RecordMsgProcessTime(nGetDataType, GetTimeMicros() - nStart);
+    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -5416,10 +6270,23 @@ bool ProcessMessages(CNode* pfrom)
             continue;
         }
 
+        // Expensive requests over the peer's allowance are dropped unanswered
+        if (!pfrom->fWhitelisted && !pfrom->AllowRequest(msg.nMsgType, GetTimeMicros())) {
+            LogPrint("net", "%s from peer=%d dropped (too many requests)\n", SanitizeString(strCommand), pfrom->id);
+            continue;
+        }
+
         // Process message
         bool fRet = false;
+        int64_t nStart = GetTimeMicros();
         try {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            if (IsConcurrentMessage(strCommand)) {
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            } else {
+                PrecomputeMessageSigners(strCommand, vRecv);
+                CSerialMessageGuard serial(IsPriorityMessage(strCommand));
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            }
             boost::this_thread::interruption_point();
         } catch (std::ios_base::failure& e) {
             pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
@@ -5439,6 +6306,7 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        pfrom->RecordMsgProcessTime(msg.nMsgType, GetTimeMicros() - nStart);
 
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
@@ -5461,6 +6329,17 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (pto->nVersion == 0)
             return true;
 
+        // The serial lock comes first: its holder may be pushing a message to this peer,
+        // and a message thread waiting for it may hold this peer's cs_vRecvMsg. Holding
+        // cs_vRecvMsg keeps the ping and addr state away from this peer's own handlers.
+        CSerialMessageGuard serial(false);
+        TRY_LOCK(pto->cs_vRecvMsg, lockRecv);
+        if (!lockRecv)
+            return true;
+        TRY_LOCK(pto->cs_vSend, lockSend);
+        if (!lockSend)
+            return true;
+
         //
         // Message: ping
         //
@@ -5499,9 +6378,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60)) {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                // Periodically clear addrKnown to allow refresh broadcasts
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_vAddrToSend);
+                    pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -5515,10 +6396,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle) {
             vector<CAddress> vAddr;
+            LOCK(pto->cs_vAddrToSend);
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
+                if (!pto->addrKnown.contains(addr.GetKey())) {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000) {
@@ -5560,10 +6442,13 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (IsHeadersFirstPeer(pto)) {
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
+                } else {
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
             }
         }
 
@@ -5578,33 +6463,13 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
         {
             LOCK(pto->cs_inventory);
             vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle) {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait) {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
+                // The same item may be queued more than once
+                if (!pto->filterInventoryKnown.contains(inv.hash)) {
+                    pto->filterInventoryKnown.insert(inv.hash);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000) {
                         pto->PushMessage("inv", vInv);
@@ -5612,13 +6477,55 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.clear();
+        }
+
+        // Transactions go out in batches from txAnnounceQueue on a Poisson timer, to protect
+        // privacy. Inbound peers share one timer, so they cannot be used to tell the order in
+        // which we learnt transactions apart; outbound peers get their own, twice as often.
+        int64_t nNow = GetTimeMicros();
+        bool fSendTxs = pto->fWhitelisted;
+        if (pto->nNextInvSend < nNow) {
+            fSendTxs = true;
+            if (pto->fInbound) {
+                static int64_t nNextInvSendInbound = 0;
+                if (nNextInvSendInbound < nNow)
+                    nNextInvSendInbound = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL);
+                pto->nNextInvSend = nNextInvSendInbound;
+            } else
+                pto->nNextInvSend = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL >> 1);
+        }
+        if (fSendTxs) {
+            LOCK(pto->cs_filter);
+            if (!pto->fRelayTxes)
+                pto->nTxAnnounceNext = txAnnounceQueue.End();
+            unsigned int nTxInv = 0;
+            vector<uint256> vHash;
+            while (nTxInv < INVENTORY_BROADCAST_MAX) {
+                vHash.clear();
+                txAnnounceQueue.Read(pto->nTxAnnounceNext, vHash, INVENTORY_BROADCAST_MAX - nTxInv);
+                if (vHash.empty())
+                    break;
+                BOOST_FOREACH (const uint256& hash, vHash) {
+                    // Evicted or mined since it was queued
+                    CTransaction tx;
+                    if (pto->pfilter ? !mempool.lookup(hash, tx) : !mempool.exists(hash))
+                        continue;
+                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(tx))
+                        continue;
+                    LOCK(pto->cs_inventory);
+                    if (pto->filterInventoryKnown.contains(hash))
+                        continue;
+                    pto->filterInventoryKnown.insert(hash);
+                    vInv.push_back(CInv(MSG_TX, hash));
+                    nTxInv++;
+                }
+            }
         }
         if (!vInv.empty())
             pto->PushMessage("inv", vInv);
 
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -5755,5 +6662,6 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanTransactionsByPeer.clear();
     }
 } instance_of_cmaincleanup;
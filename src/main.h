@@ -64,6 +64,8 @@ static const unsigned int DEFAULT_BLOCK_MAX_SIZE = 750000;
 static const unsigned int DEFAULT_BLOCK_MIN_SIZE = 0;
 /** Default for -blockprioritysize, maximum space for zero/low-fee transactions **/
 static const unsigned int DEFAULT_BLOCK_PRIORITY_SIZE = 50000;
+/** Default for -checktemplatescripts, re-verify mempool transaction scripts when testing new block templates */
+static const bool DEFAULT_CHECK_TEMPLATE_SCRIPTS = true;
 /** Default for accepting alerts from the P2P network. */
 static const bool DEFAULT_ALERTS = true;
 /** The maximum size for transactions we're willing to relay/mine */
@@ -76,6 +78,14 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_TX_SIGOPS_CURRENT = MAX_BLOCK_SIGOPS_CURRENT / 5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphantxsize, maximum kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE = 250;
+/** Default for -maxorphantxpeer, maximum number of orphan transactions kept for a single peer */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_PER_PEER = 25;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -84,6 +94,8 @@ static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int COINBASE_MATURITY = 100;
+/** Maximum number of transactions received from peers that are admitted to the memory pool in one batch */
+static const unsigned int MAX_TX_BATCH_SIZE = 128;
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
@@ -100,6 +112,19 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum total size of downloaded blocks kept in memory until their parent has been accepted. Blocks
+ *  arrive out of order from the download window, but proof-of-stake checks need their parent in the chain. */
+static const unsigned int MAX_PENDING_BLOCKS_SIZE = 64 * 1000 * 1000;
+/** Whether new blocks are relayed and fetched as compact blocks by default. */
+static const bool DEFAULT_COMPACT_BLOCKS = true;
+/** Maximum number of outbound peers asked to push new blocks to us as compact blocks without an inv. */
+static const int MAX_HIGH_BANDWIDTH_COMPACT_PEERS = 3;
+/** Depth below the tip up to which a block is served as a compact block; older ones are sent in full. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Age relative to the best header past which a block counts as historical for -maxuploadtarget (in seconds). */
+static const int64_t HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
+/** Depth below the tip up to which "getblocktxn" is answered; older blocks are sent in full. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
@@ -138,6 +163,9 @@ typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
+/** Time in microseconds spent assembling and validating the last block template */
+extern int64_t nLastBlockTemplateBuildTime;
+extern int64_t nLastBlockTemplateValidateTime;
 extern const std::string strMessageMagic;
 extern int64_t nTimeBestReceived;
 extern CWaitableCriticalSection csBestBlock;
@@ -151,6 +179,7 @@ extern bool fCheckBlockIndex;
 extern unsigned int nCoinCacheSize;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
+extern bool fCompactBlocks;
 extern bool fVerifyingBlocks;
 extern bool fClearSpendCache;
 
@@ -210,6 +239,8 @@ void UnloadBlockIndex();
 int ActiveProtocol();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** Whether a message jumps the queue for the serialized message handlers (blocks and headers) */
+bool IsPriorityMessage(const std::string& strCommand);
 /**
  * Send queued protocol messages to be sent to a give node.
  *
@@ -217,6 +248,8 @@ bool ProcessMessages(CNode* pfrom);
  * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
  */
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/** Admit the transactions queued by ProcessMessages to the memory pool and re-evaluate a batch of orphans whose parents arrived */
+void ProcessQueuedTransactions();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
 
@@ -251,6 +284,15 @@ void FlushStateToDisk();
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
 
+/**
+ * (try to) add a batch of transactions to memory pool. The batch shares one view of chain and
+ * pool, so a transaction may spend outputs of an earlier one in the same batch, and the scripts
+ * of all transactions are verified in parallel on the script check threads.
+ * vState, vAccepted and vMissingInputs are filled per transaction of vtx.
+ * @return the number of accepted transactions
+ */
+unsigned int AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransaction>& vtx, std::vector<CValidationState>& vState, std::vector<bool>& vAccepted, std::vector<bool>& vMissingInputs, bool fLimitFree, bool fRejectInsaneFee = false);
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
 int GetInputAge(CTxIn& vin);
@@ -433,8 +475,10 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 /** Reprocess a number of blocks to try and get on the correct chain again **/
 bool DisconnectBlocksAndReprocess(int blocks);
 
-/** Apply the effects of this block (with given index) on the UTXO set represented by coins */
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck, bool fAlreadyChecked = false);
+/** Apply the effects of this block (with given index) on the UTXO set represented by coins.
+ *  With fSkipMempoolScripts the scripts of transactions still in the mempool, which were verified
+ *  on entry, are not run again; this is only meant for checking our own block templates. */
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck, bool fAlreadyChecked = false, bool fSkipMempoolScripts = false);
 
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
@@ -446,7 +490,7 @@ bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& sta
 bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindexPrev);
 
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
-bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
+bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckMempoolScripts = true);
 
 /** Store block on disk. If dbp is provided, the file is known to already reside on disk */
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** pindex, CDiskBlockPos* dbp = NULL, bool fAlreadyCheckedBlock = false);
@@ -333,6 +333,8 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
         CMasternodePaymentWinner winner;
         vRecv >> winner;
 
+        pfrom->AddInventoryKnown(CInv(MSG_MASTERNODE_WINNER, winner.GetHash()));
+
         if (pfrom->nVersion < ActiveProtocol()) return;
 
         int nHeight;
@@ -468,13 +470,50 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
             mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
         }
-    }
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+        if (mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1) == MNPAYMENTS_PAID_VOTES)
+            mapPaidHeights[winnerIn.payee].insert(winnerIn.nBlockHeight);
+    }
 
     return true;
 }
 
+void CMasternodePayments::IndexPaidHeights(CMasternodeBlockPayees& blockPayees, bool fAdd)
+{
+    LOCK(cs_vecPayments);
+
+    BOOST_FOREACH (CMasternodePayee& payee, blockPayees.vecPayments) {
+        if (payee.nVotes < MNPAYMENTS_PAID_VOTES) continue;
+        if (fAdd) {
+            mapPaidHeights[payee.scriptPubKey].insert(blockPayees.nBlockHeight);
+        } else {
+            std::map<CScript, std::set<int> >::iterator it = mapPaidHeights.find(payee.scriptPubKey);
+            if (it == mapPaidHeights.end()) continue;
+            it->second.erase(blockPayees.nBlockHeight);
+            if (it->second.empty()) mapPaidHeights.erase(it);
+        }
+    }
+}
+
+const CBlockIndex* CMasternodePayments::GetLastPaidBlock(const CScript& payee, int nDepth)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == NULL) return NULL;
+
+    std::map<CScript, std::set<int> >::iterator it = mapPaidHeights.find(payee);
+    if (it == mapPaidHeights.end()) return NULL;
+
+    // the highest paid height not above the tip, if it's within nDepth blocks (the genesis block never counts)
+    std::set<int>::iterator itHeight = it->second.upper_bound(pindexTip->nHeight);
+    if (itHeight == it->second.begin()) return NULL;
+    int nHeight = *--itHeight;
+    if (nHeight <= 0 || nHeight <= pindexTip->nHeight - nDepth) return NULL;
+
+    return chainActive[nHeight];
+}
+
 bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
 {
     LOCK(cs_vecPayments);
@@ -611,7 +650,11 @@ void CMasternodePayments::CleanPaymentList()
             LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
             masternodeSync.mapSeenSyncMNW.erase((*it).first);
             mapMasternodePayeeVotes.erase(it++);
-            mapMasternodeBlocks.erase(winner.nBlockHeight);
+            std::map<int, CMasternodeBlockPayees>::iterator itBlock = mapMasternodeBlocks.find(winner.nBlockHeight);
+            if (itBlock != mapMasternodeBlocks.end()) {
+                IndexPaidHeights(itBlock->second, false);
+                mapMasternodeBlocks.erase(itBlock);
+            }
         } else {
             ++it;
         }
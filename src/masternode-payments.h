@@ -25,6 +25,8 @@ extern CMasternodePayments masternodePayments;
 
 #define MNPAYMENTS_SIGNATURES_REQUIRED 6
 #define MNPAYMENTS_SIGNATURES_TOTAL 10
+// votes a payee needs at a height to count as paid there
+#define MNPAYMENTS_PAID_VOTES 2
 
 void ProcessMessageMasternodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight);
@@ -104,19 +106,21 @@ public:
         vecPayments.clear();
     }
 
-    void AddPayee(CScript payeeIn, int nIncrement)
+    // returns the votes the payee has now
+    int AddPayee(CScript payeeIn, int nIncrement)
     {
         LOCK(cs_vecPayments);
 
         BOOST_FOREACH (CMasternodePayee& payee, vecPayments) {
             if (payee.scriptPubKey == payeeIn) {
                 payee.nVotes += nIncrement;
-                return;
+                return payee.nVotes;
             }
         }
 
         CMasternodePayee c(payeeIn, nIncrement);
         vecPayments.push_back(c);
+        return nIncrement;
     }
 
     bool GetPayee(CScript& payee)
@@ -236,6 +240,11 @@ private:
     int nSyncedFromPeer;
     int nLastBlockHeight;
 
+    // heights at which each payee has MNPAYMENTS_PAID_VOTES votes or more in mapMasternodeBlocks
+    std::map<CScript, std::set<int> > mapPaidHeights;
+
+    void IndexPaidHeights(CMasternodeBlockPayees& blockPayees, bool fAdd);
+
 public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
@@ -252,6 +261,7 @@ public:
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
         mapMasternodePayeeVotes.clear();
+        mapPaidHeights.clear();
     }
 
     bool AddWinningMasternode(CMasternodePaymentWinner& winner);
@@ -261,6 +271,9 @@ public:
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
 
+    /// Most recent block of the last nDepth on the active chain that paid payee, NULL if there is none
+    const CBlockIndex* GetLastPaidBlock(const CScript& payee, int nDepth);
+
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
     bool IsScheduled(CMasternode& mn, int nNotBlockHeight);
@@ -295,6 +308,12 @@ public:
     {
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+        if (ser_action.ForRead()) {
+            LOCK(cs_mapMasternodeBlocks);
+            mapPaidHeights.clear();
+            for (std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin(); it != mapMasternodeBlocks.end(); ++it)
+                IndexPaidHeights(it->second, true);
+        }
     }
 };
 
@@ -66,12 +66,14 @@ void CMasternodeSync::Reset()
     lastMasternodeWinner = 0;
     mapSeenSyncMNB.clear();
     mapSeenSyncMNW.clear();
+    setPendingSyncMNB.clear();
     lastFailure = 0;
     nCountFailures = 0;
     sumMasternodeList = 0;
     sumMasternodeWinner = 0;
     countMasternodeList = 0;
     countMasternodeWinner = 0;
+    nListDiffs = 0;
     RequestedMasternodeAssets = MASTERNODE_SYNC_INITIAL;
     RequestedMasternodeAttempt = 0;
     nAssetSyncStarted = GetTime();
@@ -90,6 +92,13 @@ void CMasternodeSync::AddedMasternodeList(uint256 hash)
     }
 }
 
+void CMasternodeSync::AddedMasternodeListDiff(const std::vector<uint256>& vHashPending)
+{
+    lastMasternodeList = GetTime();
+    setPendingSyncMNB.insert(vHashPending.begin(), vHashPending.end());
+    nListDiffs++;
+}
+
 void CMasternodeSync::AddedMasternodeWinner(uint256 hash)
 {
     if (masternodePayments.mapMasternodePayeeVotes.count(hash)) {
@@ -226,8 +235,13 @@ void CMasternodeSync::Process()
 
     BOOST_FOREACH (CNode* pnode, vNodes) {
         if (Params().NetworkID() == CBaseChainParams::REGTEST) {
+            // a list that came as a diff is complete as soon as its broadcasts are in, go on to the payees
+            if (RequestedMasternodeAttempt > 0 && RequestedMasternodeAttempt < 4 && HasMasternodeListDiffs(1))
+                RequestedMasternodeAttempt = 4;
+
             if (RequestedMasternodeAttempt <= 2) {
                 pnode->PushMessage("getsporks"); //get current network sporks
+                if (RequestedMasternodeAttempt == 0 && pnode->nVersion >= MNLIST_DIFF_VERSION) mnodeman.DsegUpdate(pnode);
             } else if (RequestedMasternodeAttempt < 4) {
                 mnodeman.DsegUpdate(pnode);
             } else if (RequestedMasternodeAttempt < 6) {
@@ -260,6 +274,12 @@ void CMasternodeSync::Process()
                     return;
                 }
 
+                // the peers we asked sent what changed and all of it arrived, no need to wait for more
+                if (RequestedMasternodeAttempt >= MASTERNODE_SYNC_THRESHOLD && HasMasternodeListDiffs(MASTERNODE_SYNC_THRESHOLD)) {
+                    GetNextAsset();
+                    return;
+                }
+
                 if (pnode->HasFulfilledRequest("mnsync")) continue;
                 pnode->FulfilledRequest("mnsync");
 
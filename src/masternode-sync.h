@@ -30,6 +30,8 @@ class CMasternodeSync
 public:
     std::map<uint256, int> mapSeenSyncMNB;
     std::map<uint256, int> mapSeenSyncMNW;
+    // broadcasts list diffs told us about that we haven't received yet
+    std::set<uint256> setPendingSyncMNB;
 
     int64_t lastMasternodeList;
     int64_t lastMasternodeWinner;
@@ -42,6 +44,8 @@ public:
     // peers that reported counts
     int countMasternodeList;
     int countMasternodeWinner;
+    // list diffs received
+    int nListDiffs;
 
     // Count peers we've requested the list from
     int RequestedMasternodeAssets;
@@ -53,6 +57,9 @@ public:
     CMasternodeSync();
 
     void AddedMasternodeList(uint256 hash);
+    void AddedMasternodeListDiff(const std::vector<uint256>& vHashPending);
+    /// The list is complete once enough peers sent their diffs and everything in them arrived
+    bool HasMasternodeListDiffs(int nPeers) { return nListDiffs >= nPeers && setPendingSyncMNB.empty(); }
     void AddedMasternodeWinner(uint256 hash);
     void GetNextAsset();
     std::string GetSyncStatus();
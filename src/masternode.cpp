@@ -8,6 +8,7 @@
 #include "addrman.h"
 #include "masternodeman.h"
 #include "obfuscation.h"
+#include "swifttx.h"
 #include "sync.h"
 #include "util.h"
 
@@ -148,7 +149,7 @@ bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
         int nDoS = 0;
         if (mnb.lastPing == CMasternodePing() || (mnb.lastPing != CMasternodePing() && mnb.lastPing.CheckAndUpdate(nDoS, false))) {
             lastPing = mnb.lastPing;
-            mnodeman.mapSeenMasternodePing.insert(make_pair(lastPing.GetHash(), lastPing));
+            mnodeman.AddSeenPing(lastPing);
         }
         return true;
     }
@@ -160,30 +161,67 @@ bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
 // the proof of work for that block. The further away they are the better, the furthest will win the election
 // and get paid this block
 //
+// The score given a hasher fed with the block hash and the hash of the block hash alone
+static uint256 ScoreFromBlockHashes(const CHash256& hasherBlock, const uint256& hash2, const COutPoint& prevout)
+{
+    uint256 aux = prevout.hash + prevout.n;
+    uint256 hash3;
+    CHash256(hasherBlock).Write(aux.begin(), aux.size()).Finalize(hash3.begin());
+
+    return (hash3 > hash2 ? hash3 - hash2 : hash2 - hash3);
+}
+
+void CalculateMasternodeScores(const uint256& hashBlock, const std::vector<CMasternode*>& vpmn, std::vector<uint256>& vScore)
+{
+    CHash256 hasherBlock;
+    hasherBlock.Write(hashBlock.begin(), hashBlock.size());
+    uint256 hash2;
+    CHash256(hasherBlock).Finalize(hash2.begin());
+
+    vScore.resize(vpmn.size());
+    for (size_t i = 0; i < vpmn.size(); i++)
+        vScore[i] = ScoreFromBlockHashes(hasherBlock, hash2, vpmn[i]->vin.prevout);
+}
+
+bool GetCollateralHeight(const COutPoint& outpoint, int& nHeight)
+{
+    AssertLockHeld(cs_main);
+
+    // locked by a swiftTX spending it
+    if (mapLockedInputs.count(outpoint)) return false;
+
+    CCoins coins;
+    {
+        LOCK(mempool.cs);
+        if (mempool.mapNextTx.count(outpoint)) return false;
+
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        if (!viewMemPool.GetCoins(outpoint.hash, coins) || !coins.IsAvailable(outpoint.n)) return false;
+    }
+
+    if (coins.vout[outpoint.n].nValue < (GetMasterNodeCollateral(chainActive.Height()) - 0.01) * COIN) return false;
+    if ((coins.IsCoinBase() || coins.IsCoinStake()) && (int)coins.nHeight != MEMPOOL_HEIGHT &&
+        chainActive.Height() + 1 - coins.nHeight < Params().COINBASE_MATURITY()) return false;
+
+    nHeight = coins.nHeight;
+    return true;
+}
+
 uint256 CMasternode::CalculateScore(int mod, int64_t nBlockHeight)
 {
     if (chainActive.Tip() == NULL) return 0;
 
     uint256 hash = 0;
-    uint256 aux = vin.prevout.hash + vin.prevout.n;
 
     if (!GetBlockHash(hash, nBlockHeight)) {
         LogPrint("masternode","CalculateScore ERROR - nHeight %d - Returned 0\n", nBlockHeight);
         return 0;
     }
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    ss << hash;
-    uint256 hash2 = ss.GetHash();
-
-    CHashWriter ss2(SER_GETHASH, PROTOCOL_VERSION);
-    ss2 << hash;
-    ss2 << aux;
-    uint256 hash3 = ss2.GetHash();
-
-    uint256 r = (hash3 > hash2 ? hash3 - hash2 : hash2 - hash3);
-
-    return r;
+    std::vector<CMasternode*> vpmn(1, this);
+    std::vector<uint256> vScore;
+    CalculateMasternodeScores(hash, vpmn, vScore);
+    return vScore[0];
 }
 
 void CMasternode::Check(bool forceCheck)
@@ -194,7 +232,7 @@ void CMasternode::Check(bool forceCheck)
     lastTimeChecked = GetTime();
 
 
-    //once spent, stop doing the checks
+    //once spent, stop doing the checks (mnodeman marks the spent collaterals as blocks and transactions come in)
     if (activeState == MASTERNODE_VIN_SPENT) return;
 
 
@@ -213,33 +251,12 @@ void CMasternode::Check(bool forceCheck)
     	return;
     }
 
-    if (!unitTest) {
-        CValidationState state;
-        CMutableTransaction tx = CMutableTransaction();
-        CTxOut vout = CTxOut((GetMasterNodeCollateral(chainActive.Height())-0.01) * COIN, obfuScationPool.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
-
-        {
-            TRY_LOCK(cs_main, lockMain);
-            if (!lockMain) return;
-
-            if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)) {
-                activeState = MASTERNODE_VIN_SPENT;
-                return;
-            }
-        }
-    }
-
     activeState = MASTERNODE_ENABLED; // OK
 }
 
-int64_t CMasternode::SecondsSincePayment()
+int64_t CMasternode::SecondsSincePayment(int nDepth)
 {
-    CScript pubkeyScript;
-    pubkeyScript = GetScriptForDestination(pubKeyCollateralAddress.GetID());
-
-    int64_t sec = (GetAdjustedTime() - GetLastPaid());
+    int64_t sec = (GetAdjustedTime() - GetLastPaid(nDepth));
     int64_t month = 60 * 60 * 24 * 30;
     if (sec < month) return sec; //if it's less than 30 days, give seconds
 
@@ -254,12 +271,21 @@ int64_t CMasternode::SecondsSincePayment()
 
 int64_t CMasternode::GetLastPaid()
 {
-    CBlockIndex* pindexPrev = chainActive.Tip();
-    if (pindexPrev == NULL) return false;
+    return GetLastPaid(mnodeman.CountEnabled() * 1.25);
+}
 
+int64_t CMasternode::GetLastPaid(int nDepth)
+{
     CScript mnpayee;
     mnpayee = GetScriptForDestination(pubKeyCollateralAddress.GetID());
 
+    /*
+        Search for this payee, with at least 2 votes. This will aid in consensus allowing the network
+        to converge on the same payees quickly, then keep the same schedule.
+    */
+    const CBlockIndex* pindexPaid = masternodePayments.GetLastPaidBlock(mnpayee, nDepth);
+    if (pindexPaid == NULL) return 0;
+
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     ss << vin;
     ss << sigTime;
@@ -268,36 +294,7 @@ int64_t CMasternode::GetLastPaid()
     // use a deterministic offset to break a tie -- 2.5 minutes
     int64_t nOffset = hash.GetCompact(false) % 150;
 
-    if (chainActive.Tip() == NULL) return false;
-
-    const CBlockIndex* BlockReading = chainActive.Tip();
-
-    int nMnCount = mnodeman.CountEnabled() * 1.25;
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nMnCount) {
-            return 0;
-        }
-        n++;
-
-        if (masternodePayments.mapMasternodeBlocks.count(BlockReading->nHeight)) {
-            /*
-                Search for this payee, with at least 2 votes. This will aid in consensus allowing the network
-                to converge on the same payees quickly, then keep the same schedule.
-            */
-            if (masternodePayments.mapMasternodeBlocks[BlockReading->nHeight].HasPayeeWithVotes(mnpayee, 2)) {
-                return BlockReading->nTime + nOffset;
-            }
-        }
-
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
-
-    return 0;
+    return pindexPaid->nTime + nOffset;
 }
 
 std::string CMasternode::GetStatus()
@@ -551,7 +548,7 @@ bool CMasternodeBroadcast::CheckAndUpdate(int& nDos)
     if (pmn->pubKeyCollateralAddress == pubKeyCollateralAddress && !pmn->IsBroadcastedWithin(MASTERNODE_MIN_MNB_SECONDS)) {
         //take the newest entry
         LogPrint("masternode","mnb - Got updated entry for %s\n", vin.prevout.hash.ToString());
-        if (pmn->UpdateFromNewBroadcast((*this))) {
+        if (mnodeman.UpdateFromNewBroadcast(*pmn, *this)) {
             pmn->Check();
             if (pmn->IsEnabled()) Relay();
         }
@@ -582,47 +579,34 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
             mnodeman.Remove(pmn->vin);
     }
 
-    CValidationState state;
-    CMutableTransaction tx = CMutableTransaction();
-    CTxOut vout = CTxOut((GetMasterNodeCollateral(chainActive.Height())-0.01) * COIN, obfuScationPool.collateralPubKey);
-    tx.vin.push_back(vin);
-    tx.vout.push_back(vout);
-
     {
         TRY_LOCK(cs_main, lockMain);
         if (!lockMain) {
             // not mnb fault, let it to be checked again later
-            mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
+            mnodeman.EraseSeenBroadcast(GetHash());
             masternodeSync.mapSeenSyncMNB.erase(GetHash());
             return false;
         }
 
-        if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)) {
-            //set nDos
-            state.IsInvalid(nDoS);
+        int nHeight;
+        if (!GetCollateralHeight(vin.prevout, nHeight)) {
+            LogPrint("masternode", "mnb - Collateral %s is spent or not a collateral\n", vin.prevout.ToString());
             return false;
         }
-    }
 
-    LogPrint("masternode", "mnb - Accepted Masternode entry\n");
+        LogPrint("masternode", "mnb - Accepted Masternode entry\n");
 
-    if (GetInputAge(vin) < MASTERNODE_MIN_CONFIRMATIONS) {
-        LogPrint("masternode","mnb - Input must have at least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
-        // maybe we miss few blocks, let this mnb to be checked again later
-        mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
-        masternodeSync.mapSeenSyncMNB.erase(GetHash());
-        return false;
-    }
+        if (chainActive.Height() + 1 - nHeight < MASTERNODE_MIN_CONFIRMATIONS) {
+            LogPrint("masternode","mnb - Input must have at least %d confirmations\n", MASTERNODE_MIN_CONFIRMATIONS);
+            // maybe we miss few blocks, let this mnb to be checked again later
+            mnodeman.EraseSeenBroadcast(GetHash());
+            masternodeSync.mapSeenSyncMNB.erase(GetHash());
+            return false;
+        }
 
-    // verify that sig time is legit in past
-    // should be at least not earlier than block when 1000 BAS tx got MASTERNODE_MIN_CONFIRMATIONS
-    uint256 hashBlock = 0;
-    CTransaction tx2;
-    GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-    if (mi != mapBlockIndex.end() && (*mi).second) {
-        CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 1000 BaaS tx -> 1 confirmation
-        CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+        // verify that sig time is legit in past
+        // should be at least not earlier than block when 1000 BAS tx got MASTERNODE_MIN_CONFIRMATIONS
+        CBlockIndex* pConfIndex = chainActive[nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
         if (pConfIndex->GetBlockTime() > sigTime) {
             LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
                 sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
@@ -711,7 +695,7 @@ bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     std::string strMasterNodeSignMessage;
 
     sigTime = GetAdjustedTime();
-    std::string strMessage = vin.ToString() + blockHash.ToString() + std::to_string(sigTime);
+    std::string strMessage = GetStrMessage();
 
     if (!masternodeSigner.SignMessage(strMessage, errorMessage, vchSig, keyMasternode)) {
         LogPrint("masternode","CMasternodePing::Sign() - Error: %s\n", errorMessage);
@@ -726,9 +710,14 @@ bool CMasternodePing::Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode)
     return true;
 }
 
+std::string CMasternodePing::GetStrMessage() const
+{
+    return vin.ToString() + blockHash.ToString() + std::to_string(sigTime);
+}
+
 bool CMasternodePing::VerifySignature(CPubKey& pubKeyMasternode, int &nDos)
 {
-    std::string strMessage = vin.ToString() + blockHash.ToString() + std::to_string(sigTime);
+    std::string strMessage = GetStrMessage();
 	std::string errorMessage = "";
 
 	if(!masternodeSigner.VerifyMessage(pubKeyMasternode, vchSig, strMessage, errorMessage)){
@@ -31,6 +31,11 @@ class CMasternodePing;
 extern map<int64_t, uint256> mapCacheBlockHashes;
 
 bool GetBlockHash(uint256& hash, int nBlockHeight);
+/** CMasternode::CalculateScore of many masternodes for the same block, the block's own hash is hashed once */
+void CalculateMasternodeScores(const uint256& hashBlock, const std::vector<CMasternode*>& vpmn, std::vector<uint256>& vScore);
+/** Whether a collateral is unspent on chain and in the mempool, big enough and not locked, and the height it confirmed at
+    (MEMPOOL_HEIGHT if it didn't). Requires cs_main. */
+bool GetCollateralHeight(const COutPoint& outpoint, int& nHeight);
 
 
 //
@@ -63,6 +68,7 @@ public:
     bool CheckAndUpdate(int& nDos, bool fRequireEnabled = true, bool fCheckSigTimeOnly = false);
     bool Sign(CKey& keyMasternode, CPubKey& pubKeyMasternode);
     bool VerifySignature(CPubKey& pubKeyMasternode, int &nDos);
+    std::string GetStrMessage() const;
     void Relay();
 
     uint256 GetHash()
@@ -219,7 +225,8 @@ public:
         READWRITE(nLastScanningErrorBlockHeight);
     }
 
-    int64_t SecondsSincePayment();
+    /// nDepth: how many blocks back a payment counts, see GetLastPaid
+    int64_t SecondsSincePayment(int nDepth);
 
     bool UpdateFromNewBroadcast(CMasternodeBroadcast& mnb);
 
@@ -282,7 +289,9 @@ public:
         return strStatus;
     }
 
+    /// Time of the last block paying this masternode, looking back CountEnabled() * 1.25 blocks or nDepth blocks
     int64_t GetLastPaid();
+    int64_t GetLastPaid(int nDepth);
     bool IsValidNetAddr();
 };
 
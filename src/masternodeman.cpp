@@ -17,27 +17,22 @@
 /** Masternode manager */
 CMasternodeMan mnodeman;
 
+// high to low
 struct CompareLastPaid {
     bool operator()(const pair<int64_t, CTxIn>& t1,
         const pair<int64_t, CTxIn>& t2) const
     {
-        return t1.first < t2.first;
-    }
-};
-
-struct CompareScoreTxIn {
-    bool operator()(const pair<int64_t, CTxIn>& t1,
-        const pair<int64_t, CTxIn>& t2) const
-    {
-        return t1.first < t2.first;
+        return t1.first > t2.first;
     }
 };
 
+// high to low, equal scores by vin
 struct CompareScoreMN {
-    bool operator()(const pair<int64_t, CMasternode>& t1,
-        const pair<int64_t, CMasternode>& t2) const
+    bool operator()(const pair<int64_t, CMasternode*>& t1,
+        const pair<int64_t, CMasternode*>& t2) const
     {
-        return t1.first < t2.first;
+        if (t1.first != t2.first) return t1.first > t2.first;
+        return t1.second->vin.prevout < t2.second->vin.prevout;
     }
 };
 
@@ -195,6 +190,7 @@ void DumpMasternodes()
 CMasternodeMan::CMasternodeMan()
 {
     nDsqCount = 0;
+    hashListState = 0;
 }
 
 bool CMasternodeMan::Add(CMasternode& mn)
@@ -207,13 +203,179 @@ bool CMasternodeMan::Add(CMasternode& mn)
     CMasternode* pmn = Find(mn.vin);
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        IndexMasternode(listMasternodes.insert(listMasternodes.end(), mn));
+        mapScoreCache.clear();
         return true;
     }
 
     return false;
 }
 
+static uint256 GetPayeeKey(const CPubKey& pubKeyCollateralAddress)
+{
+    CScript payee = GetScriptForDestination(pubKeyCollateralAddress.GetID());
+    return Hash(payee.begin(), payee.end());
+}
+
+void CMasternodeMan::IndexMasternode(MasternodeIter it)
+{
+    const COutPoint& outpoint = it->vin.prevout;
+    mapMasternodeVins[outpoint] = it;
+    mapMasternodePayees[GetPayeeKey(it->pubKeyCollateralAddress)].insert(outpoint);
+    mapMasternodePubKeys[it->pubKeyMasternode.GetHash()].insert(outpoint);
+    mapMasternodeAddrs[(CNetAddr)it->addr].insert(outpoint);
+    ToggleListState(*it);
+}
+
+static bool EraseFromIndex(boost::unordered_map<uint256, std::set<COutPoint>, CCoinsKeyHasher>& index, const uint256& key, const COutPoint& outpoint)
+{
+    boost::unordered_map<uint256, std::set<COutPoint>, CCoinsKeyHasher>::iterator it = index.find(key);
+    if (it == index.end()) return false;
+    bool fErased = it->second.erase(outpoint) > 0;
+    if (it->second.empty()) index.erase(it);
+    return fErased;
+}
+
+void CMasternodeMan::UnindexMasternode(const CMasternode& mn)
+{
+    const COutPoint& outpoint = mn.vin.prevout;
+    // an entry being updated is unindexed already, it must not be taken out of the list state twice
+    bool fIndexed = EraseFromIndex(mapMasternodePayees, GetPayeeKey(mn.pubKeyCollateralAddress), outpoint);
+    EraseFromIndex(mapMasternodePubKeys, mn.pubKeyMasternode.GetHash(), outpoint);
+    std::map<CNetAddr, std::set<COutPoint> >::iterator it = mapMasternodeAddrs.find((CNetAddr)mn.addr);
+    if (it != mapMasternodeAddrs.end()) {
+        it->second.erase(outpoint);
+        if (it->second.empty()) mapMasternodeAddrs.erase(it);
+    }
+    if (fIndexed) ToggleListState(mn);
+}
+
+void CMasternodeMan::ToggleListState(const CMasternode& mn)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << mn.vin.prevout;
+    ss << mn.sigTime;
+    ss << mn.pubKeyCollateralAddress;
+    hashListState ^= ss.GetHash();
+
+    dequeListChanges.push_back(make_pair(hashListState, mn.vin.prevout));
+    if (dequeListChanges.size() > MASTERNODES_LIST_CHANGES)
+        dequeListChanges.pop_front();
+}
+
+uint256 CMasternodeMan::GetListState()
+{
+    LOCK(cs);
+    return hashListState;
+}
+
+bool CMasternodeMan::GetListChanges(const uint256& hashStateFrom, std::vector<CMasternode*>& vpmn)
+{
+    LOCK(cs);
+
+    vpmn.clear();
+    if (hashStateFrom == hashListState) return false;
+
+    // the vins changed after the last time the list was in that state
+    std::set<COutPoint> setChanged;
+    std::deque<std::pair<uint256, COutPoint> >::reverse_iterator it;
+    for (it = dequeListChanges.rbegin(); it != dequeListChanges.rend(); ++it) {
+        if (it->first == hashStateFrom) break;
+        setChanged.insert(it->second);
+    }
+    if (it != dequeListChanges.rend()) {
+        BOOST_FOREACH (const COutPoint& outpoint, setChanged) {
+            CMasternode* pmn = Find(CTxIn(outpoint));
+            if (pmn) vpmn.push_back(pmn);
+        }
+        return false;
+    }
+
+    BOOST_FOREACH (CMasternode& mn, listMasternodes)
+        vpmn.push_back(&mn);
+    return true;
+}
+
+void CMasternodeMan::EraseMasternode(MasternodeIter it)
+{
+    const COutPoint outpoint = it->vin.prevout;
+
+    //erase all of the broadcasts and pings we've seen from this vin
+    // -- if we missed a few pings and the node was removed, this will allow is to get it back without them
+    //    sending a brand new mnb
+    std::map<COutPoint, std::set<uint256> >::iterator itSeen = mapSeenBroadcastsByVin.find(outpoint);
+    if (itSeen != mapSeenBroadcastsByVin.end()) {
+        BOOST_FOREACH (const uint256& hash, itSeen->second) {
+            masternodeSync.mapSeenSyncMNB.erase(hash);
+            mapSeenMasternodeBroadcast.erase(hash);
+        }
+        mapSeenBroadcastsByVin.erase(itSeen);
+    }
+    itSeen = mapSeenPingsByVin.find(outpoint);
+    if (itSeen != mapSeenPingsByVin.end()) {
+        BOOST_FOREACH (const uint256& hash, itSeen->second)
+            mapSeenMasternodePing.erase(hash);
+        mapSeenPingsByVin.erase(itSeen);
+    }
+
+    // allow us to ask for this masternode again if we see another ping
+    mWeAskedForMasternodeListEntry.erase(outpoint);
+
+    UnindexMasternode(*it);
+    mapMasternodeVins.erase(outpoint);
+    listMasternodes.erase(it);
+    mapScoreCache.clear();
+}
+
+void CMasternodeMan::RebuildIndexes()
+{
+    mapScoreCache.clear();
+    mapMasternodeVins.clear();
+    mapMasternodePayees.clear();
+    mapMasternodePubKeys.clear();
+    mapMasternodeAddrs.clear();
+    hashListState = 0;
+    for (MasternodeIter it = listMasternodes.begin(); it != listMasternodes.end(); ++it)
+        IndexMasternode(it);
+    dequeListChanges.clear();
+
+    mapSeenBroadcastsByVin.clear();
+    for (map<uint256, CMasternodeBroadcast>::iterator it = mapSeenMasternodeBroadcast.begin(); it != mapSeenMasternodeBroadcast.end(); ++it)
+        mapSeenBroadcastsByVin[it->second.vin.prevout].insert(it->first);
+    mapSeenPingsByVin.clear();
+    for (map<uint256, CMasternodePing>::iterator it = mapSeenMasternodePing.begin(); it != mapSeenMasternodePing.end(); ++it)
+        mapSeenPingsByVin[it->second.vin.prevout].insert(it->first);
+}
+
+void CMasternodeMan::AddSeenBroadcast(CMasternodeBroadcast& mnb)
+{
+    LOCK(cs);
+    uint256 hash = mnb.GetHash();
+    if (mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb)).second)
+        mapSeenBroadcastsByVin[mnb.vin.prevout].insert(hash);
+}
+
+void CMasternodeMan::AddSeenPing(CMasternodePing& mnp)
+{
+    LOCK(cs);
+    uint256 hash = mnp.GetHash();
+    if (mapSeenMasternodePing.insert(make_pair(hash, mnp)).second)
+        mapSeenPingsByVin[mnp.vin.prevout].insert(hash);
+}
+
+void CMasternodeMan::EraseSeenBroadcast(const uint256& hash)
+{
+    LOCK(cs);
+    map<uint256, CMasternodeBroadcast>::iterator it = mapSeenMasternodeBroadcast.find(hash);
+    if (it == mapSeenMasternodeBroadcast.end()) return;
+    std::map<COutPoint, std::set<uint256> >::iterator itVin = mapSeenBroadcastsByVin.find(it->second.vin.prevout);
+    if (itVin != mapSeenBroadcastsByVin.end()) {
+        itVin->second.erase(hash);
+        if (itVin->second.empty()) mapSeenBroadcastsByVin.erase(itVin);
+    }
+    mapSeenMasternodeBroadcast.erase(it);
+}
+
 void CMasternodeMan::AskForMN(CNode* pnode, CTxIn& vin)
 {
     std::map<COutPoint, int64_t>::iterator i = mWeAskedForMasternodeListEntry.find(vin.prevout);
@@ -234,11 +396,66 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
     }
 }
 
+void CMasternodeMan::CheckCollaterals(const std::vector<COutPoint>& vOutpoints)
+{
+    AssertLockHeld(cs_main);
+
+    BOOST_FOREACH (const COutPoint& outpoint, vOutpoints) {
+        int nHeight;
+        if (GetCollateralHeight(outpoint, nHeight)) continue;
+
+        LOCK(cs);
+        CMasternode* pmn = Find(CTxIn(outpoint));
+        if (pmn && pmn->activeState != CMasternode::MASTERNODE_VIN_SPENT) {
+            LogPrint("masternode", "CMasternodeMan: Collateral of Masternode %s is spent\n", outpoint.ToString());
+            pmn->activeState = CMasternode::MASTERNODE_VIN_SPENT;
+        }
+    }
+}
+
+void CMasternodeMan::CheckCollaterals()
+{
+    std::vector<COutPoint> vOutpoints;
+    {
+        LOCK(cs);
+        vOutpoints.reserve(listMasternodes.size());
+        BOOST_FOREACH (CMasternode& mn, listMasternodes)
+            vOutpoints.push_back(mn.vin.prevout);
+    }
+    CheckCollaterals(vOutpoints);
+}
+
+void CMasternodeMan::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    std::vector<COutPoint> vOutpoints;
+    {
+        LOCK(cs);
+        if (mapMasternodeVins.empty()) return;
+
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+                if (mapMasternodeVins.count(txin.prevout))
+                    vOutpoints.push_back(txin.prevout);
+            }
+        }
+        // a collateral's own transaction only comes without a block when it's new or disconnected
+        if (pblock == NULL) {
+            uint256 hash = tx.GetHash();
+            for (unsigned int i = 0; i < tx.vout.size(); i++) {
+                if (mapMasternodeVins.count(COutPoint(hash, i)))
+                    vOutpoints.push_back(COutPoint(hash, i));
+            }
+        }
+    }
+    if (!vOutpoints.empty())
+        CheckCollaterals(vOutpoints);
+}
+
 void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 {
     Check();
@@ -246,38 +463,14 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    MasternodeIter it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
             (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
             (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
             (*it).protocolVersion < masternodePayments.GetMinMasternodePaymentsProto()) {
             LogPrint("masternode", "CMasternodeMan: Removing inactive Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-
-            //erase all of the broadcasts we've seen from this vin
-            // -- if we missed a few pings and the node was removed, this will allow is to get it back without them
-            //    sending a brand new mnb
-            map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
-            while (it3 != mapSeenMasternodeBroadcast.end()) {
-                if ((*it3).second.vin == (*it).vin) {
-                    masternodeSync.mapSeenSyncMNB.erase((*it3).first);
-                    mapSeenMasternodeBroadcast.erase(it3++);
-                } else {
-                    ++it3;
-                }
-            }
-
-            // allow us to ask for this masternode again if we see another ping
-            map<COutPoint, int64_t>::iterator it2 = mWeAskedForMasternodeListEntry.begin();
-            while (it2 != mWeAskedForMasternodeListEntry.end()) {
-                if ((*it2).first == (*it).vin.prevout) {
-                    mWeAskedForMasternodeListEntry.erase(it2++);
-                } else {
-                    ++it2;
-                }
-            }
-
-            it = vMasternodes.erase(it);
+            EraseMasternode(it++);
         } else {
             ++it;
         }
@@ -317,8 +510,9 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     map<uint256, CMasternodeBroadcast>::iterator it3 = mapSeenMasternodeBroadcast.begin();
     while (it3 != mapSeenMasternodeBroadcast.end()) {
         if ((*it3).second.lastPing.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
-            mapSeenMasternodeBroadcast.erase(it3++);
-            masternodeSync.mapSeenSyncMNB.erase((*it3).second.GetHash());
+            uint256 hash = (*it3++).first;
+            masternodeSync.mapSeenSyncMNB.erase(hash);
+            EraseSeenBroadcast(hash);
         } else {
             ++it3;
         }
@@ -328,6 +522,11 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     map<uint256, CMasternodePing>::iterator it4 = mapSeenMasternodePing.begin();
     while (it4 != mapSeenMasternodePing.end()) {
         if ((*it4).second.sigTime < GetTime() - (MASTERNODE_REMOVAL_SECONDS * 2)) {
+            std::map<COutPoint, std::set<uint256> >::iterator itVin = mapSeenPingsByVin.find((*it4).second.vin.prevout);
+            if (itVin != mapSeenPingsByVin.end()) {
+                itVin->second.erase((*it4).first);
+                if (itVin->second.empty()) mapSeenPingsByVin.erase(itVin);
+            }
             mapSeenMasternodePing.erase(it4++);
         } else {
             ++it4;
@@ -338,12 +537,21 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    listMasternodes.clear();
+    mapScoreCache.clear();
+    mapMasternodeVins.clear();
+    mapMasternodePayees.clear();
+    mapMasternodePubKeys.clear();
+    mapMasternodeAddrs.clear();
+    hashListState = 0;
+    dequeListChanges.clear();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
     mapSeenMasternodeBroadcast.clear();
     mapSeenMasternodePing.clear();
+    mapSeenBroadcastsByVin.clear();
+    mapSeenPingsByVin.clear();
     nDsqCount = 0;
 }
 
@@ -352,7 +560,7 @@ int CMasternodeMan::stable_size ()
     int nStable_size = 0;
     int nMinProtocol = ActiveProtocol();
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
@@ -371,7 +579,7 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -384,7 +592,7 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         std::string strHost;
         int port;
@@ -421,45 +629,54 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
         }
     }
 
-    pnode->PushMessage("dseg", CTxIn());
+    // peers that know list states only send what changed since ours
+    if (pnode->nVersion >= MNLIST_DIFF_VERSION)
+        pnode->PushMessage("getmnlist", hashListState);
+    else
+        pnode->PushMessage("dseg", CTxIn());
     int64_t askAgain = GetTime() + MASTERNODES_DSEG_SECONDS;
     mWeAskedForMasternodeList[pnode->addr] = askAgain;
 }
 
+CMasternode* CMasternodeMan::FindInIndex(const MasternodeKeyIndex& index, const uint256& key)
+{
+    MasternodeKeyIndex::const_iterator it = index.find(key);
+    if (it == index.end() || it->second.empty())
+        return NULL;
+    return &*mapMasternodeVins[*it->second.begin()];
+}
+
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
-
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
-    }
-    return NULL;
+    return FindInIndex(mapMasternodePayees, Hash(payee.begin(), payee.end()));
 }
 
 CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_map<COutPoint, MasternodeIter, COutPointHasher>::iterator it = mapMasternodeVins.find(vin.prevout);
+    if (it == mapMasternodeVins.end())
+        return NULL;
+    return &*it->second;
 }
 
 
 CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
+    return FindInIndex(mapMasternodePubKeys, pubKeyMasternode.GetHash());
+}
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
-    }
-    return NULL;
+CMasternode* CMasternodeMan::Find(const CNetAddr& addr)
+{
+    LOCK(cs);
+
+    std::map<CNetAddr, std::set<COutPoint> >::iterator it = mapMasternodeAddrs.find(addr);
+    if (it == mapMasternodeAddrs.end() || it->second.empty())
+        return NULL;
+    return &*mapMasternodeVins[*it->second.begin()];
 }
 
 //
@@ -477,7 +694,9 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // how far back a payment counts, the same for every masternode
+    int nPaidDepth = nMnCount * 1.25;
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (!mn.IsEnabled()) continue;
 
@@ -493,7 +712,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nPaidDepth), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -501,27 +720,35 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     //when the network is in the process of upgrading, don't penalize nodes that recently restarted
     if (fFilterSigTime && nCount < nMnCount / 3) return GetNextMasternodeInQueueForPayment(nBlockHeight, false, nCount);
 
-    // Sort them high to low
-    sort(vecMasternodeLastPaid.rbegin(), vecMasternodeLastPaid.rend(), CompareLastPaid());
-
     // Look at 1/10 of the oldest nodes (by last payment), calculate their scores and pay the best one
     //  -- This doesn't look at who is being paid in the +8-10 blocks, allowing for double payments very rarely
     //  -- 1/100 payments should be a double payment on mainnet - (1/(3000/10))*2
     //  -- (chance per block * chances before IsScheduled will fire)
-    int nTenthNetwork = CountEnabled() / 10;
-    int nCountTenth = 0;
-    uint256 nHigh = 0;
+    int nTenthNetwork = nMnCount / 10;
+
+    // Sort them high to low, only as far as the loop below looks (at least one)
+    int nSorted = std::min(std::max(nTenthNetwork, 1), nCount);
+    partial_sort(vecMasternodeLastPaid.begin(), vecMasternodeLastPaid.begin() + nSorted, vecMasternodeLastPaid.end(), CompareLastPaid());
+    std::vector<CMasternode*> vpmnTenth;
     BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeLastPaid) {
         CMasternode* pmn = Find(s.second);
         if (!pmn) break;
 
-        uint256 n = pmn->CalculateScore(1, nBlockHeight - 100);
-        if (n > nHigh) {
-            nHigh = n;
-            pBestMasternode = pmn;
+        vpmnTenth.push_back(pmn);
+        if ((int)vpmnTenth.size() >= nTenthNetwork) break;
+    }
+
+    uint256 hash = 0;
+    if (chainActive.Tip() == NULL || !GetBlockHash(hash, nBlockHeight - 100)) return NULL;
+    std::vector<uint256> vScore;
+    CalculateMasternodeScores(hash, vpmnTenth, vScore);
+
+    uint256 nHigh = 0;
+    for (size_t i = 0; i < vpmnTenth.size(); i++) {
+        if (vScore[i] > nHigh) {
+            nHigh = vScore[i];
+            pBestMasternode = vpmnTenth[i];
         }
-        nCountTenth++;
-        if (nCountTenth >= nTenthNetwork) break;
     }
     return pBestMasternode;
 }
@@ -540,7 +767,7 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -558,40 +785,70 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     return NULL;
 }
 
+const CMasternodeMan::MasternodeScores* CMasternodeMan::GetScores(int64_t nBlockHeight)
+{
+    AssertLockHeld(cs);
+
+    uint256 hash = 0;
+    if (chainActive.Tip() == NULL || !GetBlockHash(hash, nBlockHeight)) return NULL;
+    if (nBlockHeight == 0) nBlockHeight = chainActive.Tip()->nHeight;
+
+    std::map<int64_t, std::pair<uint256, MasternodeScores> >::iterator it = mapScoreCache.find(nBlockHeight);
+    if (it != mapScoreCache.end() && it->second.first == hash) return &it->second.second;
+
+    std::vector<CMasternode*> vpmn;
+    vpmn.reserve(listMasternodes.size());
+    BOOST_FOREACH (CMasternode& mn, listMasternodes)
+        vpmn.push_back(&mn);
+    std::vector<uint256> vScore;
+    CalculateMasternodeScores(hash, vpmn, vScore);
+
+    if (it == mapScoreCache.end()) {
+        if (mapScoreCache.size() >= MASTERNODES_SCORE_CACHE_HEIGHTS)
+            mapScoreCache.erase(mapScoreCache.begin());
+        it = mapScoreCache.insert(make_pair(nBlockHeight, make_pair(hash, MasternodeScores()))).first;
+    }
+    it->second.first = hash;
+    MasternodeScores& vScores = it->second.second;
+    vScores.clear();
+    vScores.reserve(vpmn.size());
+    for (size_t i = 0; i < vpmn.size(); i++)
+        vScores.push_back(make_pair(vScore[i].GetCompact(false), vpmn[i]));
+    sort(vScores.begin(), vScores.end(), CompareScoreMN());
+
+    return &vScores;
+}
+
 CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight, int minProtocol)
 {
-    int64_t score = 0;
-    CMasternode* winner = NULL;
+    LOCK(cs);
+
+    const MasternodeScores* pScores = GetScores(nBlockHeight);
+    if (pScores == NULL) return NULL;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // the highest scoring enabled one
+    BOOST_FOREACH (const PAIRTYPE(int64_t, CMasternode*) & s, *pScores) {
+        CMasternode& mn = *s.second;
         mn.Check();
         if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
-
-        // calculate the score for each Masternode
-        uint256 n = mn.CalculateScore(mod, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        // determine the winner
-        if (n2 > score) {
-            score = n2;
-            winner = &mn;
-        }
+        if (s.first <= 0) break;
+        return &mn;
     }
 
-    return winner;
+    return NULL;
 }
 
 int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
     //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    const MasternodeScores* pScores = GetScores(nBlockHeight);
+    if (pScores == NULL) return -1;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, CMasternode*) & s, *pScores) {
+        CMasternode& mn = *s.second;
         if (mn.protocolVersion < minProtocol) {
             LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
@@ -601,18 +858,9 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
-        if (s.second.prevout == vin.prevout) {
+        if (mn.vin.prevout == vin.prevout) {
             return rank;
         }
     }
@@ -622,36 +870,34 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
 {
-    std::vector<pair<int64_t, CMasternode> > vecMasternodeScores;
     std::vector<pair<int, CMasternode> > vecMasternodeRanks;
 
+    LOCK(cs);
+
     //make sure we know about this block
-    uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
+    const MasternodeScores* pScores = GetScores(nBlockHeight);
+    if (pScores == NULL) return vecMasternodeRanks;
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    // enabled ones by score, then the others
+    std::vector<CMasternode*> vpmnNotEnabled;
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, CMasternode*) & s, *pScores) {
+        CMasternode& mn = *s.second;
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
 
         if (!mn.IsEnabled()) {
-            vecMasternodeScores.push_back(make_pair(9999, mn));
+            vpmnNotEnabled.push_back(&mn);
             continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn));
+        rank++;
+        vecMasternodeRanks.push_back(make_pair(rank, mn));
     }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreMN());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CMasternode) & s, vecMasternodeScores) {
+    BOOST_FOREACH (CMasternode* pmn, vpmnNotEnabled) {
         rank++;
-        vecMasternodeRanks.push_back(make_pair(rank, s.second));
+        vecMasternodeRanks.push_back(make_pair(rank, *pmn));
     }
 
     return vecMasternodeRanks;
@@ -659,29 +905,23 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    LOCK(cs);
 
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    const MasternodeScores* pScores = GetScores(nBlockHeight);
+    if (pScores == NULL) return NULL;
+
+    int rank = 0;
+    BOOST_FOREACH (const PAIRTYPE(int64_t, CMasternode*) & s, *pScores) {
+        CMasternode& mn = *s.second;
         if (mn.protocolVersion < minProtocol) continue;
         if (fOnlyActive) {
             mn.Check();
             if (!mn.IsEnabled()) continue;
         }
 
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
-
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
-
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
         rank++;
         if (rank == nRank) {
-            return Find(s.second);
+            return &mn;
         }
     }
 
@@ -699,11 +939,15 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         CMasternodeBroadcast mnb;
         vRecv >> mnb;
 
+        // The sender has it, never announce it back
+        pfrom->AddInventoryKnown(CInv(MSG_MASTERNODE_ANNOUNCE, mnb.GetHash()));
+        masternodeSync.setPendingSyncMNB.erase(mnb.GetHash());
+
         if (mapSeenMasternodeBroadcast.count(mnb.GetHash())) { //seen
             masternodeSync.AddedMasternodeList(mnb.GetHash());
             return;
         }
-        mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
+        AddSeenBroadcast(mnb);
 
         int nDoS = 0;
         if (!mnb.CheckAndUpdate(nDoS)) {
@@ -740,10 +984,12 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         CMasternodePing mnp;
         vRecv >> mnp;
 
+        pfrom->AddInventoryKnown(CInv(MSG_MASTERNODE_PING, mnp.GetHash()));
+
         LogPrint("masternode", "mnp - Masternode ping, vin: %s\n", mnp.vin.prevout.hash.ToString());
 
         if (mapSeenMasternodePing.count(mnp.GetHash())) return; //seen
-        mapSeenMasternodePing.insert(make_pair(mnp.GetHash(), mnp));
+        AddSeenPing(mnp);
 
         int nDoS = 0;
         if (mnp.CheckAndUpdate(nDoS)) return;
@@ -787,33 +1033,101 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
         } //else, asking for a specific node which is ok
 
 
+        if (vin != CTxIn()) {
+            CMasternode* pmn = Find(vin);
+            if (pmn == NULL || pmn->vin != vin || pmn->addr.IsRFC1918() || !pmn->IsEnabled()) return;
+
+            LogPrint("masternode", "dseg - Sending Masternode entry - %s \n", pmn->vin.prevout.hash.ToString());
+            CMasternodeBroadcast mnb = CMasternodeBroadcast(*pmn);
+            pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, mnb.GetHash()));
+            AddSeenBroadcast(mnb);
+            LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
+            return;
+        }
+
         int nInvCount = 0;
 
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH (CMasternode& mn, listMasternodes) {
             if (mn.addr.IsRFC1918()) continue; //local network
 
             if (mn.IsEnabled()) {
                 LogPrint("masternode", "dseg - Sending Masternode entry - %s \n", mn.vin.prevout.hash.ToString());
-                if (vin == CTxIn() || vin == mn.vin) {
-                    CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
-                    uint256 hash = mnb.GetHash();
-                    pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, hash));
-                    nInvCount++;
+                CMasternodeBroadcast mnb = CMasternodeBroadcast(mn);
+                pfrom->PushInventory(CInv(MSG_MASTERNODE_ANNOUNCE, mnb.GetHash()));
+                nInvCount++;
+
+                AddSeenBroadcast(mnb);
+            }
+        }
 
-                    if (!mapSeenMasternodeBroadcast.count(hash)) mapSeenMasternodeBroadcast.insert(make_pair(hash, mnb));
+        pfrom->PushMessage("ssc", MASTERNODE_SYNC_LIST, nInvCount);
+        LogPrint("masternode", "dseg - Sent %d Masternode entries to peer %i\n", nInvCount, pfrom->GetId());
 
-                    if (vin == mn.vin) {
-                        LogPrint("masternode", "dseg - Sent 1 Masternode entry to peer %i\n", pfrom->GetId());
-                        return;
-                    }
-                }
+    } else if (strCommand == "getmnlist") { //Get the Masternode list changes since a list state
+
+        uint256 hashStateFrom;
+        vRecv >> hashStateFrom;
+
+        LOCK(cs);
+
+        // as often as a full list, it may be one
+        bool isLocal = (pfrom->addr.IsRFC1918() || pfrom->addr.IsLocal());
+        if (!isLocal && Params().NetworkID() == CBaseChainParams::MAIN) {
+            std::map<CNetAddr, int64_t>::iterator i = mAskedUsForMasternodeList.find(pfrom->addr);
+            if (i != mAskedUsForMasternodeList.end() && GetTime() < i->second) {
+                LogPrintf("CMasternodeMan::ProcessMessage() : getmnlist - peer already asked me for the list\n");
+                Misbehaving(pfrom->GetId(), 34);
+                return;
             }
+            mAskedUsForMasternodeList[pfrom->addr] = GetTime() + MASTERNODES_DSEG_SECONDS;
+        }
+
+        std::vector<CMasternode*> vpmn;
+        bool fFull = GetListChanges(hashStateFrom, vpmn);
+
+        std::vector<uint256> vHash;
+        BOOST_FOREACH (CMasternode* pmn, vpmn) {
+            if (pmn->addr.IsRFC1918() || !pmn->IsEnabled()) continue;
+            CMasternodeBroadcast mnb = CMasternodeBroadcast(*pmn);
+            vHash.push_back(mnb.GetHash());
+            AddSeenBroadcast(mnb);
         }
 
-        if (vin == CTxIn()) {
-            pfrom->PushMessage("ssc", MASTERNODE_SYNC_LIST, nInvCount);
-            LogPrint("masternode", "dseg - Sent %d Masternode entries to peer %i\n", nInvCount, pfrom->GetId());
+        pfrom->PushMessage("mnlistdiff", hashStateFrom, hashListState, vHash);
+        LogPrint("masternode", "getmnlist - Sent %d %s Masternode entries to peer %i\n", vHash.size(), fFull ? "(all)" : "changed", pfrom->GetId());
+
+    } else if (strCommand == "mnlistdiff") { //Masternode list changes since the state we sent
+
+        uint256 hashStateFrom, hashState;
+        std::vector<uint256> vHash;
+        vRecv >> hashStateFrom >> hashState >> vHash;
+
+        if (!mWeAskedForMasternodeList.count(pfrom->addr)) {
+            LogPrint("masternode", "mnlistdiff - unrequested diff from peer %i\n", pfrom->GetId());
+            Misbehaving(pfrom->GetId(), 20);
+            return;
         }
+        if (vHash.size() > MAX_INV_SZ) {
+            Misbehaving(pfrom->GetId(), 20);
+            return;
+        }
+
+        // Broadcasts we know are not asked for (nor checked) again
+        std::vector<uint256> vPending;
+        BOOST_FOREACH (const uint256& hash, vHash) {
+            CInv inv(MSG_MASTERNODE_ANNOUNCE, hash);
+            pfrom->AddInventoryKnown(inv);
+            if (mapSeenMasternodeBroadcast.count(hash)) {
+                masternodeSync.AddedMasternodeList(hash);
+                continue;
+            }
+            pfrom->AskFor(inv);
+            vPending.push_back(hash);
+        }
+        masternodeSync.AddedMasternodeListDiff(vPending);
+
+        LogPrint("masternode", "mnlistdiff - %d Masternode entries from peer %i, %d unknown, list %s\n", vHash.size(), pfrom->GetId(), vPending.size(),
+            hashStateFrom == hashState ? "unchanged" : "changed");
     }
 }
 
@@ -821,22 +1135,18 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
-        if ((*it).vin == vin) {
-            LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-            vMasternodes.erase(it);
-            break;
-        }
-        ++it;
+    boost::unordered_map<COutPoint, MasternodeIter, COutPointHasher>::iterator it = mapMasternodeVins.find(vin.prevout);
+    if (it != mapMasternodeVins.end() && it->second->vin == vin) {
+        LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", vin.prevout.hash.ToString(), size() - 1);
+        EraseMasternode(it->second);
     }
 }
 
 void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
 {
-	mapSeenMasternodePing.insert(make_pair(mnb.lastPing.GetHash(), mnb.lastPing));
-	mapSeenMasternodeBroadcast.insert(make_pair(mnb.GetHash(), mnb));
-	masternodeSync.AddedMasternodeList(mnb.GetHash());
+    AddSeenPing(mnb.lastPing);
+    AddSeenBroadcast(mnb);
+    masternodeSync.AddedMasternodeList(mnb.GetHash());
 
     LogPrint("masternode","CMasternodeMan::UpdateMasternodeList() -- masternode=%s\n", mnb.vin.prevout.ToString());
 
@@ -845,15 +1155,32 @@ void CMasternodeMan::UpdateMasternodeList(CMasternodeBroadcast mnb)
         CMasternode mn(mnb);
         Add(mn);
     } else {
-    	pmn->UpdateFromNewBroadcast(mnb);
+        UpdateFromNewBroadcast(*pmn, mnb);
     }
 }
 
+bool CMasternodeMan::UpdateFromNewBroadcast(CMasternode& mn, CMasternodeBroadcast& mnb)
+{
+    // cs is not held across the update itself, checking the new ping takes cs_main
+    {
+        LOCK(cs);
+        UnindexMasternode(mn);
+    }
+    bool fUpdated = mn.UpdateFromNewBroadcast(mnb);
+
+    LOCK(cs);
+    // the entry may have been removed meanwhile
+    boost::unordered_map<COutPoint, MasternodeIter, COutPointHasher>::iterator it = mapMasternodeVins.find(mn.vin.prevout);
+    if (it != mapMasternodeVins.end() && &*it->second == &mn)
+        IndexMasternode(it->second);
+    return fUpdated;
+}
+
 std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
+    info << "Masternodes: " << (int)listMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size() << ", nDsqCount: " << (int)nDsqCount;
 
     return info.str();
 }
@@ -14,9 +14,17 @@
 #include "net.h"
 #include "sync.h"
 #include "util.h"
+#include "validationinterface.h"
+
+#include <deque>
+#include <list>
+
+#include <boost/unordered_map.hpp>
 
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODES_SCORE_CACHE_HEIGHTS 24
+#define MASTERNODES_LIST_CHANGES 5000
 
 using namespace std;
 
@@ -49,7 +57,7 @@ public:
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
 };
 
-class CMasternodeMan
+class CMasternodeMan : public CValidationInterface
 {
 private:
     // critical section to protect the inner data structures
@@ -58,8 +66,29 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    typedef std::list<CMasternode>::iterator MasternodeIter;
+    typedef boost::unordered_map<uint256, std::set<COutPoint>, CCoinsKeyHasher> MasternodeKeyIndex;
+
+    // list to hold all MNs, in the order they were added; entries don't move until removed
+    std::list<CMasternode> listMasternodes;
+    // indexes into listMasternodes, by collateral outpoint, by hash of the payee script,
+    // by hash of pubKeyMasternode and by address (ignoring the port). Several entries may
+    // share a key, the lowest outpoint is returned then.
+    boost::unordered_map<COutPoint, MasternodeIter, COutPointHasher> mapMasternodeVins;
+    MasternodeKeyIndex mapMasternodePayees;
+    MasternodeKeyIndex mapMasternodePubKeys;
+    std::map<CNetAddr, std::set<COutPoint> > mapMasternodeAddrs;
+    // scores of all MNs per block height, high to low, with the hash of the block they were calculated for.
+    // They point into listMasternodes and are dropped whenever an entry is added or removed.
+    typedef std::vector<std::pair<int64_t, CMasternode*> > MasternodeScores;
+    std::map<int64_t, std::pair<uint256, MasternodeScores> > mapScoreCache;
+    // the list state: the XOR of the hashes of all entries' vin and broadcast, equal for equal lists.
+    // The last changes to the list are kept with the state after each, for telling peers what changed since theirs.
+    uint256 hashListState;
+    std::deque<std::pair<uint256, COutPoint> > dequeListChanges;
+    // hashes of the broadcasts and pings in mapSeenMasternodeBroadcast/Ping, by vin
+    std::map<COutPoint, std::set<uint256> > mapSeenBroadcastsByVin;
+    std::map<COutPoint, std::set<uint256> > mapSeenPingsByVin;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
@@ -67,6 +96,24 @@ private:
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
 
+    void IndexMasternode(MasternodeIter it);
+    void UnindexMasternode(const CMasternode& mn);
+    /// Add or take away an entry from the list state
+    void ToggleListState(const CMasternode& mn);
+    CMasternode* FindInIndex(const MasternodeKeyIndex& index, const uint256& key);
+    /// Erase an entry and everything seen from its vin
+    void EraseMasternode(MasternodeIter it);
+    void RebuildIndexes();
+    /// Scores of all MNs for a block, NULL if the block is unknown
+    const MasternodeScores* GetScores(int64_t nBlockHeight);
+    /// Mark the MNs with one of these collaterals spent if it's gone from the coins view, requires cs_main
+    void CheckCollaterals(const std::vector<COutPoint>& vOutpoints);
+
+protected:
+    // Collaterals are spent by transactions entering the mempool or a connected block,
+    // and taken away by disconnecting the block they confirmed in
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
+
 public:
     // Keep track of all broadcasts I've seen
     map<uint256, CMasternodeBroadcast> mapSeenMasternodeBroadcast;
@@ -82,6 +129,10 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
         LOCK(cs);
+        // stored as a vector, the indexes are rebuilt on load
+        std::vector<CMasternode> vMasternodes;
+        if (!ser_action.ForRead())
+            vMasternodes.assign(listMasternodes.begin(), listMasternodes.end());
         READWRITE(vMasternodes);
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
@@ -90,6 +141,10 @@ public:
 
         READWRITE(mapSeenMasternodeBroadcast);
         READWRITE(mapSeenMasternodePing);
+        if (ser_action.ForRead()) {
+            listMasternodes.assign(vMasternodes.begin(), vMasternodes.end());
+            RebuildIndexes();
+        }
     }
 
     CMasternodeMan();
@@ -98,12 +153,20 @@ public:
     /// Add an entry
     bool Add(CMasternode& mn);
 
+    /// Keep track of a broadcast or ping we've seen
+    void AddSeenBroadcast(CMasternodeBroadcast& mnb);
+    void AddSeenPing(CMasternodePing& mnp);
+    void EraseSeenBroadcast(const uint256& hash);
+
     /// Ask (source) node for mnb
     void AskForMN(CNode* pnode, CTxIn& vin);
 
     /// Check all Masternodes
     void Check();
 
+    /// Mark all MNs whose collateral is spent, for what happened before SyncTransaction was listened to
+    void CheckCollaterals();
+
     /// Check all Masternodes and remove inactive
     void CheckAndRemove(bool forceExpiredRemoval = false);
 
@@ -116,10 +179,17 @@ public:
 
     void DsegUpdate(CNode* pnode);
 
+    /// The list state peers send their changes against
+    uint256 GetListState();
+    /// Entries that changed since a list state, all of them if it's too old or unknown (returns true then)
+    bool GetListChanges(const uint256& hashStateFrom, std::vector<CMasternode*>& vpmn);
+
     /// Find an entry
     CMasternode* Find(const CScript& payee);
     CMasternode* Find(const CTxIn& vin);
     CMasternode* Find(const CPubKey& pubKeyMasternode);
+    /// Find an entry running on this IP, whatever the port
+    CMasternode* Find(const CNetAddr& addr);
 
     /// Find an entry in the masternode list that is next to be paid
     CMasternode* GetNextMasternodeInQueueForPayment(int nBlockHeight, bool fFilterSigTime, int& nCount);
@@ -133,7 +203,8 @@ public:
     std::vector<CMasternode> GetFullMasternodeVector()
     {
         Check();
-        return vMasternodes;
+        LOCK(cs);
+        return std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end());
     }
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
@@ -143,7 +214,7 @@ public:
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return listMasternodes.size(); }
 
     /// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
@@ -156,6 +227,9 @@ public:
 
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
+
+    /// Update an entry from a newer broadcast, keeping the indexes in step with its keys
+    bool UpdateFromNewBroadcast(CMasternode& mn, CMasternodeBroadcast& mnb);
 };
 
 #endif
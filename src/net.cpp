@@ -15,6 +15,8 @@
 #include "addrman.h"
 #include "chainparams.h"
 #include "clientversion.h"
+#include "hash.h"
+#include "main.h"
 #include "miner.h"
 #include "obfuscation.h"
 #include "primitives/transaction.h"
@@ -25,10 +27,17 @@
 #include "wallet.h"
 #endif // ENABLE_WALLET
 
+#include <math.h>
+
 #ifdef WIN32
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -48,6 +57,13 @@
 #define MSG_NOSIGNAL 0
 #endif
 
+// Queued messages handed to a single sendmsg() call
+static const int MAX_SEND_IOV = 64;
+// Send buffers larger than this are freed rather than pooled
+static const size_t MAX_POOLED_SEND_BUFFER = 256 * 1024;
+// Total capacity kept in the send buffer pool
+static const size_t MAX_SEND_BUFFER_POOL = 4 * 1024 * 1024;
+
 // Fix for ancient MinGW versions, that don't have defined these in ws2tcpip.h.
 // Todo: Can be removed when our pull-tester is upgraded to a modern MinGW version.
 #ifdef WIN32
@@ -93,9 +109,10 @@ std::string strSubVersion;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CNetSendBufferRef> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
+CTxAnnounceQueue txAnnounceQueue;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
@@ -111,6 +128,7 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore* semOutbound = NULL;
+static void RegisterNodeSocket(CNode* pnode);
 boost::condition_variable messageHandlerCondition;
 
 // Signals for message handling
@@ -346,6 +364,10 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+int64_t CNode::nMaxOutboundCycleStartTime = 0;
+CNetMsgTypeCounters CNode::vMsgStatsTotal[NET_MESSAGE_TYPE_COUNT];
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -415,7 +437,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest)
     bool proxyConnectionFailed = false;
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed)) {
-        if (!IsSelectableSocket(hSocket)) {
+        if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -426,6 +448,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest)
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        RegisterNodeSocket(pnode);
 
         {
             LOCK(cs_vNodes);
@@ -699,15 +722,24 @@ void CNode::copyStats(CNodeStats& stats)
     // Raw ping time is in microseconds, but show it to user as whole seconds (BaaS users should be well used to small numbers with many decimal places by now :)
     stats.dPingTime = (((double)nPingUsecTime) / 1e6);
     stats.dPingWait = (((double)nPingUsecWait) / 1e6);
+    stats.dMinPing = nMinPingUsecTime == std::numeric_limits<int64_t>::max() ? 0 : (((double)nMinPingUsecTime) / 1e6);
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    const std::vector<std::string>& vTypes = GetAllNetMessageTypes();
+    for (unsigned int i = 0; i < NET_MESSAGE_TYPE_COUNT; i++) {
+        CNetMsgTypeStats msgStats = vMsgStats[i].Get();
+        if (!msgStats.IsNull())
+            stats.mapMsgStats[vTypes[i]] = msgStats;
+    }
 }
 #undef X
 
 // requires LOCK(cs_vRecvMsg)
-bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
+bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes, bool& fComplete)
 {
+    fComplete = false;
     while (nBytes > 0) {
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
@@ -736,7 +768,9 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            msg.nMsgType = GetNetMessageTypeIndex(msg.hdr.GetCommand());
+            RecordMsgRecv(msg.nMsgType, CMessageHeader::HEADER_SIZE + msg.hdr.nMessageSize);
+            fComplete = true;
         }
     }
 
@@ -790,26 +824,57 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
 }
 
 
-// requires LOCK(cs_vSend)
+/**
+ * Write as much of the send queue as the socket takes. Queued messages are handed
+ * to the kernel together with sendmsg(), straight from their (possibly shared) buffers.
+ * requires LOCK(cs_vSend)
+ */
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CNetSendBufferRef>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert((*it)->vch.size() > pnode->nSendOffset);
+        size_t nWant = 0;
+#ifdef WIN32
+        const std::vector<char>& data = (*it)->vch;
+        nWant = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nWant, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        struct iovec iov[MAX_SEND_IOV];
+        int nIov = 0;
+        for (std::deque<CNetSendBufferRef>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; ++itIov, ++nIov) {
+            size_t nOffset = (nIov == 0) ? pnode->nSendOffset : 0;
+            iov[nIov].iov_base = &(*itIov)->vch[nOffset];
+            iov[nIov].iov_len = (*itIov)->vch.size() - nOffset;
+            nWant += iov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the messages that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nRemaining = (*it)->vch.size() - pnode->nSendOffset;
+                if (nLeft < nRemaining) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nRemaining;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->vch.size();
+                pnode->RecordMsgSent((*it)->nMsgType, (*it)->vch.size());
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nWant) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -835,283 +900,700 @@ void SocketSendData(CNode* pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+#ifdef HAVE_SYS_EPOLL_H
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_EPOLL;
+#else
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
+#endif
+
+// frequency to poll pnode->vSend and disconnected nodes (in milliseconds)
+static const int SOCKET_POLL_INTERVAL = 50;
+
+#ifdef HAVE_SYS_EPOLL_H
+// Maximum number of readiness events taken from the kernel per epoll_wait()
+static const int MAX_SOCKET_EVENTS = 1024;
+// Descriptor of the epoll instance, or -1 when the select() loop is used
+static int hEpoll = -1;
+#endif
+
+std::string SocketEventsModeToString(SocketEventsMode mode)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true) {
-        //
-        // Disconnect nodes
-        //
-        {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy) {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+    switch (mode) {
+    case SOCKETEVENTS_SELECT:
+        return "select";
+    case SOCKETEVENTS_EPOLL:
+        return "epoll";
+    }
+    return "unknown";
+}
+
+bool SocketEventsModeFromString(const std::string& strMode, SocketEventsMode& modeRet)
+{
+    if (strMode == "select") {
+        modeRet = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (strMode == "epoll") {
+        modeRet = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+std::string GetSupportedSocketEventsModes()
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return "select, epoll";
+#else
+    return "select";
+#endif
+}
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+/** Start watching a node's socket for readiness, if the epoll backend is active */
+static void RegisterNodeSocket(CNode* pnode)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    // Edge-triggered: the kernel reports each transition once and fSocketReadable/
+    // fSocketWritable remember it until recv()/send() run out of data or space.
+    // Closing the socket removes it from the set, and only the socket handler thread
+    // deletes nodes, so the node pointer outlives every event that refers to it.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(errno));
+        pnode->CloseSocketDisconnect();
+    }
+#endif
+}
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
-            }
+void CTokenBucket::Refill(int64_t nNowUsec)
+{
+    if (nNowUsec > nLastUpdate) {
+        if (nLastUpdate != 0)
+            dTokens = std::min(dBurst, dTokens + (double)(nNowUsec - nLastUpdate) / nIntervalUsec);
+        nLastUpdate = nNowUsec;
+    }
+}
+
+bool CTokenBucket::Consume(int64_t nNowUsec)
+{
+    Refill(nNowUsec);
+    if (dTokens < 1)
+        return false;
+    dTokens -= 1;
+    return true;
+}
+
+bool CTokenBucket::IsFull(int64_t nNowUsec)
+{
+    Refill(nNowUsec);
+    return dTokens >= dBurst;
+}
+
+static bool ReverseCompareNodeMinPingTime(const NodeEvictionCandidate& a, const NodeEvictionCandidate& b)
+{
+    return a.nMinPingUsecTime > b.nMinPingUsecTime;
+}
+
+static bool ReverseCompareNodeTimeConnected(const NodeEvictionCandidate& a, const NodeEvictionCandidate& b)
+{
+    return a.nTimeConnected > b.nTimeConnected;
+}
+
+static bool CompareNodeBlockTime(const NodeEvictionCandidate& a, const NodeEvictionCandidate& b)
+{
+    // Peers that never gave us a block sort first, ties go to the longer connected one
+    if (a.nLastBlockTime != b.nLastBlockTime)
+        return a.nLastBlockTime < b.nLastBlockTime;
+    return a.nTimeConnected > b.nTimeConnected;
+}
+
+static bool IsMasternodeCandidate(const NodeEvictionCandidate& candidate)
+{
+    return candidate.fMasternode;
+}
+
+static bool CompareKeyedNetGroup(const NodeEvictionCandidate& a, const NodeEvictionCandidate& b)
+{
+    return a.nKeyedNetGroup < b.nKeyedNetGroup;
+}
+
+/** Drop the last nCount candidates after sorting with comparator; they are protected */
+template <typename T>
+static void ProtectCandidates(std::vector<NodeEvictionCandidate>& vCandidates, T comparator, size_t nCount)
+{
+    std::sort(vCandidates.begin(), vCandidates.end(), comparator);
+    vCandidates.erase(vCandidates.end() - std::min(nCount, vCandidates.size()), vCandidates.end());
+}
+
+NodeId SelectNodeToEvict(std::vector<NodeEvictionCandidate> vEvictionCandidates)
+{
+    // Masternodes are few, and the list and its payments depend on reaching them
+    vEvictionCandidates.erase(std::remove_if(vEvictionCandidates.begin(), vEvictionCandidates.end(), IsMasternodeCandidate),
+        vEvictionCandidates.end());
+
+    // Keep a few netgroups an attacker cannot predict or cheaply pick
+    ProtectCandidates(vEvictionCandidates, CompareKeyedNetGroup, EVICTION_PROTECT_NETGROUP);
+    // Keep the fastest peers, which an attacker needs to be close by to displace
+    ProtectCandidates(vEvictionCandidates, ReverseCompareNodeMinPingTime, EVICTION_PROTECT_PING);
+    // Keep the peers that most recently told us about a new block
+    ProtectCandidates(vEvictionCandidates, CompareNodeBlockTime, EVICTION_PROTECT_BLOCKS);
+    // Keep the longest-lived half of the rest; a flood only displaces its own recent sockets
+    ProtectCandidates(vEvictionCandidates, ReverseCompareNodeTimeConnected, vEvictionCandidates.size() / 2);
+
+    if (vEvictionCandidates.empty())
+        return -1;
+
+    // Take from the netgroup with the most connections; on a tie, the one with the youngest connection
+    std::map<uint64_t, std::vector<NodeEvictionCandidate> > mapNetGroupNodes;
+    uint64_t nMostConnectionsGroup = 0;
+    size_t nMostConnections = 0;
+    int64_t nMostConnectionsTime = 0;
+    BOOST_FOREACH (const NodeEvictionCandidate& candidate, vEvictionCandidates) {
+        std::vector<NodeEvictionCandidate>& vGroup = mapNetGroupNodes[candidate.nKeyedNetGroup];
+        vGroup.push_back(candidate);
+        int64_t nGroupTime = 0;
+        BOOST_FOREACH (const NodeEvictionCandidate& member, vGroup)
+            nGroupTime = std::max(nGroupTime, member.nTimeConnected);
+        if (vGroup.size() > nMostConnections || (vGroup.size() == nMostConnections && nGroupTime > nMostConnectionsTime)) {
+            nMostConnectionsGroup = candidate.nKeyedNetGroup;
+            nMostConnections = vGroup.size();
+            nMostConnectionsTime = nGroupTime;
         }
-        {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0) {
-                    bool fDelete = false;
-                    {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend) {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv) {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
-                        }
-                    }
-                    if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
-                }
-            }
+    }
+
+    // The youngest connection of that netgroup goes
+    const std::vector<NodeEvictionCandidate>& vGroup = mapNetGroupNodes[nMostConnectionsGroup];
+    return std::min_element(vGroup.begin(), vGroup.end(), ReverseCompareNodeTimeConnected)->id;
+}
+
+/**
+ * Make room for a new inbound connection by dropping an existing inbound peer.
+ * Evictions are rate limited, so a flood of connections from many addresses can
+ * only cycle through the unprotected slots slowly. Returns false if nobody was dropped.
+ */
+static bool AttemptToEvictConnection(bool fWhitelisted)
+{
+    static CTokenBucket evictionRate(EVICTION_RATE_BURST, EVICTION_RATE_INTERVAL * 1000000);
+    std::vector<NodeEvictionCandidate> vEvictionCandidates;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (!pnode->fInbound || pnode->fWhitelisted || pnode->fDisconnect)
+                continue;
+            NodeEvictionCandidate candidate = {pnode->id, pnode->nTimeConnected, pnode->nMinPingUsecTime,
+                pnode->nLastBlockTime, pnode->nKeyedNetGroup, pnode->fMasternode};
+            vEvictionCandidates.push_back(candidate);
         }
-        size_t vNodesSize;
+    }
+
+    NodeId nodeEvict = SelectNodeToEvict(vEvictionCandidates);
+    if (nodeEvict < 0)
+        return false;
+    if (!fWhitelisted && !evictionRate.Consume(GetTimeMicros()))
+        return false;
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH (CNode* pnode, vNodes) {
+        if (pnode->id == nodeEvict) {
+            LogPrint("net", "evicting peer=%d to make room for a new connection\n", pnode->id);
+            pnode->fDisconnect = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Whether another connection from this address's netgroup is allowed now. Limiting
+ * the netgroup rather than the address stops a flood from cycling through the
+ * addresses of a subnet. Loopback connections (local tests, Tor) are not limited.
+ * Only called from the socket handler thread, which owns the buckets.
+ */
+static bool AllowAccept(const CNetAddr& addr)
+{
+    static std::map<std::vector<unsigned char>, CTokenBucket> mapAcceptRate;
+    int64_t nNow = GetTimeMicros();
+
+    if (mapAcceptRate.size() >= ACCEPT_RATE_MAX_GROUPS) {
+        // Forget the netgroups that have not connected for a while
+        for (std::map<std::vector<unsigned char>, CTokenBucket>::iterator it = mapAcceptRate.begin(); it != mapAcceptRate.end();) {
+            if (it->second.IsFull(nNow))
+                mapAcceptRate.erase(it++);
+            else
+                it++;
+        }
+        if (mapAcceptRate.size() >= ACCEPT_RATE_MAX_GROUPS)
+            mapAcceptRate.clear();
+    }
+
+    std::vector<unsigned char> vchNetGroup(addr.GetGroup());
+    std::map<std::vector<unsigned char>, CTokenBucket>::iterator it = mapAcceptRate.find(vchNetGroup);
+    if (it == mapAcceptRate.end())
+        it = mapAcceptRate.insert(std::make_pair(vchNetGroup, CTokenBucket(ACCEPT_RATE_BURST, ACCEPT_RATE_INTERVAL * 1000000))).first;
+    return it->second.Consume(nNow);
+}
+
+static void AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    } else if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (CNode::IsBanned(addr) && !whitelisted) {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (!whitelisted && !addr.IsLocal() && !AllowAccept(addr)) {
+        LogPrint("net", "connection from %s dropped (too many connection attempts)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS && !AttemptToEvictConnection(whitelisted)) {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    } else {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+        RegisterNodeSocket(pnode);
+
         {
             LOCK(cs_vNodes);
-            vNodesSize = vNodes.size();
+            vNodes.push_back(pnode);
         }
-        if(vNodesSize != nPrevNodeCount) {
-            nPrevNodeCount = vNodesSize;
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+/**
+ * Read once from a node's socket into its receive buffer.
+ * Returns false once the socket has no more data queued (the read came up short).
+ * fComplete is set when a message was completed; the caller wakes the message
+ * handlers only after releasing cs_vRecvMsg, so they do not find the node still locked.
+ * requires LOCK(pnode->cs_vRecvMsg)
+ */
+static bool SocketRecvData(CNode* pnode, bool& fComplete)
+{
+    fComplete = false;
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0) {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, fComplete))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return nBytes == (int)sizeof(pchBuf);
+    } else if (nBytes == 0) {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    } else if (nBytes < 0) {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
         }
+    }
+    return false;
+}
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+// requires LOCK(pnode->cs_vRecvMsg)
+static bool ReceiveBufferHasRoom(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
 
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60) {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
         }
+    }
+}
 
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodes) {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
+static void DisconnectNodes()
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty())) {
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
+
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
+            }
+        }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH (CNode* pnode, vNodesDisconnectedCopy) {
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0) {
+                bool fDelete = false;
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
+                    if (lockSend) {
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv) {
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
+                        }
                     }
                 }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
+                if (fDelete) {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
                 }
             }
         }
+    }
+}
+
+/** One pass of the portable backend: select() over every listening and node socket */
+static void SocketHandlerSelect()
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = SOCKET_POLL_INTERVAL * 1000;
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty()) {
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                    continue;
+                }
+            }
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && ReceiveBufferHasRoom(pnode))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+            }
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+        &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (nSelect == SOCKET_ERROR) {
+        if (have_fds) {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout.tv_usec / 1000);
+    }
+
+    //
+    // Accept new connections
+    //
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            AcceptConnection(hListenSocket);
+    }
+
+    //
+    // Service each socket
+    //
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH (CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+    BOOST_FOREACH (CNode* pnode, vNodesCopy) {
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+        //
+        // Receive
+        //
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
+            bool fComplete = false;
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv)
+                    SocketRecvData(pnode, fComplete);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
+            if (fComplete)
+                messageHandlerCondition.notify_all();
         }
 
         //
-        // Accept new connections
+        // Send
         //
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
+                SocketSendData(pnode);
+        }
 
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
+        //
+        // Inactivity checking
+        //
+        InactivityCheck(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodesCopy)
+            pnode->Release();
+    }
+}
 
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH (CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * One pass of the epoll backend. Only nodes the kernel reported as ready, plus those
+ * left in setPending (referenced) by an earlier pass, are visited. A node stays pending
+ * while it is readable, or while a send or receive was skipped because its lock was
+ * busy; in the latter case the next pass comes after a millisecond instead of a full
+ * poll interval, so a held lock no longer costs the node the whole pass.
+ */
+static void SocketHandlerEpoll(std::set<CNode*>& setPending, bool& fRetry, int64_t& nLastInactivityCheck)
+{
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    int nEvents = epoll_wait(hEpoll, events, MAX_SOCKET_EVENTS, fRetry ? 1 : SOCKET_POLL_INTERVAL);
+    boost::this_thread::interruption_point();
 
-                if (hSocket == INVALID_SOCKET) {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else if (CNode::IsBanned(addr) && !whitelisted) {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                } else {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
+    if (nEvents < 0) {
+        if (errno != EINTR) {
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+            MilliSleep(SOCKET_POLL_INTERVAL);
+        }
+        nEvents = 0;
+    }
+
+    bool fAccept = false;
+    {
+        LOCK(cs_vNodes);
+        for (int i = 0; i < nEvents; i++) {
+            CNode* pnode = (CNode*)events[i].data.ptr;
+            if (pnode == NULL) {
+                fAccept = true;
+                continue;
             }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fSocketReadable = true;
+            if (events[i].events & EPOLLOUT)
+                pnode->fSocketWritable = true;
+            if (setPending.insert(pnode).second)
+                pnode->AddRef();
         }
+    }
+
+    //
+    // Accept new connections
+    //
+    if (fAccept) {
+        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket)
+            if (hListenSocket.socket != INVALID_SOCKET)
+                AcceptConnection(hListenSocket);
+    }
+
+    //
+    // Service the ready sockets
+    //
+    fRetry = false;
+    std::vector<CNode*> vDone;
+    BOOST_FOREACH (CNode* pnode, setPending) {
+        boost::this_thread::interruption_point();
+
+        bool fKeep = false;
+        bool fSendPending = false;
 
         //
-        // Service each socket
+        // Send; as in the select() loop, queued output is drained before reading more
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy)
-                pnode->AddRef();
+        if (pnode->hSocket != INVALID_SOCKET && pnode->fSocketWritable) {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (!lockSend) {
+                fKeep = fRetry = true;
+            } else if (!pnode->vSendMsg.empty()) {
+                SocketSendData(pnode);
+                // out of socket buffer space; wait for the next EPOLLOUT edge
+                fSendPending = !pnode->vSendMsg.empty();
+                if (fSendPending)
+                    pnode->fSocketWritable = false;
+            }
         }
-        BOOST_FOREACH (CNode* pnode, vNodesCopy) {
-            boost::this_thread::interruption_point();
 
-            //
-            // Receive
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
+        //
+        // Receive
+        //
+        if (pnode->hSocket != INVALID_SOCKET && pnode->fSocketReadable) {
+            fKeep = true;
+            bool fComplete = false;
+            {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
+                if (!lockRecv) {
+                    fRetry = true;
+                } else if (!fSendPending && ReceiveBufferHasRoom(pnode)) {
+                    pnode->fSocketReadable = SocketRecvData(pnode, fComplete);
+                    fRetry |= pnode->fSocketReadable;
                 }
             }
+            if (fComplete)
+                messageHandlerCondition.notify_all();
+        }
 
-            //
-            // Send
-            //
-            if (pnode->hSocket == INVALID_SOCKET)
-                continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
-            }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60) {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0) {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL) {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                } else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90 * 60)) {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                } else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros()) {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+        if (pnode->hSocket == INVALID_SOCKET || !fKeep)
+            vDone.push_back(pnode);
+    }
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vDone) {
+            setPending.erase(pnode);
+            pnode->Release();
         }
+    }
+
+    //
+    // Inactivity checking; the timeouts have a resolution of one second
+    //
+    int64_t nTime = GetTime();
+    if (nTime != nLastInactivityCheck) {
+        nLastInactivityCheck = nTime;
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes)
+            if (pnode->hSocket != INVALID_SOCKET)
+                InactivityCheck(pnode);
+    }
+}
+#endif
+
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+#ifdef HAVE_SYS_EPOLL_H
+    std::set<CNode*> setPending;
+    bool fRetry = false;
+    int64_t nLastInactivityCheck = 0;
+#endif
+    while (true) {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes();
+        size_t vNodesSize;
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodesCopy)
-                pnode->Release();
+            vNodesSize = vNodes.size();
+        }
+        if(vNodesSize != nPrevNodeCount) {
+            nPrevNodeCount = vNodesSize;
+            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+        }
+
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll != -1) {
+            SocketHandlerEpoll(setPending, fRetry, nLastInactivityCheck);
+            continue;
         }
+#endif
+        SocketHandlerSelect();
     }
 }
 
@@ -1492,6 +1974,48 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
 }
 
 
+/**
+ * Collect the nodes with a complete message (or pending getdata) to handle, those
+ * whose next message is a block or headers first. Nodes another message thread is
+ * working on are skipped. The returned nodes are referenced.
+ */
+static void GetNodesWithMessages(vector<CNode*>& vNodesRet)
+{
+    vector<CNode*> vNodesOther;
+    LOCK(cs_vNodes);
+    BOOST_FOREACH (CNode* pnode, vNodes) {
+        if (pnode->fDisconnect || pnode->nSendSize >= SendBufferSize())
+            continue;
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (!lockRecv)
+            continue;
+        if (!pnode->vRecvGetData.empty()) {
+            vNodesOther.push_back(pnode->AddRef());
+        } else if (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete()) {
+            if (IsPriorityMessage(pnode->vRecvMsg.front().hdr.GetCommand()))
+                vNodesRet.push_back(pnode->AddRef());
+            else
+                vNodesOther.push_back(pnode->AddRef());
+        }
+    }
+    vNodesRet.insert(vNodesRet.end(), vNodesOther.begin(), vNodesOther.end());
+}
+
+/** Handle the next message from pnode, unless another thread has it. Returns true if more are waiting. */
+static bool ProcessNodeMessages(CNode* pnode)
+{
+    // Holding cs_vRecvMsg for the whole call keeps each peer's messages on one thread, in order
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv || pnode->fDisconnect)
+        return false;
+
+    if (!g_signals.ProcessMessages(pnode))
+        pnode->CloseSocketDisconnect();
+
+    return pnode->nSendSize < SendBufferSize() &&
+           (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()));
+}
+
 void ThreadMessageHandler()
 {
     boost::mutex condition_mutex;
@@ -1515,35 +2039,34 @@ void ThreadMessageHandler()
 
         bool fSleep = true;
 
+        // Receive messages
+        vector<CNode*> vNodesReady;
+        GetNodesWithMessages(vNodesReady);
+        BOOST_FOREACH (CNode* pnode, vNodesReady) {
+            if (ProcessNodeMessages(pnode))
+                fSleep = false;
+            boost::this_thread::interruption_point();
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH (CNode* pnode, vNodesReady)
+                pnode->Release();
+        }
+
+        // Send messages
         BOOST_FOREACH (CNode* pnode, vNodesCopy) {
             if (pnode->fDisconnect)
                 continue;
 
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize()) {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
-                            fSleep = false;
-                        }
-                    }
-                }
-            }
-            boost::this_thread::interruption_point();
-
-            // Send messages
-            {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
-            }
+            // SendMessages takes the node's locks itself, after the serial message lock
+            g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
             boost::this_thread::interruption_point();
         }
 
+        // Admit the transactions received during this pass as one batch,
+        // then retry a batch of orphans whose parents have arrived
+        g_signals.ProcessQueuedTransactions();
+        boost::this_thread::interruption_point();
 
         {
             LOCK(cs_vNodes);
@@ -1556,6 +2079,37 @@ void ThreadMessageHandler()
     }
 }
 
+/**
+ * Extra message threads (-msghandlerthreads). They only handle received messages;
+ * sending, trickling and transaction batches stay on ThreadMessageHandler.
+ */
+void ThreadMessageWorker()
+{
+    boost::mutex condition_mutex;
+    boost::unique_lock<boost::mutex> lock(condition_mutex);
+
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true) {
+        vector<CNode*> vNodesReady;
+        GetNodesWithMessages(vNodesReady);
+
+        bool fSleep = true;
+        BOOST_FOREACH (CNode* pnode, vNodesReady) {
+            if (ProcessNodeMessages(pnode))
+                fSleep = false;
+            boost::this_thread::interruption_point();
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH (CNode* pnode, vNodesReady)
+                pnode->Release();
+        }
+
+        if (fSleep)
+            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+    }
+}
+
 #ifdef ENABLE_WALLET
 // ppcoin: stake minter thread
 void static ThreadStakeMinter()
@@ -1758,6 +2312,26 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Map ports with UPnP
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
+#ifdef HAVE_SYS_EPOLL_H
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL && hEpoll == -1) {
+        hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1) {
+            LogPrintf("epoll_create1 failed: %s, falling back to select()\n", NetworkErrorString(errno));
+            nSocketEventsMode = SOCKETEVENTS_SELECT;
+        } else {
+            // Listening sockets stay level-triggered; a NULL pointer marks them
+            BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+                struct epoll_event event;
+                event.events = EPOLLIN;
+                event.data.ptr = NULL;
+                if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+                    LogPrintf("epoll_ctl failed for listening socket: %s\n", NetworkErrorString(errno));
+            }
+        }
+    }
+#endif
+    LogPrintf("Using %s for socket events\n", SocketEventsModeToString(nSocketEventsMode));
+
     // Send and receive from sockets, accept connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
@@ -1769,6 +2343,9 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageThreads = max(1, min((int)GetArg("-msghandlerthreads", DEFAULT_MSGHANDLER_THREADS), MAX_MSGHANDLER_THREADS));
+    for (int i = 1; i < nMessageThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgworker", &ThreadMessageWorker));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -1811,6 +2388,12 @@ public:
             if (hListenSocket.socket != INVALID_SOCKET)
                 if (!CloseSocket(hListenSocket.socket))
                     LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll != -1) {
+            close(hEpoll);
+            hEpoll = -1;
+        }
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH (CNode* pnode, vNodes)
@@ -1851,34 +2434,73 @@ void RelayTransaction(const CTransaction& tx)
 void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
 {
     CInv inv(MSG_TX, tx.GetHash());
-    {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime()) {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
+    // Save original serialized message so newer versions are preserved
+    AddRelayMessage(inv, MakeNetMessage("tx", ss));
+    // SendMessages hands it to each peer, bloom filter permitting, when the peer's turn comes
+    txAnnounceQueue.Push(inv.hash);
+}
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+void CTxAnnounceQueue::Push(const uint256& hash)
+{
+    int64_t nNow = GetTime();
+    LOCK(cs);
+    while (!vQueue.empty() && vQueue.front().first < nNow - TX_ANNOUNCE_EXPIRY) {
+        setQueued.erase(vQueue.front().second);
+        vQueue.pop_front();
+        nFirst++;
     }
-    LOCK(cs_vNodes);
-    BOOST_FOREACH (CNode* pnode, vNodes) {
-        if (!pnode->fRelayTxes)
-            continue;
-        LOCK(pnode->cs_filter);
-        if (pnode->pfilter) {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx))
-                pnode->PushInventory(inv);
-        } else
-            pnode->PushInventory(inv);
+    if (setQueued.insert(hash).second)
+        vQueue.push_back(std::make_pair(nNow, hash));
+}
+
+uint64_t CTxAnnounceQueue::End() const
+{
+    LOCK(cs);
+    return nFirst + vQueue.size();
+}
+
+void CTxAnnounceQueue::Read(uint64_t& nNext, std::vector<uint256>& vHash, size_t nMax) const
+{
+    LOCK(cs);
+    // Whatever expired before the peer got to it is not announced to it any more
+    if (nNext < nFirst)
+        nNext = nFirst;
+    while (nMax-- > 0 && nNext < nFirst + vQueue.size())
+        vHash.push_back(vQueue[nNext++ - nFirst].second);
+}
+
+size_t CTxAnnounceQueue::size() const
+{
+    LOCK(cs);
+    return vQueue.size();
+}
+
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
+/**
+ * Keep a serialized message around for getdata of inv, for 15 minutes.
+ * Every peer asking for it is then sent the same buffer.
+ */
+void AddRelayMessage(const CInv& inv, const CNetSendBufferRef& msg)
+{
+    LOCK(cs_mapRelay);
+    // Expire old relay messages
+    while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime()) {
+        mapRelay.erase(vRelayExpiration.front().second);
+        vRelayExpiration.pop_front();
     }
+
+    if (mapRelay.insert(std::make_pair(inv, msg)).second)
+        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
 }
 
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
 {
     CInv inv(MSG_TXLOCK_REQUEST, tx.GetHash());
+    CNetSendBufferRef msg = MakeNetMessage("ix", tx);
 
     //broadcast the new lock
     LOCK(cs_vNodes);
@@ -1886,7 +2508,7 @@ void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll)
         if (!relayToAll && !pnode->fRelayTxes)
             continue;
 
-        pnode->PushMessage("ix", tx);
+        pnode->PushMessageBuffer(msg);
     }
 }
 
@@ -1910,6 +2532,121 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    int64_t nNow = GetTime();
+    if (nMaxOutboundCycleStartTime + (int64_t)MAX_UPLOAD_TIMEFRAME < nNow || nNow < nMaxOutboundCycleStartTime) {
+        // The cycle is over (or the clock went back), start counting afresh
+        nMaxOutboundCycleStartTime = nNow;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t nLimit)
+{
+    LOCK(cs_totalBytesSent);
+    nMaxOutboundLimit = nLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    // Nothing sent yet, a cycle starts with the first byte
+    if (nMaxOutboundCycleStartTime == 0)
+        return MAX_UPLOAD_TIMEFRAME;
+
+    int64_t nCycleEndTime = nMaxOutboundCycleStartTime + MAX_UPLOAD_TIMEFRAME;
+    int64_t nNow = GetTime();
+    return nCycleEndTime < nNow ? 0 : std::min<uint64_t>(nCycleEndTime - nNow, MAX_UPLOAD_TIMEFRAME);
+}
+
+bool CNode::OutboundTargetReached(bool fHistoricalBlockServingLimit)
+{
+    uint64_t nTimeLeft = GetMaxOutboundTimeLeftInCycle();
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (fHistoricalBlockServingLimit) {
+        // Keep enough back to relay the blocks still expected in this cycle
+        uint64_t nBuffer = nTimeLeft / Params().TargetSpacing() * UPLOAD_TARGET_BLOCK_BUFFER;
+        if (nBuffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - nBuffer)
+            return true;
+    } else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+void CNode::RecordMsgRecv(unsigned int nMsgType, uint64_t nBytes)
+{
+    vMsgStats[nMsgType].AddRecv(nBytes);
+    vMsgStatsTotal[nMsgType].AddRecv(nBytes);
+}
+
+void CNode::RecordMsgSent(unsigned int nMsgType, uint64_t nBytes)
+{
+    vMsgStats[nMsgType].AddSent(nBytes);
+    vMsgStatsTotal[nMsgType].AddSent(nBytes);
+}
+
+void CNode::RecordMsgProcessTime(unsigned int nMsgType, int64_t nUsec)
+{
+    vMsgStats[nMsgType].AddProcessTime(nUsec);
+    vMsgStatsTotal[nMsgType].AddProcessTime(nUsec);
+}
+
+void CNode::GetMsgStatsTotal(std::vector<CNetMsgTypeStats>& vStats)
+{
+    vStats.resize(NET_MESSAGE_TYPE_COUNT);
+    for (unsigned int i = 0; i < NET_MESSAGE_TYPE_COUNT; i++)
+        vStats[i] = vMsgStatsTotal[i].Get();
+}
+
+/** Requests that make us walk the chain, the mempool or the masternode list, and how often a peer may send them */
+static const struct {
+    const char* pszCommand;
+    unsigned int nBurst;
+    int64_t nIntervalUsec;
+} vRequestRateLimits[] = {
+    {"getblocks", 20, 500 * 1000},       // a syncing peer asks again every 500 blocks
+    {"mempool", 3, 30 * 1000 * 1000},    // normally once after connecting
+    {"dseg", 100, 200 * 1000},           // the full list once, then single entries for unknown pings
+    {"getmnlist", 3, 60 * 1000 * 1000},  // the list changes once after connecting
+};
+
+bool CNode::AllowRequest(unsigned int nMsgType, int64_t nNowUsec)
+{
+    std::map<unsigned int, CTokenBucket>::iterator it = mapRequestRate.find(nMsgType);
+    if (it == mapRequestRate.end()) {
+        for (unsigned int i = 0; i < ARRAYLEN(vRequestRateLimits); i++) {
+            if (GetNetMessageTypeIndex(vRequestRateLimits[i].pszCommand) == nMsgType) {
+                it = mapRequestRate.insert(std::make_pair(nMsgType, CTokenBucket(vRequestRateLimits[i].nBurst, vRequestRateLimits[i].nIntervalUsec))).first;
+                break;
+            }
+        }
+        if (it == mapRequestRate.end())
+            return true;
+    }
+    return it->second.Consume(nNowUsec);
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -1929,27 +2666,30 @@ void CNode::Fuzz(int nChance)
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
     if (GetRand(nChance) != 0) return;   // Fuzz 1 of every nChance messages
 
+    if (ssSend.empty())
+        return;
+    std::vector<char>& vch = ssSend.GetBuffer();
     switch (GetRand(3)) {
     case 0:
         // xor a random byte with a random value:
-        if (!ssSend.empty()) {
-            CDataStream::size_type pos = GetRand(ssSend.size());
-            ssSend[pos] ^= (unsigned char)(GetRand(256));
+        if (!vch.empty()) {
+            size_t pos = GetRand(vch.size());
+            vch[pos] ^= (unsigned char)(GetRand(256));
         }
         break;
     case 1:
         // delete a random byte:
-        if (!ssSend.empty()) {
-            CDataStream::size_type pos = GetRand(ssSend.size());
-            ssSend.erase(ssSend.begin() + pos);
+        if (!vch.empty()) {
+            size_t pos = GetRand(vch.size());
+            vch.erase(vch.begin() + pos);
         }
         break;
     case 2:
         // insert a random byte at a random position
         {
-            CDataStream::size_type pos = GetRand(ssSend.size());
+            size_t pos = GetRand(vch.size());
             char ch = (char)GetRand(256);
-            ssSend.insert(ssSend.begin() + pos, ch);
+            vch.insert(vch.begin() + pos, ch);
         }
         break;
     }
@@ -2055,7 +2795,9 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+                                                                                           addrKnown(ADDR_KNOWN_SIZE, 0.001),
+                                                                                           filterInventoryKnown(INVENTORY_KNOWN_SIZE, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2080,16 +2822,30 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    fSocketReadable = false;
+    fSocketWritable = false;
     hashContinue = 0;
     nStartingHeight = -1;
     fGetAddr = false;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
     nPingUsecTime = 0;
     fPingQueued = false;
+    nMinPingUsecTime = std::numeric_limits<int64_t>::max();
+    nLastBlockTime = 0;
+    fMasternode = false;
+    {
+        // Salted so that an attacker cannot tell which netgroups are protected from eviction
+        static const uint64_t nNetGroupSalt0 = GetRand(std::numeric_limits<uint64_t>::max());
+        static const uint64_t nNetGroupSalt1 = GetRand(std::numeric_limits<uint64_t>::max());
+        std::vector<unsigned char> vchNetGroup(addr.GetGroup());
+        nKeyedNetGroup = CSipHasher(nNetGroupSalt0, nNetGroupSalt1).Write(vchNetGroup.empty() ? NULL : &vchNetGroup[0], vchNetGroup.size()).Finalize();
+    }
+    // Transactions queued before the peer connected are not announced to it
+    nTxAnnounceNext = txAnnounceQueue.End();
+    nNextInvSend = 0;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2148,11 +2904,105 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+namespace
+{
+/** Send buffers released by their last holder, kept for reuse (see CNetSendBuffer) */
+class CSendBufferPool
+{
+public:
+    CSendBufferPool() : nCapacity(0) {}
+
+    CNetSendBuffer* Get()
+    {
+        {
+            LOCK(cs);
+            if (!vFree.empty()) {
+                CNetSendBuffer* pbuf = vFree.back();
+                vFree.pop_back();
+                nCapacity -= pbuf->vch.capacity();
+                return pbuf;
+            }
+        }
+        return new CNetSendBuffer();
+    }
+
+    void Put(CNetSendBuffer* pbuf)
+    {
+        size_t nBufCapacity = pbuf->vch.capacity();
+        if (nBufCapacity <= MAX_POOLED_SEND_BUFFER) {
+            pbuf->vch.clear();
+            LOCK(cs);
+            if (nCapacity + nBufCapacity <= MAX_SEND_BUFFER_POOL) {
+                nCapacity += nBufCapacity;
+                vFree.push_back(pbuf);
+                return;
+            }
+        }
+        delete pbuf;
+    }
+
+private:
+    CCriticalSection cs;
+    std::vector<CNetSendBuffer*> vFree;
+    size_t nCapacity;
+};
+
+/** Created on first use and never destroyed, so buffers released during static destruction still have a pool */
+CSendBufferPool& GetSendBufferPool()
+{
+    static CSendBufferPool* pool = new CSendBufferPool();
+    return *pool;
+}
+}
+
+void intrusive_ptr_add_ref(CNetSendBuffer* pbuf)
+{
+    pbuf->nRefCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void intrusive_ptr_release(CNetSendBuffer* pbuf)
+{
+    if (pbuf->nRefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        GetSendBufferPool().Put(pbuf);
+}
+
+CNetSendBufferRef AllocateSendBuffer()
+{
+    return CNetSendBufferRef(GetSendBufferPool().Get());
+}
+
+void CNetMessageStream::BeginMessage(const char* pszCommand)
+{
+    assert(empty());
+    buf = AllocateSendBuffer();
+    buf->nMsgType = GetNetMessageTypeIndex(pszCommand);
+    *this << CMessageHeader(pszCommand, 0);
+}
+
+CNetSendBufferRef CNetMessageStream::EndMessage()
+{
+    std::vector<char>& vch = buf->vch;
+
+    // Set the size
+    unsigned int nSize = vch.size() - CMessageHeader::HEADER_SIZE;
+    memcpy(&vch[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(vch.begin() + CMessageHeader::HEADER_SIZE, vch.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(vch.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy(&vch[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    CNetSendBufferRef ret;
+    ret.swap(buf);
+    return ret;
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
-    assert(ssSend.size() == 0);
-    ssSend << CMessageHeader(pszCommand, 0);
+    ssSend.BeginMessage(pszCommand);
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
 
@@ -2183,30 +3033,38 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         return;
     }
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    CNetSendBufferRef msg = ssSend.EndMessage();
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    LogPrint("net", "(%d bytes) peer=%d\n", msg->vch.size() - CMessageHeader::HEADER_SIZE, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    vSendMsg.push_back(msg);
+    nSendSize += msg->vch.size();
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
+void CNode::PushMessageBuffer(const CNetSendBufferRef& msg)
+{
+    LOCK(cs_vSend);
+    assert(ssSend.empty());
+    if (fDebug) {
+        const char* pszCommand = &msg->vch[MESSAGE_START_SIZE];
+        LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n", SanitizeString(std::string(pszCommand, strnlen(pszCommand, CMessageHeader::COMMAND_SIZE))),
+            msg->vch.size() - CMessageHeader::HEADER_SIZE, id);
+    }
+
+    vSendMsg.push_back(msg);
+    nSendSize += msg->vch.size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
+
 //
 // CBanDB
 //
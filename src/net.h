@@ -12,7 +12,6 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
@@ -21,6 +20,7 @@
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
 #include <stdint.h>
 
@@ -30,6 +30,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/intrusive_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -50,6 +51,16 @@ static const int TIMEOUT_INTERVAL = 20 * 60;
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Number of recent addresses remembered as known to a peer, and not sent to it again */
+static const unsigned int ADDR_KNOWN_SIZE = 5000;
+/** Number of recent inventory items remembered as known to a peer, and not announced to it again */
+static const unsigned int INVENTORY_KNOWN_SIZE = 5000;
+/** Average delay between transaction announcements to inbound peers, in seconds; outbound peers get half of it */
+static const unsigned int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of transactions announced to a peer at a time, one full inv; the rest wait for its next turn */
+static const unsigned int INVENTORY_BROADCAST_MAX = 1000;
+/** Time a transaction stays in the announcement queue, as long as its relay message is kept (in seconds) */
+static const int64_t TX_ANNOUNCE_EXPIRY = 15 * 60;
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
 /** Maximum length of strSubVer in `version` message */
@@ -62,8 +73,38 @@ static const bool DEFAULT_UPNP = USE_UPNP;
 #else
 static const bool DEFAULT_UPNP = false;
 #endif
+/** -msghandlerthreads default: threads handling received messages, including ThreadMessageHandler */
+static const int DEFAULT_MSGHANDLER_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHANDLER_THREADS = 16;
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Inbound peers kept safe from eviction for their low ping, each */
+static const unsigned int EVICTION_PROTECT_PING = 8;
+/** Inbound peers kept safe from eviction for most recently giving us a new block */
+static const unsigned int EVICTION_PROTECT_BLOCKS = 4;
+/** Inbound peers kept safe from eviction for their (salted, unpredictable) netgroup */
+static const unsigned int EVICTION_PROTECT_NETGROUP = 4;
+/** Connections accepted from one netgroup in a burst; one more is allowed every ACCEPT_RATE_INTERVAL seconds */
+static const unsigned int ACCEPT_RATE_BURST = 10;
+static const int64_t ACCEPT_RATE_INTERVAL = 10;
+/** Inbound peers evicted for new ones in a burst; one more may go every EVICTION_RATE_INTERVAL seconds */
+static const unsigned int EVICTION_RATE_BURST = 10;
+static const int64_t EVICTION_RATE_INTERVAL = 1;
+/** -maxuploadtarget default, in MiB per MAX_UPLOAD_TIMEFRAME; 0 means no limit */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The period the upload target applies to (in seconds) */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
+/** Upload kept back from the target for each block still expected in the cycle, so new blocks are always relayed */
+static const uint64_t UPLOAD_TARGET_BLOCK_BUFFER = 100 * 1000;
+/** Number of netgroups whose accept rate is tracked before idle ones are forgotten */
+static const size_t ACCEPT_RATE_MAX_GROUPS = 10000;
+
+/** How ThreadSocketHandler learns which sockets are ready (-socketevents) */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT, // portable select() loop, limited to FD_SETSIZE sockets
+    SOCKETEVENTS_EPOLL,  // Linux edge-triggered epoll, no descriptor limit
+};
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -83,14 +124,36 @@ bool BindListenPort(const CService& bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode* pnode);
+std::string SocketEventsModeToString(SocketEventsMode mode);
+bool SocketEventsModeFromString(const std::string& strMode, SocketEventsMode& modeRet);
+std::string GetSupportedSocketEventsModes();
 
 typedef int NodeId;
 
+/** What the inbound eviction policy looks at for each peer */
+struct NodeEvictionCandidate {
+    NodeId id;
+    int64_t nTimeConnected;
+    int64_t nMinPingUsecTime;
+    int64_t nLastBlockTime;
+    uint64_t nKeyedNetGroup;
+    bool fMasternode;
+};
+
+/**
+ * Choose the inbound peer to drop for a new connection. Masternodes and the peers
+ * with the lowest ping, the most recent new blocks, a few netgroups and the longest
+ * uptime are protected; of the rest, the youngest peer in the most crowded netgroup
+ * goes. Returns -1 when every candidate is protected.
+ */
+NodeId SelectNodeToEvict(std::vector<NodeEvictionCandidate> vEvictionCandidates);
+
 // Signals for message handling
 struct CNodeSignals {
     boost::signals2::signal<int()> GetHeight;
     boost::signals2::signal<bool(CNode*)> ProcessMessages;
     boost::signals2::signal<bool(CNode*, bool)> SendMessages;
+    boost::signals2::signal<void()> ProcessQueuedTransactions;
     boost::signals2::signal<void(NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void(NodeId)> FinalizeNode;
 };
@@ -125,16 +188,107 @@ bool IsReachable(const CNetAddr& addr);
 CAddress GetLocalAddress(const CNetAddr* paddrPeer = NULL);
 
 
+/**
+ * A serialized network message (header and payload) waiting to be sent.
+ * Buffers are refcounted so that one message can sit in the send queues of
+ * several peers, and go back to a small pool when the last reference is dropped.
+ * Network data is public, so unlike CSerializeData it is not wiped on release.
+ */
+class CNetSendBuffer
+{
+public:
+    std::vector<char> vch;
+    //! GetNetMessageTypeIndex() of the command, for the per-type statistics
+    unsigned int nMsgType;
+
+    CNetSendBuffer() : nMsgType(NET_MESSAGE_TYPE_COUNT - 1), nRefCount(0) {}
+
+private:
+    std::atomic<int> nRefCount;
+
+    friend void intrusive_ptr_add_ref(CNetSendBuffer* pbuf);
+    friend void intrusive_ptr_release(CNetSendBuffer* pbuf);
+};
+
+typedef boost::intrusive_ptr<CNetSendBuffer> CNetSendBufferRef;
+
+/** Take an empty buffer from the pool, or allocate one */
+CNetSendBufferRef AllocateSendBuffer();
+
+/**
+ * Stream serializing one message straight into a pooled CNetSendBuffer.
+ * BeginMessage() writes a blank header, EndMessage() fills in its size and
+ * checksum and hands the buffer over.
+ */
+class CNetMessageStream
+{
+private:
+    CNetSendBufferRef buf;
+
+public:
+    int nType;
+    int nVersion;
+
+    CNetMessageStream(int nTypeIn, int nVersionIn) : nType(nTypeIn), nVersion(nVersionIn) {}
+
+    void BeginMessage(const char* pszCommand);
+    CNetSendBufferRef EndMessage();
+    void clear() { buf.reset(); }
+
+    size_t size() const { return buf ? buf->vch.size() : 0; }
+    bool empty() const { return size() == 0; }
+    std::vector<char>& GetBuffer() { return buf->vch; }
+
+    void SetType(int n) { nType = n; }
+    int GetType() { return nType; }
+    void SetVersion(int n) { nVersion = n; }
+    int GetVersion() { return nVersion; }
+
+    CNetMessageStream& write(const char* pch, size_t nSize)
+    {
+        buf->vch.insert(buf->vch.end(), pch, pch + nSize);
+        return (*this);
+    }
+
+    template <typename T>
+    CNetMessageStream& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
+/** Serialize a complete message once, to be pushed to any number of peers with CNode::PushMessageBuffer */
+template <typename T1>
+CNetSendBufferRef MakeNetMessage(const char* pszCommand, const T1& a1)
+{
+    CNetMessageStream msg(SER_NETWORK, PROTOCOL_VERSION);
+    msg.BeginMessage(pszCommand);
+    msg << a1;
+    return msg.EndMessage();
+}
+
+template <typename T1, typename T2>
+CNetSendBufferRef MakeNetMessage(const char* pszCommand, const T1& a1, const T2& a2)
+{
+    CNetMessageStream msg(SER_NETWORK, PROTOCOL_VERSION);
+    msg.BeginMessage(pszCommand);
+    msg << a1 << a2;
+    return msg.EndMessage();
+}
+
+
 extern bool fDiscover;
 extern bool fListen;
 extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern SocketEventsMode nSocketEventsMode;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CNetSendBufferRef> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -156,6 +310,95 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Traffic and processing time of one message type, on one peer or summed over all of them */
+class CNetMsgTypeStats
+{
+public:
+    uint64_t nRecvMsgs;
+    uint64_t nRecvBytes;
+    uint64_t nSentMsgs;
+    uint64_t nSentBytes;
+    //! Time spent handling the received messages, in microseconds
+    uint64_t nProcessUsec;
+
+    CNetMsgTypeStats() : nRecvMsgs(0), nRecvBytes(0), nSentMsgs(0), nSentBytes(0), nProcessUsec(0) {}
+
+    bool IsNull() const { return nRecvMsgs == 0 && nSentMsgs == 0; }
+
+    CNetMsgTypeStats& operator+=(const CNetMsgTypeStats& other)
+    {
+        nRecvMsgs += other.nRecvMsgs;
+        nRecvBytes += other.nRecvBytes;
+        nSentMsgs += other.nSentMsgs;
+        nSentBytes += other.nSentBytes;
+        nProcessUsec += other.nProcessUsec;
+        return *this;
+    }
+};
+
+/**
+ * The counters behind a CNetMsgTypeStats. The socket thread and the message
+ * threads update them without taking any lock.
+ */
+class CNetMsgTypeCounters
+{
+private:
+    std::atomic<uint64_t> nRecvMsgs;
+    std::atomic<uint64_t> nRecvBytes;
+    std::atomic<uint64_t> nSentMsgs;
+    std::atomic<uint64_t> nSentBytes;
+    std::atomic<uint64_t> nProcessUsec;
+
+public:
+    CNetMsgTypeCounters() : nRecvMsgs(0), nRecvBytes(0), nSentMsgs(0), nSentBytes(0), nProcessUsec(0) {}
+
+    void AddRecv(uint64_t nBytes)
+    {
+        nRecvMsgs.fetch_add(1, std::memory_order_relaxed);
+        nRecvBytes.fetch_add(nBytes, std::memory_order_relaxed);
+    }
+    void AddSent(uint64_t nBytes)
+    {
+        nSentMsgs.fetch_add(1, std::memory_order_relaxed);
+        nSentBytes.fetch_add(nBytes, std::memory_order_relaxed);
+    }
+    void AddProcessTime(int64_t nUsec) { nProcessUsec.fetch_add(nUsec, std::memory_order_relaxed); }
+
+    CNetMsgTypeStats Get() const
+    {
+        CNetMsgTypeStats stats;
+        stats.nRecvMsgs = nRecvMsgs.load(std::memory_order_relaxed);
+        stats.nRecvBytes = nRecvBytes.load(std::memory_order_relaxed);
+        stats.nSentMsgs = nSentMsgs.load(std::memory_order_relaxed);
+        stats.nSentBytes = nSentBytes.load(std::memory_order_relaxed);
+        stats.nProcessUsec = nProcessUsec.load(std::memory_order_relaxed);
+        return stats;
+    }
+};
+
+/**
+ * Token bucket rate limit: holds up to nBurst tokens, gains one every nIntervalUsec,
+ * and every allowed event takes one. Not thread safe.
+ */
+class CTokenBucket
+{
+private:
+    double dTokens;
+    double dBurst;
+    int64_t nIntervalUsec;
+    int64_t nLastUpdate;
+
+    void Refill(int64_t nNowUsec);
+
+public:
+    CTokenBucket(unsigned int nBurst, int64_t nIntervalUsecIn) : dTokens(nBurst), dBurst(nBurst), nIntervalUsec(nIntervalUsecIn), nLastUpdate(0) {}
+
+    //! Take a token if there is one
+    bool Consume(int64_t nNowUsec);
+    //! Whether the bucket is back to its burst size, i.e. carries no history
+    bool IsFull(int64_t nNowUsec);
+};
+
 class CNodeStats
 {
 public:
@@ -175,7 +418,10 @@ public:
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
+    double dMinPing;
     std::string addrLocal;
+    //! Message types seen on this connection, by command
+    std::map<std::string, CNetMsgTypeStats> mapMsgStats;
 };
 
 
@@ -192,6 +438,7 @@ public:
     unsigned int nDataPos;
 
     int64_t nTime; // time (in microseconds) of message receipt.
+    unsigned int nMsgType; // GetNetMessageTypeIndex() of the command, once complete
 
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
     {
@@ -200,6 +447,7 @@ public:
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        nMsgType = NET_MESSAGE_TYPE_COUNT - 1;
     }
 
     bool complete() const
@@ -289,13 +537,17 @@ public:
     // socket
     uint64_t nServices;
     SOCKET hSocket;
-    CDataStream ssSend;
+    CNetMessageStream ssSend;
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CNetSendBufferRef> vSendMsg;
     CCriticalSection cs_vSend;
 
+    // Readiness reported by the epoll backend; only touched by the socket handler thread
+    bool fSocketReadable;
+    bool fSocketWritable;
+
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
@@ -355,15 +607,19 @@ public:
     int nStartingHeight;
 
     // flood relay
+    CCriticalSection cs_vAddrToSend; // protects vAddrToSend and addrKnown; addr runs on any message thread
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
+    // Next entry of txAnnounceQueue to offer this peer, and when; used by SendMessages only
+    uint64_t nTxAnnounceNext;
+    int64_t nNextInvSend;
     std::multimap<int64_t, CInv> mapAskFor;
     std::vector<uint256> vBlockRequested;
 
@@ -376,6 +632,15 @@ public:
     int64_t nPingUsecTime;
     // Whether a ping is requested.
     bool fPingQueued;
+    // Lowest measured round-trip time, for inbound eviction.
+    int64_t nMinPingUsecTime;
+
+    // Last time the peer gave us a new valid block, for inbound eviction.
+    int64_t nLastBlockTime;
+    // Whether the peer connects from the address of a known masternode
+    bool fMasternode;
+    // Salted hash of the peer's netgroup, for inbound eviction.
+    uint64_t nKeyedNetGroup;
 
     CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn = false);
     ~CNode();
@@ -387,6 +652,18 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Upload target (-maxuploadtarget) and what was sent towards it; guarded by cs_totalBytesSent
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static int64_t nMaxOutboundCycleStartTime;
+
+    // Traffic and processing time per message type, on this connection and in total
+    CNetMsgTypeCounters vMsgStats[NET_MESSAGE_TYPE_COUNT];
+    static CNetMsgTypeCounters vMsgStatsTotal[NET_MESSAGE_TYPE_COUNT];
+
+    // Allowance for expensive requests, by message type; requires cs_vRecvMsg
+    std::map<unsigned int, CTokenBucket> mapRequestRate;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -412,7 +689,7 @@ public:
     }
 
     // requires LOCK(cs_vRecvMsg)
-    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
+    bool ReceiveMsgBytes(const char* pch, unsigned int nBytes, bool& fComplete);
 
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
@@ -436,7 +713,8 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        LOCK(cs_vAddrToSend);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -444,7 +722,8 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        LOCK(cs_vAddrToSend);
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -458,7 +737,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -466,7 +745,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -484,6 +763,9 @@ public:
 
     void PushVersion();
 
+    /** Queue a message built by MakeNetMessage; the buffer may be shared with other peers */
+    void PushMessageBuffer(const CNetSendBufferRef& msg);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -726,6 +1008,34 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    //! Set the upload target in bytes per MAX_UPLOAD_TIMEFRAME, 0 for none
+    static void SetMaxOutboundTarget(uint64_t nLimit);
+    static uint64_t GetMaxOutboundTarget();
+    /**
+     * Whether the upload target is used up. With fHistoricalBlockServingLimit, whether
+     * it is close enough that serving old blocks would eat into the upload kept back for
+     * relaying new blocks until the cycle ends.
+     */
+    static bool OutboundTargetReached(bool fHistoricalBlockServingLimit);
+    //! Bytes left before the upload target is reached, 0 if there is no target
+    static uint64_t GetOutboundTargetBytesLeft();
+    //! Seconds until the upload target cycle starts over, 0 if there is no target
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
+
+    void RecordMsgRecv(unsigned int nMsgType, uint64_t nBytes);
+    void RecordMsgSent(unsigned int nMsgType, uint64_t nBytes);
+    void RecordMsgProcessTime(unsigned int nMsgType, int64_t nUsec);
+
+    //! Totals since startup, indexed like GetAllNetMessageTypes()
+    static void GetMsgStatsTotal(std::vector<CNetMsgTypeStats>& vStats);
+
+    /**
+     * Whether to answer an expensive request (getblocks, mempool, dseg) now, or drop
+     * it because the peer is over its allowance. Other message types always pass.
+     * requires LOCK(cs_vRecvMsg)
+     */
+    bool AllowRequest(unsigned int nMsgType, int64_t nNowUsec);
 };
 
 class CExplicitNetCleanup
@@ -737,9 +1047,44 @@ public:
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
 void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void AddRelayMessage(const CInv& inv, const CNetSendBufferRef& msg);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
 
+/**
+ * Transactions waiting to be announced, shared by all peers. A transaction is
+ * queued once, however many peers it goes to; every peer keeps a sequence
+ * number into the queue and reads on from there when its announcement timer
+ * fires. Entries expire after TX_ANNOUNCE_EXPIRY.
+ */
+class CTxAnnounceQueue
+{
+public:
+    CTxAnnounceQueue() : nFirst(0) {}
+
+    //! Queue hash, unless it is queued already
+    void Push(const uint256& hash);
+
+    //! Sequence number the next queued transaction will get
+    uint64_t End() const;
+
+    //! Copy up to nMax queued hashes from nNext on into vHash, and move nNext past them
+    void Read(uint64_t& nNext, std::vector<uint256>& vHash, size_t nMax) const;
+
+    size_t size() const;
+
+private:
+    mutable CCriticalSection cs;
+    //! (time queued, hash), oldest first; the front entry has sequence number nFirst
+    std::deque<std::pair<int64_t, uint256> > vQueue;
+    std::set<uint256> setQueued;
+    uint64_t nFirst;
+};
+extern CTxAnnounceQueue txAnnounceQueue;
+
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
 {
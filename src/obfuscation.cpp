@@ -1199,22 +1199,75 @@ bool CMasternodeSigner::SignMessage(std::string strMessage, std::string& errorMe
     return true;
 }
 
-bool CMasternodeSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+uint256 CMasternodeSigner::GetMessageHash(const std::string& strMessage)
 {
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
     ss << strMessage;
+    return ss.GetHash();
+}
 
-    CPubKey pubkey2;
-    if (!pubkey2.RecoverCompact(ss.GetHash(), vchSig)) {
-        errorMessage = _("Error recovering public key.");
-        return false;
+uint256 CMasternodeSigner::GetRecoveredKey(const uint256& hashMessage, const vector<unsigned char>& vchSig)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << hashMessage;
+    ss << vchSig;
+    return ss.GetHash();
+}
+
+bool CMasternodeSigner::VerifyMessage(CPubKey pubkey, vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage)
+{
+    uint256 hashMessage = GetMessageHash(strMessage);
+
+    CKeyID keyID;
+    bool fRecovered = false;
+    {
+        LOCK(cs_recovered);
+        std::map<uint256, CKeyID>::const_iterator it = mapRecovered.find(GetRecoveredKey(hashMessage, vchSig));
+        if (it != mapRecovered.end()) {
+            keyID = it->second;
+            fRecovered = true;
+        }
     }
 
-    if (fDebug && pubkey2.GetID() != pubkey.GetID())
-        LogPrintf("CMasternodeSigner::VerifyMessage -- keys don't match: %s %s\n", pubkey2.GetID().ToString(), pubkey.GetID().ToString());
+    if (!fRecovered) {
+        CPubKey pubkey2;
+        if (!pubkey2.RecoverCompact(hashMessage, vchSig)) {
+            errorMessage = _("Error recovering public key.");
+            return false;
+        }
+        keyID = pubkey2.GetID();
+    }
+
+    if (fDebug && keyID != pubkey.GetID())
+        LogPrintf("CMasternodeSigner::VerifyMessage -- keys don't match: %s %s\n", keyID.ToString(), pubkey.GetID().ToString());
+
+    return (keyID == pubkey.GetID());
+}
+
+void CMasternodeSigner::PrecomputeSigner(const std::string& strMessage, const vector<unsigned char>& vchSig)
+{
+    uint256 hashMessage = GetMessageHash(strMessage);
+    uint256 hashKey = GetRecoveredKey(hashMessage, vchSig);
+    {
+        LOCK(cs_recovered);
+        if (mapRecovered.count(hashKey))
+            return;
+    }
 
-    return (pubkey2.GetID() == pubkey.GetID());
+    // Invalid signatures are not remembered; VerifyMessage reports them itself
+    CPubKey pubkey;
+    if (!pubkey.RecoverCompact(hashMessage, vchSig))
+        return;
+
+    LOCK(cs_recovered);
+    if (!mapRecovered.insert(make_pair(hashKey, pubkey.GetID())).second)
+        return;
+    vRecoveredOrder.push_back(hashKey);
+    if (vRecoveredOrder.size() > MAX_RECOVERED_SIGNERS) {
+        mapRecovered.erase(vRecoveredOrder.front());
+        vRecoveredOrder.pop_front();
+    }
 }
 
 bool CObfuscationQueue::Sign()
@@ -1247,10 +1300,11 @@ bool CObfuscationQueue::Sign()
 
 bool CObfuscationQueue::Relay()
 {
+    CNetSendBufferRef msg = MakeNetMessage("dsq", (*this));
     LOCK(cs_vNodes);
     BOOST_FOREACH (CNode* pnode, vNodes) {
         // always relay to everyone
-        pnode->PushMessage("dsq", (*this));
+        pnode->PushMessageBuffer(msg);
     }
 
     return true;
@@ -1277,9 +1331,10 @@ bool CObfuscationQueue::CheckSignature()
 
 void CObfuscationPool::RelayFinalTransaction(const int sessionID, const CTransaction& txNew)
 {
+    CNetSendBufferRef msg = MakeNetMessage("dsf", sessionID, txNew);
     LOCK(cs_vNodes);
     BOOST_FOREACH (CNode* pnode, vNodes) {
-        pnode->PushMessage("dsf", sessionID, txNew);
+        pnode->PushMessageBuffer(msg);
     }
 }
 
@@ -243,10 +243,22 @@ public:
     int64_t sigTime;
 };
 
+/** Number of recovered masternode message signers kept for VerifyMessage */
+static const unsigned int MAX_RECOVERED_SIGNERS = 10000;
+
 /** Helper object for signing and checking signatures
  */
 class CMasternodeSigner
 {
+private:
+    // Signers recovered ahead of time by PrecomputeSigner, by Hash(message hash, signature)
+    CCriticalSection cs_recovered;
+    std::map<uint256, CKeyID> mapRecovered;
+    std::deque<uint256> vRecoveredOrder;
+
+    static uint256 GetMessageHash(const std::string& strMessage);
+    static uint256 GetRecoveredKey(const uint256& hashMessage, const std::vector<unsigned char>& vchSig);
+
 public:
     /// Is the inputs associated with this public key? (and there is 25000 BAS - checking if valid masternode)
     bool IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey);
@@ -258,6 +270,8 @@ public:
     bool SignMessage(std::string strMessage, std::string& errorMessage, std::vector<unsigned char>& vchSig, CKey key);
     /// Verify the message, returns true if succcessful
     bool VerifyMessage(CPubKey pubkey, std::vector<unsigned char>& vchSig, std::string strMessage, std::string& errorMessage);
+    /// Recover the signer of a message on the calling thread, so a later VerifyMessage only compares keys
+    void PrecomputeSigner(const std::string& strMessage, const std::vector<unsigned char>& vchSig);
 };
 
 /** Used to keep track of current status of Obfuscation pool
@@ -16,6 +16,8 @@
 #include <arpa/inet.h>
 #endif
 
+#include <map>
+
 static const char* ppszTypeName[] =
     {
         "ERROR",
@@ -30,7 +32,8 @@ static const char* ppszTypeName[] =
         "mn quorum",
         "mn announce",
         "mn ping",
-        "dstx"
+        "dstx",
+        "compact block"
     };
 
 CMessageHeader::CMessageHeader()
@@ -136,7 +139,7 @@ bool CInv::IsKnownType() const
 }
 
 bool CInv::IsMasterNodeType() const{
- 	return (type >= 6);
+ 	return (type >= MSG_SPORK && type <= MSG_DSTX);
 }
 
 const char* CInv::GetCommand() const
@@ -153,3 +156,37 @@ std::string CInv::ToString() const
 {
     return strprintf("%s %s", GetCommand(), hash.ToString());
 }
+
+static const char* ppszNetMessageTypes[] = {
+    "version", "verack", "addr", "getaddr", "inv", "getdata", "notfound", "getblocks",
+    "getheaders", "headers", "block", "tx", "mempool", "ping", "pong", "alert", "reject",
+    "filterload", "filteradd", "filterclear", "merkleblock",
+    "sendcmpct", "cmpctblock", "getblocktxn", "blocktxn",
+    "ix", "txlvote", "spork", "getsporks",
+    "mnb", "mnp", "mnw", "mnget", "dseg", "ssc", "getmnlist", "mnlistdiff",
+    "dsa", "dsc", "dsf", "dsi", "dsq", "dss", "dssu", "dstx",
+    "other"};
+
+static_assert(sizeof(ppszNetMessageTypes) / sizeof(ppszNetMessageTypes[0]) == NET_MESSAGE_TYPE_COUNT, "NET_MESSAGE_TYPE_COUNT does not match ppszNetMessageTypes");
+
+const std::vector<std::string>& GetAllNetMessageTypes()
+{
+    static const std::vector<std::string> vTypes(ppszNetMessageTypes, ppszNetMessageTypes + NET_MESSAGE_TYPE_COUNT);
+    return vTypes;
+}
+
+static std::map<std::string, unsigned int> MakeNetMessageTypeIndex()
+{
+    std::map<std::string, unsigned int> mapIndex;
+    for (unsigned int i = 0; i < NET_MESSAGE_TYPE_COUNT - 1; i++)
+        mapIndex[ppszNetMessageTypes[i]] = i;
+    return mapIndex;
+}
+
+unsigned int GetNetMessageTypeIndex(const std::string& strCommand)
+{
+    // Built once, by whichever thread gets here first
+    static const std::map<std::string, unsigned int> mapIndex = MakeNetMessageTypeIndex();
+    std::map<std::string, unsigned int>::const_iterator it = mapIndex.find(strCommand);
+    return it == mapIndex.end() ? NET_MESSAGE_TYPE_COUNT - 1 : it->second;
+}
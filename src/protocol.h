@@ -20,6 +20,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #define MESSAGE_START_SIZE 4
 
@@ -165,7 +166,19 @@ enum {
     MSG_MASTERNODE_SCANNING_ERROR,
     MSG_MASTERNODE_QUORUM,
     MSG_MASTERNODE_ANNOUNCE,
-    MSG_MASTERNODE_PING
+    MSG_MASTERNODE_PING,
+    MSG_DSTX,
+    // Like MSG_FILTERED_BLOCK, MSG_CMPCT_BLOCK is only ever used in getdata
+    MSG_CMPCT_BLOCK
 };
 
+/** Number of message types counted apart in the network message statistics */
+static const unsigned int NET_MESSAGE_TYPE_COUNT = 46;
+
+/** Commands of the counted message types; the last one, "other", stands for any unknown command */
+const std::vector<std::string>& GetAllNetMessageTypes();
+
+/** Position of strCommand in GetAllNetMessageTypes() */
+unsigned int GetNetMessageTypeIndex(const std::string& strCommand);
+
 #endif // BITCOIN_PROTOCOL_H
@@ -100,6 +100,11 @@ quint64 ClientModel::getTotalBytesSent() const
     return CNode::GetTotalBytesSent();
 }
 
+void ClientModel::getNetMsgStats(std::vector<CNetMsgTypeStats>& vStats) const
+{
+    CNode::GetMsgStatsTotal(vStats);
+}
+
 QDateTime ClientModel::getLastBlockDate() const
 {
     LOCK(cs_main);
@@ -10,11 +10,14 @@
 
 #include <QObject>
 
+#include <vector>
+
 class AddressTableModel;
 class OptionsModel;
 class PeerTableModel;
 class TransactionTableModel;
 
+class CNetMsgTypeStats;
 class CWallet;
 
 QT_BEGIN_NAMESPACE
@@ -56,6 +59,8 @@ public:
 
     quint64 getTotalBytesRecv() const;
     quint64 getTotalBytesSent() const;
+    //! Traffic by message type since startup, indexed like GetAllNetMessageTypes()
+    void getNetMsgStats(std::vector<CNetMsgTypeStats>& vStats) const;
 
     double getVerificationProgress() const;
     QDateTime getLastBlockDate() const;
@@ -5,10 +5,14 @@
 #include "trafficgraphwidget.h"
 #include "clientmodel.h"
 
+#include "net.h"
+#include "protocol.h"
+
 #include <QColor>
 #include <QPainter>
 #include <QTimer>
 
+#include <algorithm>
 #include <cmath>
 
 #define DESIRED_SAMPLES 800
@@ -16,6 +20,9 @@
 #define XMARGIN 10
 #define YMARGIN 10
 
+// Message types named in the graph; the tooltip lists them all
+#define LEGEND_TYPES 5
+
 TrafficGraphWidget::TrafficGraphWidget(QWidget* parent) : QWidget(parent),
                                                           timer(0),
                                                           fMax(0.0f),
@@ -36,6 +43,8 @@ void TrafficGraphWidget::setClientModel(ClientModel* model)
     if (model) {
         nLastBytesIn = model->getTotalBytesRecv();
         nLastBytesOut = model->getTotalBytesSent();
+        model->getNetMsgStats(vMsgStatsStart);
+        msgStatsTimer.start();
     }
 }
 
@@ -115,6 +124,53 @@ void TrafficGraphWidget::paintEvent(QPaintEvent*)
         painter.setPen(Qt::red);
         painter.drawPath(p);
     }
+
+    // the busiest message types, top right
+    painter.setPen(Qt::gray);
+    int lineHeight = painter.fontMetrics().height();
+    for (int i = 0; i < vMsgLegend.size(); i++) {
+        QRect line(XMARGIN, YMARGIN + i * lineHeight, width() - XMARGIN * 2, lineHeight);
+        painter.drawText(line, Qt::AlignRight, vMsgLegend.at(i));
+    }
+}
+
+void TrafficGraphWidget::updateMsgStats()
+{
+    std::vector<CNetMsgTypeStats> vStats;
+    clientModel->getNetMsgStats(vStats);
+    if (vMsgStatsStart.size() != vStats.size())
+        vMsgStatsStart.resize(vStats.size());
+    const std::vector<std::string>& vTypes = GetAllNetMessageTypes();
+    float secs = std::max<qint64>(msgStatsTimer.elapsed(), 1) / 1000.0f;
+
+    // (bytes in and out, type) since the graph was cleared, busiest first
+    std::vector<std::pair<uint64_t, unsigned int> > vBusiest;
+    QStringList vToolTip;
+    for (unsigned int i = 0; i < vStats.size(); i++) {
+        uint64_t nRecvBytes = vStats[i].nRecvBytes - vMsgStatsStart[i].nRecvBytes;
+        uint64_t nSentBytes = vStats[i].nSentBytes - vMsgStatsStart[i].nSentBytes;
+        if (nRecvBytes + nSentBytes == 0)
+            continue;
+        vBusiest.push_back(std::make_pair(nRecvBytes + nSentBytes, i));
+    }
+    std::sort(vBusiest.rbegin(), vBusiest.rend());
+
+    vMsgLegend.clear();
+    for (unsigned int n = 0; n < vBusiest.size(); n++) {
+        unsigned int i = vBusiest[n].second;
+        float inRate = (vStats[i].nRecvBytes - vMsgStatsStart[i].nRecvBytes) / 1024.0f / secs;
+        float outRate = (vStats[i].nSentBytes - vMsgStatsStart[i].nSentBytes) / 1024.0f / secs;
+        if (n < LEGEND_TYPES)
+            vMsgLegend << tr("%1: %2 in, %3 out KB/s").arg(QString::fromStdString(vTypes[i])).arg(inRate, 0, 'f', 2).arg(outRate, 0, 'f', 2);
+        vToolTip << tr("%1: %2 in, %3 out KB/s, %4 received, %5 sent, %6 ms handling")
+                        .arg(QString::fromStdString(vTypes[i]))
+                        .arg(inRate, 0, 'f', 2)
+                        .arg(outRate, 0, 'f', 2)
+                        .arg(vStats[i].nRecvMsgs - vMsgStatsStart[i].nRecvMsgs)
+                        .arg(vStats[i].nSentMsgs - vMsgStatsStart[i].nSentMsgs)
+                        .arg((vStats[i].nProcessUsec - vMsgStatsStart[i].nProcessUsec) / 1000);
+    }
+    setToolTip(vToolTip.join("\n"));
 }
 
 void TrafficGraphWidget::updateRates()
@@ -129,6 +185,7 @@ void TrafficGraphWidget::updateRates()
     vSamplesOut.push_front(outRate);
     nLastBytesIn = bytesIn;
     nLastBytesOut = bytesOut;
+    updateMsgStats();
 
     while (vSamplesIn.size() > DESIRED_SAMPLES) {
         vSamplesIn.pop_back();
@@ -166,9 +223,14 @@ void TrafficGraphWidget::clear()
     vSamplesIn.clear();
     fMax = 0.0f;
 
+    vMsgLegend.clear();
+    setToolTip(QString());
+
     if (clientModel) {
         nLastBytesIn = clientModel->getTotalBytesRecv();
         nLastBytesOut = clientModel->getTotalBytesSent();
+        clientModel->getNetMsgStats(vMsgStatsStart);
+        msgStatsTimer.start();
     }
     timer->start();
 }
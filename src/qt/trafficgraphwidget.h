@@ -5,10 +5,15 @@
 #ifndef BITCOIN_QT_TRAFFICGRAPHWIDGET_H
 #define BITCOIN_QT_TRAFFICGRAPHWIDGET_H
 
+#include <QElapsedTimer>
 #include <QQueue>
+#include <QStringList>
 #include <QWidget>
 
+#include <vector>
+
 class ClientModel;
+class CNetMsgTypeStats;
 
 QT_BEGIN_NAMESPACE
 class QPaintEvent;
@@ -34,6 +39,7 @@ public slots:
 
 private:
     void paintPath(QPainterPath& path, QQueue<float>& samples);
+    void updateMsgStats();
 
     QTimer* timer;
     float fMax;
@@ -42,6 +48,10 @@ private:
     QQueue<float> vSamplesOut;
     quint64 nLastBytesIn;
     quint64 nLastBytesOut;
+    // Traffic by message type since the graph was cleared
+    std::vector<CNetMsgTypeStats> vMsgStatsStart;
+    QElapsedTimer msgStatsTimer;
+    QStringList vMsgLegend;
     ClientModel* clientModel;
 };
 
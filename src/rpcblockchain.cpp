@@ -331,7 +331,7 @@ UniValue mempoolToJSON(bool fVerbose = false)
     if (fVerbose) {
         LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH (const PAIRTYPE(uint256, CTxMemPoolEntry) & entry, mempool.mapTx) {
+        BOOST_FOREACH (const PAIRTYPE(const uint256, CTxMemPoolEntry) & entry, mempool.mapTx) {
             const uint256& hash = entry.first;
             const CTxMemPoolEntry& e = entry.second;
             UniValue info(UniValue::VOBJ);
@@ -953,6 +953,82 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue getmempoolstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolstats\n"
+            "\nReturns admission, rejection and removal statistics of the TX memory pool since startup.\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"accepted\": xxxxx            (numeric) Transactions accepted\n"
+            "  \"rejected\": xxxxx            (numeric) Transactions rejected, including orphans\n"
+            "  \"latency\": {                 (json object) Admission time percentiles, in microseconds\n"
+            "    \"p50\": xxxxx,\n"
+            "    \"p90\": xxxxx,\n"
+            "    \"p99\": xxxxx\n"
+            "  },\n"
+            "  \"rejects\": {                 (json object) Rejected transactions by reject reason\n"
+            "    \"reason\": xxxxx,           (numeric) The number of rejects with this reason\n"
+            "    ...\n"
+            "  },\n"
+            "  \"removed\": {                 (json object) Transactions removed from the pool by reason\n"
+            "    \"block\": xxxxx,            (numeric) Included in a block\n"
+            "    \"conflict\": xxxxx,         (numeric) Double spent by a block or a locked transaction\n"
+            "    \"reorg\": xxxxx,            (numeric) Invalid after a block was disconnected\n"
+            "    \"unknown\": xxxxx           (numeric) Removed for any other reason\n"
+            "  },\n"
+            "  \"feerates\": [                (json array) Transactions currently in the pool by fee rate\n"
+            "    {\n"
+            "      \"minfeerate\": x.xxxx,    (numeric) Lowest fee rate of this bucket in baas/kb\n"
+            "      \"size\": xxxxx,           (numeric) Transactions in this bucket\n"
+            "      \"bytes\": xxxxx           (numeric) Sum of their sizes\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getmempoolstats", "") + HelpExampleRpc("getmempoolstats", ""));
+
+    // Only counters are read here, neither cs_main nor mempool.cs is needed
+    const CMemPoolStats& stats = mempool.stats;
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("accepted", (int64_t)stats.GetAccepted()));
+    ret.push_back(Pair("rejected", (int64_t)stats.GetRejected()));
+
+    UniValue latency(UniValue::VOBJ);
+    latency.push_back(Pair("p50", stats.GetLatencyPercentile(0.5)));
+    latency.push_back(Pair("p90", stats.GetLatencyPercentile(0.9)));
+    latency.push_back(Pair("p99", stats.GetLatencyPercentile(0.99)));
+    ret.push_back(Pair("latency", latency));
+
+    UniValue rejects(UniValue::VOBJ);
+    std::map<std::string, uint64_t> mapRejects = stats.GetRejects();
+    for (std::map<std::string, uint64_t>::const_iterator it = mapRejects.begin(); it != mapRejects.end(); ++it)
+        rejects.push_back(Pair(it->first, (int64_t)it->second));
+    ret.push_back(Pair("rejects", rejects));
+
+    UniValue removed(UniValue::VOBJ);
+    for (unsigned int i = 0; i < MEMPOOL_REMOVAL_REASONS; i++) {
+        MemPoolRemovalReason reason = (MemPoolRemovalReason)i;
+        removed.push_back(Pair(RemovalReasonToString(reason), (int64_t)stats.GetRemoved(reason)));
+    }
+    ret.push_back(Pair("removed", removed));
+
+    UniValue feerates(UniValue::VARR);
+    for (unsigned int i = 0; i < CMemPoolStats::FEE_BUCKETS; i++) {
+        UniValue bucket(UniValue::VOBJ);
+        bucket.push_back(Pair("minfeerate", ValueFromAmount(CMemPoolStats::GetFeeBucketStart(i))));
+        bucket.push_back(Pair("size", (int64_t)stats.GetFeeBucketCount(i)));
+        bucket.push_back(Pair("bytes", (int64_t)stats.GetFeeBucketBytes(i)));
+        feerates.push_back(bucket);
+    }
+    ret.push_back(Pair("feerates", feerates));
+
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -203,6 +203,8 @@ UniValue listmasternodes(const UniValue& params, bool fHelp)
         nHeight = pindex->nHeight;
     }
     std::vector<pair<int, CMasternode> > vMasternodeRanks = mnodeman.GetMasternodeRanks(nHeight);
+    // how far back GetLastPaid() looks, counted once for the whole list
+    int nPaidDepth = mnodeman.CountEnabled() * 1.25;
     BOOST_FOREACH (PAIRTYPE(int, CMasternode) & s, vMasternodeRanks) {
         UniValue obj(UniValue::VOBJ);
         std::string strVin = s.second.vin.prevout.ToStringShort();
@@ -233,7 +235,7 @@ UniValue listmasternodes(const UniValue& params, bool fHelp)
             obj.push_back(Pair("version", mn->protocolVersion));
             obj.push_back(Pair("lastseen", (int64_t)mn->lastPing.sigTime));
             obj.push_back(Pair("activetime", (int64_t)(mn->lastPing.sigTime - mn->sigTime)));
-            obj.push_back(Pair("lastpaid", (int64_t)mn->GetLastPaid()));
+            obj.push_back(Pair("lastpaid", (int64_t)mn->GetLastPaid(nPaidDepth)));
 
             ret.push_back(obj);
         }
@@ -821,14 +823,21 @@ UniValue getmasternodescores (const UniValue& params, bool fHelp)
     UniValue obj(UniValue::VOBJ);
 
     std::vector<CMasternode> vMasternodes = mnodeman.GetFullMasternodeVector();
+    std::vector<CMasternode*> vpmn;
+    BOOST_FOREACH (CMasternode& mn, vMasternodes)
+        vpmn.push_back(&mn);
+    std::vector<uint256> vScore;
     for (int nHeight = chainActive.Tip()->nHeight - nLast; nHeight < chainActive.Tip()->nHeight + 20; nHeight++) {
+        uint256 hash = 0;
+        if (!GetBlockHash(hash, nHeight - 100)) continue;
+        CalculateMasternodeScores(hash, vpmn, vScore);
+
         uint256 nHigh = 0;
         CMasternode* pBestMasternode = NULL;
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-            uint256 n = mn.CalculateScore(1, nHeight - 100);
-            if (n > nHigh) {
-                nHigh = n;
-                pBestMasternode = &mn;
+        for (size_t i = 0; i < vpmn.size(); i++) {
+            if (vScore[i] > nHigh) {
+                nHigh = vScore[i];
+                pBestMasternode = vpmn[i];
             }
         }
         if (pBestMasternode)
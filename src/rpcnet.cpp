@@ -77,6 +77,17 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static UniValue NetMsgTypeStatsToJSON(const CNetMsgTypeStats& stats)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("recvmsgs", stats.nRecvMsgs));
+    obj.push_back(Pair("recvbytes", stats.nRecvBytes));
+    obj.push_back(Pair("sentmsgs", stats.nSentMsgs));
+    obj.push_back(Pair("sentbytes", stats.nSentBytes));
+    obj.push_back(Pair("processms", stats.nProcessUsec / 1000.0));
+    return obj;
+}
+
 UniValue getpeerinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -99,6 +110,7 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"timeoffset\": ttt,         (numeric) The time offset in seconds\n"
             "    \"pingtime\": n,             (numeric) ping time\n"
             "    \"pingwait\": n,             (numeric) ping wait\n"
+            "    \"minping\": n,              (numeric) lowest ping time seen\n"
             "    \"version\": v,              (numeric) The peer version, such as 7001\n"
             "    \"subver\": \"/BaaS Core:x.x.x.x/\",  (string) The string version\n"
             "    \"inbound\": true|false,     (boolean) Inbound (true) or Outbound (false)\n"
@@ -109,7 +121,16 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"msgstats\": {             (json object) Traffic of this peer by message type, types seen only\n"
+            "      \"type\": {                (json object) The message type, such as \"inv\", or \"other\" for unknown ones\n"
+            "        \"recvmsgs\": n,        (numeric) Messages received\n"
+            "        \"recvbytes\": n,       (numeric) Bytes received, headers included\n"
+            "        \"sentmsgs\": n,        (numeric) Messages sent\n"
+            "        \"sentbytes\": n,       (numeric) Bytes sent, headers included\n"
+            "        \"processms\": n        (numeric) Milliseconds spent handling the received messages\n"
+            "      }, ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -142,6 +163,8 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         obj.push_back(Pair("pingtime", stats.dPingTime));
         if (stats.dPingWait > 0.0)
             obj.push_back(Pair("pingwait", stats.dPingWait));
+        if (stats.dMinPing > 0.0)
+            obj.push_back(Pair("minping", stats.dMinPing));
         obj.push_back(Pair("version", stats.nVersion));
         // Use the sanitized form of subver here, to avoid tricksy remote peers from
         // corrupting or modifiying the JSON output by putting special characters in
@@ -160,6 +183,10 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             obj.push_back(Pair("inflight", heights));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        UniValue msgstats(UniValue::VOBJ);
+        for (std::map<std::string, CNetMsgTypeStats>::const_iterator it = stats.mapMsgStats.begin(); it != stats.mapMsgStats.end(); ++it)
+            msgstats.push_back(Pair(it->first, NetMsgTypeStatsToJSON(it->second)));
+        obj.push_back(Pair("msgstats", msgstats));
 
         ret.push_back(obj);
     }
@@ -355,7 +382,16 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"uploadtarget\":\n"
+            "  {\n"
+            "    \"timeframe\": n,                         (numeric) Length of the measuring timeframe in seconds\n"
+            "    \"target\": n,                            (numeric) Target in bytes, 0 if -maxuploadtarget is not set\n"
+            "    \"target_reached\": true|false,           (boolean) True if target is reached\n"
+            "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
+            "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
+            "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  }\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -365,6 +401,54 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    UniValue outboundLimit(UniValue::VOBJ);
+    outboundLimit.push_back(Pair("timeframe", MAX_UPLOAD_TIMEFRAME));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
+    return obj;
+}
+
+UniValue getnetmsgstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetmsgstats\n"
+            "\nReturns network traffic and message handling time by message type, summed over all\n"
+            "peers since startup. Use getpeerinfo for the same numbers per peer.\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"type\": {            (json object) The message type, such as \"inv\", or \"other\" for unknown ones\n"
+            "    \"recvmsgs\": n,    (numeric) Messages received\n"
+            "    \"recvbytes\": n,   (numeric) Bytes received, headers included\n"
+            "    \"sentmsgs\": n,    (numeric) Messages sent\n"
+            "    \"sentbytes\": n,   (numeric) Bytes sent, headers included\n"
+            "    \"processms\": n    (numeric) Milliseconds spent handling the received messages\n"
+            "  }, ...\n"
+            "  \"total\": {...}       (json object) All message types together\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getnetmsgstats", "") + HelpExampleRpc("getnetmsgstats", ""));
+
+    std::vector<CNetMsgTypeStats> vStats;
+    CNode::GetMsgStatsTotal(vStats);
+    const std::vector<std::string>& vTypes = GetAllNetMessageTypes();
+
+    UniValue obj(UniValue::VOBJ);
+    CNetMsgTypeStats total;
+    for (unsigned int i = 0; i < vStats.size(); i++) {
+        if (vStats[i].IsNull())
+            continue;
+        obj.push_back(Pair(vTypes[i], NetMsgTypeStatsToJSON(vStats[i])));
+        total += vStats[i];
+    }
+    obj.push_back(Pair("total", NetMsgTypeStatsToJSON(total)));
     return obj;
 }
 
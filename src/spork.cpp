@@ -65,6 +65,8 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
         CSporkMessage spork;
         vRecv >> spork;
 
+        pfrom->AddInventoryKnown(CInv(MSG_SPORK, spork.GetHash()));
+
         if (chainActive.Tip() == NULL) return;
 
         // Ignore spork messages about unknown/deleted sporks
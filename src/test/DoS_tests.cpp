@@ -14,6 +14,7 @@
 #include "pow.h"
 #include "script/sign.h"
 #include "serialize.h"
+#include "streams.h"
 #include "util.h"
 
 #include <stdint.h>
@@ -26,13 +27,15 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxBytes, unsigned int nMaxPerPeer);
 struct COrphanTx {
-    CTransaction tx;
+    std::vector<unsigned char> vchTx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern size_t nOrphanTransactionsBytes;
 
 CService ip(uint32_t i)
 {
@@ -112,7 +115,22 @@ CTransaction RandomOrphan()
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    CDataStream ss(it->second.vchTx, SER_NETWORK, PROTOCOL_VERSION);
+    CTransaction tx;
+    ss >> tx;
+    return tx;
+}
+
+CMutableTransaction OrphanSpending(const uint256& hashPrev)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -187,13 +205,59 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, 1000000, 100);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, 1000000, 100);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, 1000000, 100);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsBytes, 0);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphansLimits)
+{
+    // Per-peer quota: peer 1 keeps only its newest orphans, peer 2 is untouched
+    std::vector<uint256> vPeer1;
+    for (int i = 0; i < 10; i++) {
+        CTransaction tx = OrphanSpending(GetRandHash());
+        BOOST_CHECK(AddOrphanTx(tx, 1));
+        vPeer1.push_back(tx.GetHash());
+    }
+    BOOST_CHECK(AddOrphanTx(OrphanSpending(GetRandHash()), 2));
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(100, 1000000, 4), 6);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 5);
+    for (int i = 0; i < 6; i++)
+        BOOST_CHECK(!mapOrphanTransactions.count(vPeer1[i]));
+    for (int i = 6; i < 10; i++)
+        BOOST_CHECK(mapOrphanTransactions.count(vPeer1[i]));
+
+    // Byte budget: the peer using the most memory is evicted first
+    size_t nTxSize = nOrphanTransactionsBytes / mapOrphanTransactions.size();
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(100, nTxSize * 2, 4), 3);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 2);
+    BOOST_CHECK_EQUAL(nOrphanTransactionsBytes, nTxSize * 2);
+    BOOST_CHECK(mapOrphanTransactions.count(vPeer1[9]));
+
+    // EraseOrphansFor only touches the given peer
+    EraseOrphansFor(1);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 1);
+    EraseOrphansFor(1);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 1);
+
+    // Expiry
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL + 1);
+    BOOST_CHECK(AddOrphanTx(OrphanSpending(GetRandHash()), 3));
+    BOOST_CHECK_EQUAL(LimitOrphanTxSize(100, 1000000, 4), 0);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 1);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.begin()->second.fromPeer, 3);
+    SetMockTime(0);
+
+    LimitOrphanTxSize(0, 0, 0);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsBytes, 0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
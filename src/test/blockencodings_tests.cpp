@@ -0,0 +1,208 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018-2019 The BaaS developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CBlock BuildBlockTestCase(bool fProofOfStake)
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    // Coinbase
+    block.vtx.push_back(tx);
+
+    if (fProofOfStake) {
+        CMutableTransaction txCoinStake;
+        txCoinStake.vin.resize(1);
+        txCoinStake.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        txCoinStake.vout.resize(2);
+        txCoinStake.vout[0].SetEmpty();
+        txCoinStake.vout[1].nValue = 4200;
+        block.vtx.push_back(txCoinStake);
+        BOOST_CHECK(block.vtx[1].IsCoinStake());
+    }
+
+    for (int i = 0; i < 3; i++) {
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].prevout.n = 0;
+        block.vtx.push_back(tx);
+    }
+
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+    block.nTime = 1536000000;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    if (fProofOfStake)
+        block.vchBlockSig.assign(72, 0x42);
+    return block;
+}
+
+static void AddToMempool(CTxMemPool& pool, const CTransaction& tx)
+{
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, 0, 0.0, 1));
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase(false));
+    BOOST_CHECK(block.IsProofOfWork());
+
+    AddToMempool(pool, block.vtx[2]);
+
+    // Do a simple ShortTxIDs RT
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortIDs;
+    BOOST_CHECK_EQUAL(stream.size(), shortIDs.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION));
+
+    CBlockHeaderAndShortTxIDs shortIDs2;
+    stream >> shortIDs2;
+    BOOST_CHECK_EQUAL(shortIDs2.BlockTxCount(), block.vtx.size());
+    BOOST_CHECK_EQUAL(shortIDs2.GetShortID(block.vtx[2].GetHash()), shortIDs.GetShortID(block.vtx[2].GetHash()));
+
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(shortIDs2, pool) == READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.GetHeader().GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 1U);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(3));
+
+    // Too few or too many transactions for the missing slots
+    CBlock block2;
+    std::vector<CTransaction> vtx_missing;
+    vtx_missing.push_back(block.vtx[1]);
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_INVALID);
+    vtx_missing.push_back(block.vtx[3]);
+    vtx_missing.push_back(block.vtx[3]);
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_INVALID);
+
+    // Wrong transactions show up as a merkle root mismatch
+    vtx_missing.pop_back();
+    std::swap(vtx_missing[0], vtx_missing[1]);
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_FAILED);
+
+    std::swap(vtx_missing[0], vtx_missing[1]);
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtx_missing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+    bool fMutated;
+    BOOST_CHECK_EQUAL(block2.BuildMerkleTree(&fMutated).ToString(), block.hashMerkleRoot.ToString());
+    BOOST_CHECK(!fMutated);
+}
+
+BOOST_AUTO_TEST_CASE(ProofOfStakeTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase(true));
+    BOOST_CHECK(block.IsProofOfStake());
+
+    for (size_t i = 2; i < block.vtx.size(); i++)
+        AddToMempool(pool, block.vtx[i]);
+
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << shortIDs;
+    CBlockHeaderAndShortTxIDs shortIDs2;
+    stream >> shortIDs2;
+
+    // The coinstake is never in a mempool, so it is sent along with the coinbase
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(shortIDs2, pool) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), block.vtx.size() - 2);
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(partialBlock.IsTxAvailable(i));
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, std::vector<CTransaction>()) == READ_STATUS_OK);
+    BOOST_CHECK(block2.IsProofOfStake());
+    BOOST_CHECK(block2.vtx[1].GetHash() == block.vtx[1].GetHash());
+    BOOST_CHECK(block2.vchBlockSig == block.vchBlockSig);
+
+    // Byte for byte the block that was sent, signature included
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION), ssBlock2(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << block;
+    ssBlock2 << block2;
+    BOOST_CHECK(ssBlock.str() == ssBlock2.str());
+}
+
+BOOST_AUTO_TEST_CASE(EmptyMempoolTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase(true));
+
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+    PartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(shortIDs, pool) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 0U);
+
+    BlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        if (!partialBlock.IsTxAvailable(i))
+            req.indexes.push_back(i);
+    }
+    BOOST_CHECK_EQUAL(req.indexes.size(), block.vtx.size() - 2);
+
+    // Answer the request the way a peer would, through the wire format
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req;
+    BlockTransactionsRequest req2;
+    stream >> req2;
+    BOOST_CHECK(req2.blockhash == req.blockhash);
+    BOOST_CHECK(req2.indexes == req.indexes);
+
+    BlockTransactions resp(req2);
+    for (size_t i = 0; i < req2.indexes.size(); i++)
+        resp.txn[i] = block.vtx[req2.indexes[i]];
+    stream << resp;
+    BlockTransactions resp2;
+    stream >> resp2;
+
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, resp2.txn) == READ_STATUS_OK);
+    BOOST_CHECK(block2.GetHash() == block.GetHash());
+    BOOST_CHECK(block2.vchBlockSig == block.vchBlockSig);
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest)
+{
+    BlockTransactionsRequest req1;
+    req1.blockhash = GetRandHash();
+    req1.indexes.resize(4);
+    req1.indexes[0] = 0;
+    req1.indexes[1] = 1;
+    req1.indexes[2] = 3;
+    req1.indexes[3] = 4;
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+
+    BlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK_EQUAL(req1.blockhash.ToString(), req2.blockhash.ToString());
+    BOOST_CHECK_EQUAL(req1.indexes.size(), req2.indexes.size());
+    BOOST_CHECK_EQUAL(req1.indexes[0], req2.indexes[0]);
+    BOOST_CHECK_EQUAL(req1.indexes[1], req2.indexes[1]);
+    BOOST_CHECK_EQUAL(req1.indexes[2], req2.indexes[2]);
+    BOOST_CHECK_EQUAL(req1.indexes[3], req2.indexes[3]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
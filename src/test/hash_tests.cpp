@@ -46,4 +46,24 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Test vectors from the SipHash paper, key 00 01 .. 0f and message 00 01 .. (n-1)
+    unsigned char vchData[32];
+    for (int i = 0; i < 32; i++)
+        vchData[i] = i;
+    const uint64_t k0 = 0x0706050403020100ULL, k1 = 0x0F0E0D0C0B0A0908ULL;
+    BOOST_CHECK_EQUAL(CSipHasher(k0, k1).Finalize(), 0x726fdb47dd0e0e31ULL);
+    BOOST_CHECK_EQUAL(CSipHasher(k0, k1).Write(vchData, 8).Finalize(), 0x93f5f5799a932462ULL);
+    BOOST_CHECK_EQUAL(CSipHasher(k0, k1).Write(vchData, 15).Finalize(), 0xa129ca6149be45e5ULL);
+    BOOST_CHECK_EQUAL(CSipHasher(k0, k1).Write(vchData, 32).Finalize(), 0x7127512f72f27cceULL);
+
+    // Writing in pieces gives the same result
+    BOOST_CHECK_EQUAL(CSipHasher(k0, k1).Write(vchData, 3).Write(vchData + 3, 12).Finalize(), 0xa129ca6149be45e5ULL);
+
+    // The uint256 shortcut
+    uint256 hash("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100");
+    BOOST_CHECK_EQUAL(SipHashUint256(k0, k1, hash), 0x7127512f72f27cceULL);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
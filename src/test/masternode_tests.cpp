@@ -0,0 +1,444 @@
+// Copyright (c) 2018-2019 The BaaS developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "masternodeman.h"
+
+#include "clientversion.h"
+#include "hash.h"
+#include "key.h"
+#include "masternode-payments.h"
+#include "random.h"
+#include "script/standard.h"
+#include "txmempool.h"
+#include "validationinterface.h"
+
+#include <boost/test/unit_test.hpp>
+
+static CMasternodeBroadcast MakeBroadcast(const CKey& keyCollateral, const CKey& keyMasternode, const std::string& strAddr)
+{
+    CMasternodeBroadcast mnb;
+    mnb.vin = CTxIn(COutPoint(GetRandHash(), 0));
+    mnb.pubKeyCollateralAddress = keyCollateral.GetPubKey();
+    mnb.pubKeyMasternode = keyMasternode.GetPubKey();
+    mnb.addr = CService(strAddr);
+    mnb.sigTime = GetAdjustedTime();
+    mnb.lastPing.vin = mnb.vin;
+    mnb.lastPing.sigTime = mnb.sigTime;
+    return mnb;
+}
+
+// GetLastPaid as it was: walk back from the tip looking for a block with the payee at 2 votes
+static int64_t LastPaidByChainWalk(CMasternode& mn, int nDepth)
+{
+    CScript mnpayee = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << mn.vin;
+    ss << mn.sigTime;
+    int64_t nOffset = ss.GetHash().GetCompact(false) % 150;
+
+    int n = 0;
+    for (const CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->nHeight > 0; pindex = pindex->pprev) {
+        if (n++ >= nDepth) return 0;
+        if (masternodePayments.mapMasternodeBlocks.count(pindex->nHeight) &&
+            masternodePayments.mapMasternodeBlocks[pindex->nHeight].HasPayeeWithVotes(mnpayee, 2))
+            return pindex->nTime + nOffset;
+    }
+    return 0;
+}
+
+// CalculateScore as it was: two hash writers per masternode
+static uint256 ScoreByHashWriters(const CMasternode& mn, const uint256& hashBlock)
+{
+    uint256 aux = mn.vin.prevout.hash + mn.vin.prevout.n;
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << hashBlock;
+    uint256 hash2 = ss.GetHash();
+    CHashWriter ss2(SER_GETHASH, PROTOCOL_VERSION);
+    ss2 << hashBlock;
+    ss2 << aux;
+    uint256 hash3 = ss2.GetHash();
+    return (hash3 > hash2 ? hash3 - hash2 : hash2 - hash3);
+}
+
+// The rank of vin among enabled masternodes by recomputing and sorting every score
+static int RankBySorting(CMasternodeMan& man, const CTxIn& vin, int64_t nBlockHeight)
+{
+    std::vector<std::pair<int64_t, COutPoint> > vScores;
+    std::vector<CMasternode> vMasternodes = man.GetFullMasternodeVector();
+    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        mn.Check();
+        if (!mn.IsEnabled()) continue;
+        vScores.push_back(std::make_pair(mn.CalculateScore(1, nBlockHeight).GetCompact(false), mn.vin.prevout));
+    }
+    std::sort(vScores.rbegin(), vScores.rend());
+    for (size_t i = 0; i < vScores.size(); i++) {
+        if (vScores[i].second == vin.prevout) return i + 1;
+    }
+    return -1;
+}
+
+BOOST_AUTO_TEST_SUITE(masternode_tests)
+
+BOOST_AUTO_TEST_CASE(masternodeman_indexes)
+{
+    CMasternodeMan man;
+    std::vector<CKey> vKey(4);
+    BOOST_FOREACH (CKey& key, vKey)
+        key.MakeNewKey(true);
+
+    CMasternodeBroadcast mnb1 = MakeBroadcast(vKey[0], vKey[1], "1.2.3.4:51472");
+    CMasternodeBroadcast mnb2 = MakeBroadcast(vKey[0], vKey[2], "1.2.3.5:51472");
+    // broadcasts are hashed by collateral key and time only
+    mnb2.sigTime -= 10;
+    CMasternode mn1(mnb1), mn2(mnb2);
+    BOOST_CHECK(man.Add(mn1));
+    BOOST_CHECK(man.Add(mn2));
+    BOOST_CHECK(!man.Add(mn2));
+    BOOST_CHECK_EQUAL(man.size(), 2);
+    man.AddSeenBroadcast(mnb1);
+    man.AddSeenPing(mnb1.lastPing);
+    man.AddSeenBroadcast(mnb2);
+
+    // Entries don't move when others are added
+    CMasternode* pmn1 = man.Find(mnb1.vin);
+    BOOST_REQUIRE(pmn1 != NULL);
+    for (int i = 0; i < 100; i++) {
+        CMasternode mn(MakeBroadcast(vKey[3], vKey[3], strprintf("2.0.0.%d:51472", i)));
+        man.Add(mn);
+    }
+    BOOST_CHECK(man.Find(mnb1.vin) == pmn1);
+
+    BOOST_CHECK(man.Find(mnb1.pubKeyMasternode) == pmn1);
+    BOOST_CHECK(man.Find(mnb2.pubKeyMasternode) == man.Find(mnb2.vin));
+    BOOST_CHECK(man.Find(CNetAddr("1.2.3.4")) == pmn1);
+    BOOST_CHECK(man.Find(CNetAddr("1.2.3.6")) == NULL);
+    BOOST_CHECK(man.Find(vKey[0].GetPubKey()) == NULL);
+
+    // Two entries share the collateral address, the lowest outpoint is found
+    CScript payee = GetScriptForDestination(vKey[0].GetPubKey().GetID());
+    CMasternode* pmnPayee = man.Find(payee);
+    BOOST_REQUIRE(pmnPayee != NULL);
+    BOOST_CHECK(pmnPayee->vin.prevout == std::min(mnb1.vin.prevout, mnb2.vin.prevout));
+    BOOST_CHECK(man.Find(GetScriptForDestination(vKey[1].GetPubKey().GetID())) == NULL);
+
+    // The indexes follow a newer broadcast
+    CMasternodeBroadcast mnbNew = MakeBroadcast(vKey[0], vKey[3], "1.2.3.7:51472");
+    mnbNew.vin = mnb1.vin;
+    mnbNew.sigTime = mnb1.sigTime + 1;
+    mnbNew.lastPing = CMasternodePing();
+    BOOST_CHECK(man.UpdateFromNewBroadcast(*pmn1, mnbNew));
+    BOOST_CHECK(man.Find(mnb1.pubKeyMasternode) == NULL);
+    BOOST_CHECK(man.Find(CNetAddr("1.2.3.4")) == NULL);
+    BOOST_CHECK(man.Find(CNetAddr("1.2.3.7")) == pmn1);
+
+    // Removing an entry forgets what was seen from its vin only
+    man.Remove(mnb1.vin);
+    BOOST_CHECK(man.Find(mnb1.vin) == NULL);
+    BOOST_CHECK(man.Find(CNetAddr("1.2.3.7")) == NULL);
+    BOOST_CHECK(man.Find(payee) == man.Find(mnb2.vin));
+    BOOST_CHECK(!man.mapSeenMasternodeBroadcast.count(mnb1.GetHash()));
+    BOOST_CHECK(!man.mapSeenMasternodePing.count(mnb1.lastPing.GetHash()));
+    BOOST_CHECK(man.mapSeenMasternodeBroadcast.count(mnb2.GetHash()));
+    BOOST_CHECK_EQUAL(man.size(), 101);
+
+    // The list and its indexes survive a round trip through mncache.dat's format
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << man;
+    CMasternodeMan man2;
+    ss >> man2;
+    BOOST_CHECK_EQUAL(man2.size(), 101);
+    CMasternode* pmn2 = man2.Find(mnb2.pubKeyMasternode);
+    BOOST_REQUIRE(pmn2 != NULL);
+    BOOST_CHECK(pmn2->vin == mnb2.vin);
+    BOOST_CHECK(man2.Find(CNetAddr("2.0.0.50")) != NULL);
+    man2.Remove(mnb2.vin);
+    BOOST_CHECK(!man2.mapSeenMasternodeBroadcast.count(mnb2.GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(last_paid_replay)
+{
+    // A chain that only has heights, times and hashes
+    const int nBlocks = 1500;
+    std::vector<uint256> vHash(nBlocks);
+    std::vector<CBlockIndex> vBlock(nBlocks);
+    for (int i = 0; i < nBlocks; i++) {
+        vHash[i] = GetRandHash();
+        vBlock[i].phashBlock = &vHash[i];
+        vBlock[i].nHeight = i;
+        vBlock[i].nTime = 1500000000 + i * 60;
+        vBlock[i].pprev = i ? &vBlock[i - 1] : NULL;
+    }
+    CBlockIndex* pindexOld = chainActive.Tip();
+
+    std::vector<CMasternode> vMn(40);
+    std::vector<CScript> vPayee;
+    for (size_t i = 0; i < vMn.size(); i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        vMn[i].vin = CTxIn(COutPoint(GetRandHash(), 0));
+        vMn[i].pubKeyCollateralAddress = key.GetPubKey();
+        vMn[i].sigTime = i;
+        vPayee.push_back(GetScriptForDestination(key.GetPubKey().GetID()));
+    }
+
+    // Replay blocks and payment votes, comparing last paid times with the chain walk at every tip
+    masternodePayments.Clear();
+    mapCacheBlockHashes.clear();
+    const int vDepth[] = {0, 7, 50, 1250};
+    int nPaid = 0;
+    for (int nHeight = 1; nHeight < nBlocks; nHeight++) {
+        chainActive.SetTip(&vBlock[nHeight]);
+
+        // votes for a block ahead, one payee usually gets 2 or more of them
+        int nVotes = GetRand(4);
+        CScript payee = vPayee[GetRand(vPayee.size())];
+        for (int j = 0; j <= nVotes; j++) {
+            CMasternodePaymentWinner winner(CTxIn(COutPoint(GetRandHash(), 0)));
+            winner.nBlockHeight = nHeight + 10;
+            winner.payee = j < nVotes ? payee : vPayee[GetRand(vPayee.size())];
+            masternodePayments.AddWinningMasternode(winner);
+        }
+        if (nHeight % 100 == 0)
+            masternodePayments.CleanPaymentList();
+
+        BOOST_FOREACH (CMasternode& mn, vMn) {
+            BOOST_FOREACH (int nDepth, vDepth) {
+                int64_t nLastPaid = mn.GetLastPaid(nDepth);
+                BOOST_CHECK_EQUAL(nLastPaid, LastPaidByChainWalk(mn, nDepth));
+                if (nLastPaid) nPaid++;
+            }
+        }
+    }
+    BOOST_CHECK(nPaid > 0);
+
+    // The index is rebuilt from mnpayments.dat's format
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << masternodePayments;
+    masternodePayments.Clear();
+    ss >> masternodePayments;
+    BOOST_FOREACH (CMasternode& mn, vMn)
+        BOOST_CHECK_EQUAL(mn.GetLastPaid(1250), LastPaidByChainWalk(mn, 1250));
+
+    chainActive.SetTip(pindexOld);
+    masternodePayments.Clear();
+    mapCacheBlockHashes.clear();
+}
+
+BOOST_AUTO_TEST_CASE(masternode_rank_cache)
+{
+    const int nBlocks = 50;
+    std::vector<uint256> vHash(nBlocks);
+    std::vector<CBlockIndex> vBlock(nBlocks);
+    for (int i = 0; i < nBlocks; i++) {
+        vHash[i] = GetRandHash();
+        vBlock[i].phashBlock = &vHash[i];
+        vBlock[i].nHeight = i;
+        vBlock[i].nTime = 1500000000 + i * 60;
+        vBlock[i].pprev = i ? &vBlock[i - 1] : NULL;
+    }
+    CBlockIndex* pindexOld = chainActive.Tip();
+    chainActive.SetTip(&vBlock.back());
+    mapCacheBlockHashes.clear();
+
+    // Enabled masternodes, their collateral isn't checked
+    CMasternodeMan man;
+    CKey key;
+    key.MakeNewKey(true);
+    std::vector<CTxIn> vVin;
+    for (int i = 0; i < 30; i++) {
+        CMasternodeBroadcast mnb = MakeBroadcast(key, key, strprintf("3.0.0.%d:51472", i));
+        mnb.sigTime -= MASTERNODE_MIN_MNP_SECONDS + 1;
+        CMasternode mn(mnb);
+        man.Add(mn);
+        vVin.push_back(mnb.vin);
+    }
+
+    BOOST_FOREACH (const CTxIn& vin, vVin) {
+        CMasternode* pmn = man.Find(vin);
+        BOOST_REQUIRE(pmn != NULL);
+        // scores for a height are made from the hash of the block before it
+        BOOST_CHECK(pmn->CalculateScore(1, 20) == ScoreByHashWriters(*pmn, vHash[19]));
+        BOOST_CHECK(pmn->CalculateScore(1, 0) == ScoreByHashWriters(*pmn, vHash[nBlocks - 2]));
+    }
+
+    // The cached ranks are the sorted ones, at any height and at the tip
+    for (int nHeight = 0; nHeight < nBlocks; nHeight += 7) {
+        BOOST_FOREACH (const CTxIn& vin, vVin) {
+            int nRank = man.GetMasternodeRank(vin, nHeight, 0);
+            BOOST_CHECK_EQUAL(nRank, RankBySorting(man, vin, nHeight));
+            BOOST_CHECK(man.GetMasternodeByRank(nRank, nHeight, 0)->vin == vin);
+        }
+    }
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(vVin[0], 0, 0), RankBySorting(man, vVin[0], nBlocks - 1));
+    BOOST_CHECK(man.GetCurrentMasterNode(1, 10, 0) == man.GetMasternodeByRank(1, 10, 0));
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(CTxIn(COutPoint(GetRandHash(), 0)), 10, 0), -1);
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(vVin[0], nBlocks + 5, 0), -1);
+
+    std::vector<std::pair<int, CMasternode> > vRanks = man.GetMasternodeRanks(10, 0);
+    BOOST_CHECK_EQUAL(vRanks.size(), vVin.size());
+    for (size_t i = 0; i < vRanks.size(); i++)
+        BOOST_CHECK_EQUAL(vRanks[i].first, RankBySorting(man, vRanks[i].second.vin, 10));
+
+    // Adding or removing an entry drops the cache
+    man.Remove(vVin[5]);
+    BOOST_CHECK_EQUAL(man.GetMasternodeRank(vVin[5], 10, 0), -1);
+    CMasternodeBroadcast mnb = MakeBroadcast(key, key, "3.0.1.0:51472");
+    mnb.sigTime -= MASTERNODE_MIN_MNP_SECONDS + 1;
+    CMasternode mn(mnb);
+    man.Add(mn);
+    BOOST_CHECK(man.GetMasternodeRank(mnb.vin, 10, 0) > 0);
+    BOOST_FOREACH (const CTxIn& vin, vVin) {
+        if (vin == vVin[5]) continue;
+        BOOST_CHECK_EQUAL(man.GetMasternodeRank(vin, 10, 0), RankBySorting(man, vin, 10));
+    }
+
+    // A block replaced at a cached height is noticed
+    mapCacheBlockHashes.clear();
+    vHash[9] = GetRandHash();
+    BOOST_FOREACH (const CTxIn& vin, vVin) {
+        if (vin == vVin[5]) continue;
+        BOOST_CHECK_EQUAL(man.GetMasternodeRank(vin, 10, 0), RankBySorting(man, vin, 10));
+    }
+
+    chainActive.SetTip(pindexOld);
+    mapCacheBlockHashes.clear();
+}
+
+BOOST_AUTO_TEST_CASE(collateral_spent_tracking)
+{
+    LOCK(cs_main);
+
+    // Collaterals of 5 enabled masternodes on chain, and one that is too small
+    CKey key;
+    key.MakeNewKey(true);
+    CMutableTransaction txCollateral;
+    txCollateral.vin.resize(1);
+    txCollateral.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txCollateral.vout.resize(6);
+    for (int i = 0; i < 6; i++) {
+        txCollateral.vout[i].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+        txCollateral.vout[i].nValue = i < 5 ? GetMasterNodeCollateral(0) * COIN : COIN;
+    }
+    CTransaction tx(txCollateral);
+    pcoinsTip->ModifyCoins(tx.GetHash())->FromTx(tx, 1);
+
+    CMasternodeMan man;
+    std::vector<CTxIn> vVin;
+    for (int i = 0; i < 6; i++) {
+        CMasternodeBroadcast mnb = MakeBroadcast(key, key, strprintf("4.0.0.%d:51472", i));
+        mnb.vin = CTxIn(COutPoint(tx.GetHash(), i));
+        mnb.sigTime -= MASTERNODE_MIN_MNP_SECONDS + 1;
+        CMasternode mn(mnb);
+        man.Add(mn);
+        vVin.push_back(mnb.vin);
+    }
+    int nHeight;
+    BOOST_CHECK(GetCollateralHeight(vVin[0].prevout, nHeight));
+    BOOST_CHECK_EQUAL(nHeight, 1);
+    BOOST_CHECK(!GetCollateralHeight(vVin[5].prevout, nHeight));
+    BOOST_CHECK(!GetCollateralHeight(COutPoint(tx.GetHash(), 6), nHeight));
+
+    man.CheckCollaterals();
+    for (int i = 0; i < 6; i++) {
+        CMasternode* pmn = man.Find(vVin[i]);
+        pmn->Check(true);
+        BOOST_CHECK_EQUAL(pmn->IsEnabled(), i < 5);
+    }
+
+    RegisterValidationInterface(&man);
+
+    // Spent by a mempool transaction
+    CMutableTransaction txSpend;
+    txSpend.vin.push_back(vVin[0]);
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = COIN;
+    mempool.addUnchecked(CTransaction(txSpend).GetHash(), CTxMemPoolEntry(txSpend, 0, 0, 0, 1));
+    GetMainSignals().SyncTransaction(txSpend, NULL);
+    BOOST_CHECK(man.Find(vVin[0])->activeState == CMasternode::MASTERNODE_VIN_SPENT);
+    BOOST_CHECK(man.Find(vVin[1])->IsEnabled());
+
+    // Spent by a connected block
+    txSpend.vin[0] = vVin[1];
+    CBlock block;
+    block.vtx.push_back(txSpend);
+    pcoinsTip->ModifyCoins(tx.GetHash())->Spend(1);
+    GetMainSignals().SyncTransaction(block.vtx[0], &block);
+    BOOST_CHECK(man.Find(vVin[1])->activeState == CMasternode::MASTERNODE_VIN_SPENT);
+
+    // Taken away with the block it confirmed in, the rest stay enabled and stay so when checked
+    pcoinsTip->ModifyCoins(tx.GetHash())->Spend(2);
+    GetMainSignals().SyncTransaction(tx, NULL);
+    BOOST_CHECK(man.Find(vVin[2])->activeState == CMasternode::MASTERNODE_VIN_SPENT);
+    for (int i = 3; i < 5; i++) {
+        CMasternode* pmn = man.Find(vVin[i]);
+        pmn->Check(true);
+        BOOST_CHECK(pmn->IsEnabled());
+    }
+    man.Find(vVin[0])->Check(true);
+    BOOST_CHECK(man.Find(vVin[0])->activeState == CMasternode::MASTERNODE_VIN_SPENT);
+
+    // Spent masternodes are dropped from the list
+    man.CheckAndRemove();
+    BOOST_CHECK_EQUAL(man.size(), 2);
+
+    UnregisterValidationInterface(&man);
+    mempool.clear();
+    pcoinsTip->ModifyCoins(tx.GetHash())->Clear();
+}
+
+BOOST_AUTO_TEST_CASE(list_state_diff)
+{
+    CMasternodeMan man;
+    CKey key;
+    key.MakeNewKey(true);
+    std::vector<CTxIn> vVin;
+    for (int i = 0; i < 20; i++) {
+        CMasternode mn(MakeBroadcast(key, key, strprintf("5.0.0.%d:51472", i)));
+        mn.sigTime -= i;
+        man.Add(mn);
+        vVin.push_back(mn.vin);
+    }
+
+    // Equal lists have equal states, nothing changed since our own
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << man;
+    CMasternodeMan man2;
+    ss >> man2;
+    uint256 hashState = man.GetListState();
+    BOOST_CHECK(hashState != 0);
+    BOOST_CHECK(man2.GetListState() == hashState);
+    std::vector<CMasternode*> vpmn;
+    BOOST_CHECK(!man.GetListChanges(hashState, vpmn));
+    BOOST_CHECK(vpmn.empty());
+
+    // Entries added, updated and removed since
+    CMasternode mnNew(MakeBroadcast(key, key, "5.0.1.0:51472"));
+    man.Add(mnNew);
+    CMasternodeBroadcast mnbNew = MakeBroadcast(key, key, "5.0.1.1:51472");
+    mnbNew.vin = vVin[3];
+    mnbNew.sigTime += 1;
+    mnbNew.lastPing = CMasternodePing();
+    BOOST_CHECK(man.UpdateFromNewBroadcast(*man.Find(vVin[3]), mnbNew));
+    man.Remove(vVin[7]);
+    BOOST_CHECK(!man.GetListChanges(hashState, vpmn));
+    BOOST_REQUIRE_EQUAL(vpmn.size(), 2);
+    std::set<COutPoint> setChanged;
+    BOOST_FOREACH (CMasternode* pmn, vpmn)
+        setChanged.insert(pmn->vin.prevout);
+    BOOST_CHECK(setChanged.count(mnNew.vin.prevout));
+    BOOST_CHECK(setChanged.count(vVin[3].prevout));
+
+    // Changes undone bring the state back
+    uint256 hashChanged = man.GetListState();
+    CMasternode mnGone(*man2.Find(vVin[7]));
+    man.Add(mnGone);
+    man.Remove(vVin[7]);
+    BOOST_CHECK(man.GetListState() == hashChanged);
+
+    // A state we never had gets the whole list
+    BOOST_CHECK(man.GetListChanges(man2.GetListState() ^ 1, vpmn));
+    BOOST_CHECK_EQUAL(vpmn.size(), man.size());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
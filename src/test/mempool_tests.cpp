@@ -2,7 +2,12 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "key.h"
+#include "keystore.h"
 #include "main.h"
+#include "random.h"
+#include "script/sign.h"
+#include "script/standard.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -99,4 +104,181 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolPruneSpentTest)
+{
+    // Parent (not in the pool) with three outputs, two of them spent in the pool
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(3);
+    for (int i = 0; i < 3; i++) {
+        txParent.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParent.vout[i].nValue = 33000LL;
+    }
+    CMutableTransaction txChild[2];
+    for (int i = 0; i < 2; i++) {
+        txChild[i].vin.resize(1);
+        txChild[i].vin[0].scriptSig = CScript() << OP_11;
+        txChild[i].vin[0].prevout = COutPoint(txParent.GetHash(), i * 2);
+        txChild[i].vout.resize(1);
+        txChild[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txChild[i].vout[0].nValue = 11000LL;
+    }
+
+    CTxMemPool testPool(CFeeRate(0));
+    std::list<CTransaction> removed;
+    for (int i = 0; i < 2; i++)
+        testPool.addUnchecked(txChild[i].GetHash(), CTxMemPoolEntry(txChild[i], 0, 0, 0.0, 1));
+
+    CCoins coins(txParent, 1);
+    testPool.pruneSpent(txParent.GetHash(), coins);
+    BOOST_CHECK(!coins.IsAvailable(0));
+    BOOST_CHECK(coins.IsAvailable(1));
+    BOOST_CHECK(!coins.IsAvailable(2));
+
+    // Once the spender is gone the output is available again
+    testPool.remove(txChild[0], removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    coins = CCoins(txParent, 1);
+    testPool.pruneSpent(txParent.GetHash(), coins);
+    BOOST_CHECK(coins.IsAvailable(0));
+    BOOST_CHECK(coins.IsAvailable(1));
+    BOOST_CHECK(!coins.IsAvailable(2));
+
+    // Unrelated txids are left alone
+    coins = CCoins(txChild[1], 1);
+    testPool.pruneSpent(txChild[1].GetHash(), coins);
+    BOOST_CHECK(coins.IsAvailable(0));
+
+    testPool.remove(txChild[1], removed, true);
+    coins = CCoins(txParent, 1);
+    testPool.pruneSpent(txParent.GetHash(), coins);
+    BOOST_CHECK(coins.IsAvailable(0) && coins.IsAvailable(2));
+}
+
+BOOST_AUTO_TEST_CASE(MempoolStatsTest)
+{
+    CTxMemPool testPool(CFeeRate(0));
+    const CMemPoolStats& stats = testPool.stats;
+
+    // Parent paying no fee and a child paying a high fee rate
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 11000LL;
+
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 0, 0, 0.0, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 1000000, 0, 0.0, 1));
+    unsigned int nLast = CMemPoolStats::FEE_BUCKETS - 1;
+    BOOST_CHECK_EQUAL(stats.GetFeeBucketCount(0), 1);
+    BOOST_CHECK_EQUAL(stats.GetFeeBucketBytes(0), ::GetSerializeSize(txParent, SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK_EQUAL(stats.GetFeeBucketCount(nLast), 1);
+
+    // Removing the parent takes the child with it, both counted under the given reason
+    std::list<CTransaction> removed;
+    testPool.remove(txParent, removed, true, MemPoolRemovalReason::CONFLICT);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(stats.GetRemoved(MemPoolRemovalReason::CONFLICT), 2);
+    BOOST_CHECK_EQUAL(stats.GetRemoved(MemPoolRemovalReason::BLOCK), 0);
+    for (unsigned int i = 0; i < CMemPoolStats::FEE_BUCKETS; i++) {
+        BOOST_CHECK_EQUAL(stats.GetFeeBucketCount(i), 0);
+        BOOST_CHECK_EQUAL(stats.GetFeeBucketBytes(i), 0);
+    }
+
+    // Admission outcomes
+    BOOST_CHECK_EQUAL(stats.GetLatencyPercentile(0.5), 0);
+    for (int i = 0; i < 98; i++)
+        testPool.stats.RecordAccept(100);
+    testPool.stats.RecordReject("insufficient fee", 3000);
+    testPool.stats.RecordReject("insufficient fee", 3000);
+    BOOST_CHECK_EQUAL(stats.GetAccepted(), 98);
+    BOOST_CHECK_EQUAL(stats.GetRejected(), 2);
+    BOOST_CHECK_EQUAL(stats.GetRejects()["insufficient fee"], 2);
+    BOOST_CHECK_EQUAL(stats.GetLatencyPercentile(0.5), 128);
+    BOOST_CHECK_EQUAL(stats.GetLatencyPercentile(0.99), 4096);
+}
+
+static CMutableTransaction SpendOutput(const CKeyStore& keystore, const CScript& scriptFrom, const uint256& hashPrev, uint32_t n, const CScript& scriptPubKey, const CAmount& nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, n);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    tx.vout[0].nValue = nValue;
+    SignSignature(keystore, scriptFrom, tx, 0);
+    return tx;
+}
+
+static void CheckBatch(int nThreads)
+{
+    CBasicKeyStore keystore;
+    CKey key, keyOther;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    keystore.AddKey(key);
+    keystore.AddKey(keyOther);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptOther = GetScriptForDestination(keyOther.GetPubKey().GetID());
+
+    // Fund two outputs directly in the coins view
+    uint256 hashFunding = GetRandHash();
+    CMutableTransaction txFunding;
+    txFunding.vout.resize(2);
+    txFunding.vout[0].scriptPubKey = scriptPubKey;
+    txFunding.vout[0].nValue = 100 * COIN;
+    txFunding.vout[1].scriptPubKey = scriptPubKey;
+    txFunding.vout[1].nValue = 100 * COIN;
+
+    LOCK(cs_main);
+    pcoinsTip->ModifyCoins(hashFunding)->FromTx(txFunding, 0);
+
+    std::vector<CTransaction> vtx;
+    // 0: valid, 1: spends 0 within the batch, 2: double spends 0
+    CMutableTransaction txA = SpendOutput(keystore, scriptPubKey, hashFunding, 0, scriptPubKey, 99 * COIN);
+    vtx.push_back(txA);
+    vtx.push_back(SpendOutput(keystore, scriptPubKey, txA.GetHash(), 0, scriptPubKey, 98 * COIN));
+    vtx.push_back(SpendOutput(keystore, scriptPubKey, hashFunding, 0, scriptOther, 97 * COIN));
+    // 3: signed with the wrong key, 4: spends 3
+    CMutableTransaction txBad = SpendOutput(keystore, scriptOther, hashFunding, 1, scriptPubKey, 99 * COIN);
+    vtx.push_back(txBad);
+    vtx.push_back(SpendOutput(keystore, scriptPubKey, txBad.GetHash(), 0, scriptPubKey, 98 * COIN));
+
+    int nScriptCheckThreadsOld = nScriptCheckThreads;
+    nScriptCheckThreads = nThreads;
+    std::vector<CValidationState> vState;
+    std::vector<bool> vAccepted, vMissingInputs;
+    unsigned int nAccepted = AcceptToMemoryPoolBatch(mempool, vtx, vState, vAccepted, vMissingInputs, false);
+    nScriptCheckThreads = nScriptCheckThreadsOld;
+
+    BOOST_CHECK_EQUAL(nAccepted, 2U);
+    BOOST_CHECK(vAccepted[0] && vAccepted[1]);
+    BOOST_CHECK(!vAccepted[2] && !vMissingInputs[2]);
+    int nDoS = 0;
+    BOOST_CHECK(!vAccepted[3] && vState[3].IsInvalid(nDoS) && nDoS == 100);
+    BOOST_CHECK(!vAccepted[4] && vMissingInputs[4]);
+    BOOST_CHECK(mempool.exists(vtx[0].GetHash()) && mempool.exists(vtx[1].GetHash()));
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+
+    mempool.clear();
+    pcoinsTip->ModifyCoins(hashFunding)->Clear();
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAcceptBatchTest)
+{
+    // Scripts verified on the script check threads
+    CheckBatch(nScriptCheckThreads);
+    // Scripts verified in place
+    CheckBatch(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
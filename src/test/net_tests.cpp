@@ -0,0 +1,247 @@
+// Copyright (c) 2018-2019 The BaaS developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "net.h"
+
+#include "chainparams.h"
+#include "hash.h"
+#include "primitives/transaction.h"
+#include "protocol.h"
+#include "random.h"
+#include "streams.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <string.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(netmessage_framing)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 1;
+
+    // The header and payload the old CDataStream based EndMessage produced
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload << CTransaction(tx);
+    CDataStream ssExpected(SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr("tx", ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    ssExpected << hdr;
+    ssExpected += ssPayload;
+
+    CNetSendBufferRef msg = MakeNetMessage("tx", CTransaction(tx));
+    BOOST_CHECK_EQUAL(msg->vch.size(), ssExpected.size());
+    BOOST_CHECK(std::equal(msg->vch.begin(), msg->vch.end(), ssExpected.begin()));
+
+    // Serializing a stream copies its bytes, as RelayTransaction does
+    CNetSendBufferRef msg2 = MakeNetMessage("tx", ssPayload);
+    BOOST_CHECK(msg2->vch == msg->vch);
+    BOOST_CHECK(msg2.get() != msg.get());
+}
+
+BOOST_AUTO_TEST_CASE(netmessage_buffer_pool)
+{
+    // A released buffer is handed out again, emptied but with its capacity
+    CNetSendBuffer* pbuf;
+    {
+        CNetSendBufferRef msg = MakeNetMessage("ping", (uint64_t)1);
+        CNetSendBufferRef shared = msg;
+        pbuf = msg.get();
+    }
+    CNetSendBufferRef buf = AllocateSendBuffer();
+    BOOST_CHECK(buf.get() == pbuf);
+    BOOST_CHECK(buf->vch.empty());
+    BOOST_CHECK(buf->vch.capacity() >= CMessageHeader::HEADER_SIZE + sizeof(uint64_t));
+}
+
+BOOST_AUTO_TEST_CASE(tx_announce_queue)
+{
+    SetMockTime(1536000000);
+    CTxAnnounceQueue queue;
+    uint256 hash1 = GetRandHash(), hash2 = GetRandHash(), hash3 = GetRandHash();
+
+    // A peer that connects now only sees what is queued after it
+    queue.Push(hash1);
+    uint64_t nNext = queue.End();
+    queue.Push(hash2);
+    queue.Push(hash1);
+    queue.Push(hash3);
+    BOOST_CHECK_EQUAL(queue.size(), 3U);
+
+    // Batches pick up where the last one ended
+    std::vector<uint256> vHash;
+    queue.Read(nNext, vHash, 1);
+    BOOST_CHECK_EQUAL(vHash.size(), 1U);
+    BOOST_CHECK(vHash[0] == hash2);
+    queue.Read(nNext, vHash, 10);
+    BOOST_CHECK_EQUAL(vHash.size(), 2U);
+    BOOST_CHECK(vHash[1] == hash3);
+    BOOST_CHECK_EQUAL(nNext, queue.End());
+    queue.Read(nNext, vHash, 10);
+    BOOST_CHECK_EQUAL(vHash.size(), 2U);
+
+    // Expired entries are skipped by a peer that fell behind
+    uint64_t nBehind = 0;
+    SetMockTime(1536000000 + TX_ANNOUNCE_EXPIRY + 1);
+    uint256 hash4 = GetRandHash();
+    queue.Push(hash4);
+    queue.Push(hash1);
+    BOOST_CHECK_EQUAL(queue.size(), 2U);
+    vHash.clear();
+    queue.Read(nBehind, vHash, 10);
+    BOOST_CHECK_EQUAL(vHash.size(), 2U);
+    BOOST_CHECK(vHash[0] == hash4);
+    BOOST_CHECK(vHash[1] == hash1);
+    BOOST_CHECK_EQUAL(nBehind, queue.End());
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(poisson_next_send)
+{
+    // The mean of many draws is close to the requested interval
+    int64_t nNow = 1536000000LL * 1000000;
+    int64_t nTotal = 0;
+    for (int i = 0; i < 10000; i++) {
+        int64_t nNext = PoissonNextSend(nNow, 5);
+        BOOST_CHECK(nNext >= nNow);
+        nTotal += nNext - nNow;
+    }
+    BOOST_CHECK(nTotal / 10000 > 4500000);
+    BOOST_CHECK(nTotal / 10000 < 5500000);
+}
+
+BOOST_AUTO_TEST_CASE(netmsg_type_stats)
+{
+    const std::vector<std::string>& vTypes = GetAllNetMessageTypes();
+    BOOST_CHECK_EQUAL(vTypes.size(), NET_MESSAGE_TYPE_COUNT);
+    for (unsigned int i = 0; i < vTypes.size(); i++)
+        BOOST_CHECK_EQUAL(GetNetMessageTypeIndex(vTypes[i]), i);
+
+    // Anything not in the table is counted as "other"
+    BOOST_CHECK_EQUAL(vTypes[GetNetMessageTypeIndex("nosuchcmd")], "other");
+    BOOST_CHECK_EQUAL(vTypes[GetNetMessageTypeIndex("")], "other");
+    BOOST_CHECK_EQUAL(vTypes[GetNetMessageTypeIndex("inv")], "inv");
+
+    CNetMsgTypeCounters counters;
+    BOOST_CHECK(counters.Get().IsNull());
+    counters.AddRecv(100);
+    counters.AddRecv(50);
+    counters.AddSent(10);
+    counters.AddProcessTime(1234);
+    CNetMsgTypeStats stats = counters.Get();
+    BOOST_CHECK(!stats.IsNull());
+    BOOST_CHECK_EQUAL(stats.nRecvMsgs, 2U);
+    BOOST_CHECK_EQUAL(stats.nRecvBytes, 150U);
+    BOOST_CHECK_EQUAL(stats.nSentMsgs, 1U);
+    BOOST_CHECK_EQUAL(stats.nSentBytes, 10U);
+    BOOST_CHECK_EQUAL(stats.nProcessUsec, 1234U);
+
+    stats += stats;
+    BOOST_CHECK_EQUAL(stats.nRecvBytes, 300U);
+    BOOST_CHECK_EQUAL(stats.nProcessUsec, 2468U);
+}
+
+BOOST_AUTO_TEST_CASE(token_bucket)
+{
+    // A burst of 3, then one every second
+    CTokenBucket bucket(3, 1000000);
+    int64_t nNow = 1536000000LL * 1000000;
+    BOOST_CHECK(bucket.IsFull(nNow));
+    BOOST_CHECK(bucket.Consume(nNow));
+    BOOST_CHECK(bucket.Consume(nNow));
+    BOOST_CHECK(bucket.Consume(nNow));
+    BOOST_CHECK(!bucket.Consume(nNow));
+    BOOST_CHECK(!bucket.Consume(nNow + 500000));
+    BOOST_CHECK(bucket.Consume(nNow + 1000000));
+    BOOST_CHECK(!bucket.Consume(nNow + 1000000));
+    BOOST_CHECK(!bucket.IsFull(nNow + 3000000));
+    // Never more than the burst, however long it waits
+    BOOST_CHECK(bucket.IsFull(nNow + 100000000));
+    BOOST_CHECK(bucket.Consume(nNow + 100000000));
+    BOOST_CHECK(bucket.Consume(nNow + 100000000));
+    BOOST_CHECK(bucket.Consume(nNow + 100000000));
+    BOOST_CHECK(!bucket.Consume(nNow + 100000000));
+}
+
+static std::vector<NodeEvictionCandidate> EvictionCandidates(int nCount)
+{
+    std::vector<NodeEvictionCandidate> vCandidates;
+    for (int i = 0; i < nCount; i++) {
+        // Older connections have lower ids and pings; every peer in its own netgroup
+        NodeEvictionCandidate candidate = {i, 1536000000 + i, 100000 + i, 0, (uint64_t)(1000 + i), false};
+        vCandidates.push_back(candidate);
+    }
+    return vCandidates;
+}
+
+BOOST_AUTO_TEST_CASE(node_eviction)
+{
+    // Too few peers to evict anyone once the protected ones are set aside
+    BOOST_CHECK_EQUAL(SelectNodeToEvict(EvictionCandidates(EVICTION_PROTECT_NETGROUP + EVICTION_PROTECT_PING + EVICTION_PROTECT_BLOCKS)), -1);
+
+    // A flood of connections from one netgroup loses its youngest member
+    std::vector<NodeEvictionCandidate> vCandidates = EvictionCandidates(40);
+    for (int i = 20; i < 40; i++)
+        vCandidates[i].nKeyedNetGroup = 0;
+    BOOST_CHECK_EQUAL(SelectNodeToEvict(vCandidates), 39);
+
+    // The fastest peers, masternodes and the peers relaying blocks stay
+    vCandidates[39].nMinPingUsecTime = 10;
+    vCandidates[38].fMasternode = true;
+    vCandidates[37].nLastBlockTime = 1536001000;
+    NodeId nodeEvicted = SelectNodeToEvict(vCandidates);
+    BOOST_CHECK_EQUAL(nodeEvicted, 36);
+
+    // With every peer a masternode, nobody is evicted
+    for (size_t i = 0; i < vCandidates.size(); i++)
+        vCandidates[i].fMasternode = true;
+    BOOST_CHECK_EQUAL(SelectNodeToEvict(vCandidates), -1);
+}
+
+BOOST_AUTO_TEST_CASE(upload_target)
+{
+    SetMockTime(1536000000);
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+
+    // Enough for the new blocks of a day, and 10 MB more
+    uint64_t nBuffer = MAX_UPLOAD_TIMEFRAME / Params().TargetSpacing() * UPLOAD_TARGET_BLOCK_BUFFER;
+    CNode::SetMaxOutboundTarget(nBuffer + 10000000);
+    CNode::RecordBytesSent(1000000);
+    BOOST_CHECK_EQUAL(CNode::GetMaxOutboundTimeLeftInCycle(), MAX_UPLOAD_TIMEFRAME);
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), nBuffer + 9000000);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+
+    // Old blocks stop before the target is reached, to keep the buffer for new ones
+    CNode::RecordBytesSent(9000000);
+    BOOST_CHECK(CNode::OutboundTargetReached(true));
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+
+    // The buffer shrinks as the cycle goes on
+    SetMockTime(1536000000 + MAX_UPLOAD_TIMEFRAME / 2);
+    BOOST_CHECK_EQUAL(CNode::GetMaxOutboundTimeLeftInCycle(), MAX_UPLOAD_TIMEFRAME / 2);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+
+    CNode::RecordBytesSent(nBuffer);
+    BOOST_CHECK(CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+
+    // A new cycle starts with the first bytes sent after the last one ended
+    SetMockTime(1536000000 + MAX_UPLOAD_TIMEFRAME + 1);
+    CNode::RecordBytesSent(1);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), nBuffer + 10000000 - 1);
+
+    CNode::SetMaxOutboundTarget(0);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
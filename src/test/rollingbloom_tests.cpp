@@ -0,0 +1,127 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Copyright (c) 2018-2019 The BaaS developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bloom.h"
+
+#include "net.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(rollingbloom_tests)
+
+static std::vector<unsigned char> RandomData()
+{
+    uint256 r = GetRandHash();
+    return std::vector<unsigned char>(r.begin(), r.end());
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // last-100-entry, 1% false positive:
+    CRollingBloomFilter rb1(100, 0.01);
+
+    // Overfill:
+    static const int DATASIZE = 399;
+    std::vector<unsigned char> data[DATASIZE];
+    for (int i = 0; i < DATASIZE; i++) {
+        data[i] = RandomData();
+        rb1.insert(data[i]);
+    }
+    // Last 100 guaranteed to be remembered:
+    for (int i = 299; i < DATASIZE; i++) {
+        BOOST_CHECK(rb1.contains(data[i]));
+    }
+
+    // false positive rate is 1%, so we should get about 100 hits if
+    // testing 10,000 random keys. We get worst-case false positive
+    // behavior when the filter is as full as possible, which is
+    // when we've inserted one minus an integer multiple of nElement*2.
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (rb1.contains(RandomData()))
+            ++nHits;
+    }
+    // Run test_baas with --log_level=message to see BOOST_TEST_MESSAGEs:
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~100 expected)");
+
+    // Insanely unlikely to get a fp count outside this range:
+    BOOST_CHECK(nHits > 25);
+    BOOST_CHECK(nHits < 175);
+
+    BOOST_CHECK(rb1.contains(data[DATASIZE - 1]));
+    rb1.reset();
+    BOOST_CHECK(!rb1.contains(data[DATASIZE - 1]));
+
+    // Now roll through data, make sure last 100 entries
+    // are always remembered:
+    for (int i = 0; i < DATASIZE; i++) {
+        if (i >= 100)
+            BOOST_CHECK(rb1.contains(data[i - 100]));
+        rb1.insert(data[i]);
+        BOOST_CHECK(rb1.contains(data[i]));
+    }
+
+    // Insert 999 more random entries:
+    for (int i = 0; i < 999; i++) {
+        rb1.insert(RandomData());
+    }
+    // Sanity check to make sure the filter isn't just filling up:
+    nHits = 0;
+    for (int i = 0; i < DATASIZE; i++) {
+        if (rb1.contains(data[i]))
+            ++nHits;
+    }
+    // Expect about 5 false positives, more than 100 means
+    // something is definitely broken.
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~5 expected)");
+    BOOST_CHECK(nHits < 100);
+
+    // last-1000-entry, 0.1% false positive:
+    CRollingBloomFilter rb2(1000, 0.001);
+    for (int i = 0; i < DATASIZE; i++) {
+        rb2.insert(data[i]);
+    }
+    // ... room for all of them:
+    for (int i = 0; i < DATASIZE; i++) {
+        BOOST_CHECK(rb2.contains(data[i]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom_hash)
+{
+    // Inventory is keyed by hash, without a copy into a vector
+    CRollingBloomFilter rb(INVENTORY_KNOWN_SIZE, 0.000001);
+    std::vector<uint256> vHash;
+    for (unsigned int i = 0; i < INVENTORY_KNOWN_SIZE; i++) {
+        vHash.push_back(GetRandHash());
+        rb.insert(vHash.back());
+    }
+    BOOST_FOREACH (const uint256& hash, vHash)
+        BOOST_CHECK(rb.contains(hash));
+    unsigned int nHits = 0;
+    for (int i = 0; i < 100000; i++) {
+        if (rb.contains(GetRandHash()))
+            ++nHits;
+    }
+    BOOST_CHECK(nHits < 5);
+
+    // Two filters salt differently, a false positive in one says nothing about the other
+    CRollingBloomFilter rb2(INVENTORY_KNOWN_SIZE, 0.000001);
+    BOOST_CHECK(!rb2.contains(vHash[0]));
+
+    // The memory used does not grow with the number of insertions
+    size_t nUsage = rb.GetMemoryUsage();
+    for (int i = 0; i < 20000; i++)
+        rb.insert(GetRandHash());
+    BOOST_CHECK_EQUAL(rb.GetMemoryUsage(), nUsage);
+    BOOST_CHECK(!rb.contains(vHash[0]));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
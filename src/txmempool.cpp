@@ -9,11 +9,14 @@
 
 #include "clientversion.h"
 #include "main.h"
+#include "random.h"
 #include "streams.h"
 #include "util.h"
 #include "utilmoneystr.h"
 #include "version.h"
 
+#include <algorithm>
+
 #include <boost/circular_buffer.hpp>
 
 using namespace std;
@@ -356,6 +359,122 @@ public:
 };
 
 
+std::string RemovalReasonToString(MemPoolRemovalReason reason)
+{
+    switch (reason) {
+    case MemPoolRemovalReason::BLOCK:
+        return "block";
+    case MemPoolRemovalReason::CONFLICT:
+        return "conflict";
+    case MemPoolRemovalReason::REORG:
+        return "reorg";
+    default:
+        return "unknown";
+    }
+}
+
+//! Lowest fee rate of each getmempoolstats bucket, in satoshis per kB
+static const CAmount feeBucketStarts[CMemPoolStats::FEE_BUCKETS] = {
+    0, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 10000000};
+
+CMemPoolStats::CMemPoolStats() : nAccepted(0), nRejected(0)
+{
+    for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+        vLatency[i] = 0;
+    for (unsigned int i = 0; i < MEMPOOL_REMOVAL_REASONS; i++)
+        vRemoved[i] = 0;
+    ClearFeeBuckets();
+}
+
+void CMemPoolStats::RecordLatency(int64_t nMicros)
+{
+    unsigned int nBucket = 0;
+    while (nMicros > 1 && nBucket < LATENCY_BUCKETS - 1) {
+        nMicros >>= 1;
+        nBucket++;
+    }
+    vLatency[nBucket]++;
+}
+
+void CMemPoolStats::RecordAccept(int64_t nMicros)
+{
+    nAccepted++;
+    RecordLatency(nMicros);
+}
+
+void CMemPoolStats::RecordReject(const std::string& strReason, int64_t nMicros)
+{
+    nRejected++;
+    RecordLatency(nMicros);
+    LOCK(cs_rejects);
+    mapRejects[strReason]++;
+}
+
+unsigned int CMemPoolStats::GetFeeBucket(const CTxMemPoolEntry& entry)
+{
+    CAmount nFeePerK = CFeeRate(entry.GetFee(), entry.GetTxSize()).GetFeePerK();
+    unsigned int nBucket = FEE_BUCKETS - 1;
+    while (nBucket > 0 && nFeePerK < feeBucketStarts[nBucket])
+        nBucket--;
+    return nBucket;
+}
+
+void CMemPoolStats::RecordAdded(const CTxMemPoolEntry& entry)
+{
+    unsigned int nBucket = GetFeeBucket(entry);
+    vFeeCount[nBucket]++;
+    vFeeBytes[nBucket] += entry.GetTxSize();
+}
+
+void CMemPoolStats::RecordRemoved(const CTxMemPoolEntry& entry, MemPoolRemovalReason reason)
+{
+    unsigned int nBucket = GetFeeBucket(entry);
+    vFeeCount[nBucket]--;
+    vFeeBytes[nBucket] -= entry.GetTxSize();
+    vRemoved[(unsigned int)reason]++;
+}
+
+void CMemPoolStats::ClearFeeBuckets()
+{
+    for (unsigned int i = 0; i < FEE_BUCKETS; i++) {
+        vFeeCount[i] = 0;
+        vFeeBytes[i] = 0;
+    }
+}
+
+std::map<std::string, uint64_t> CMemPoolStats::GetRejects() const
+{
+    LOCK(cs_rejects);
+    return mapRejects;
+}
+
+int64_t CMemPoolStats::GetLatencyPercentile(double dFraction) const
+{
+    uint64_t vCount[LATENCY_BUCKETS];
+    uint64_t nTotal = 0;
+    for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+        vCount[i] = vLatency[i];
+        nTotal += vCount[i];
+    }
+    if (nTotal == 0)
+        return 0;
+
+    uint64_t nSeen = 0;
+    for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+        nSeen += vCount[i];
+        if (nSeen >= dFraction * nTotal)
+            return (int64_t)2 << i;
+    }
+    return (int64_t)2 << (LATENCY_BUCKETS - 1);
+}
+
+CAmount CMemPoolStats::GetFeeBucketStart(unsigned int nBucket)
+{
+    return feeBucketStarts[nBucket];
+}
+
+COutPointHasher::COutPointHasher() : salt(GetRandHash()) {}
+
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) : nTransactionsUpdated(0),
                                                        minRelayFee(_minRelayFee)
 {
@@ -381,13 +500,13 @@ void CTxMemPool::pruneSpent(const uint256& hashTx, CCoins& coins)
 {
     LOCK(cs);
 
-    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.lower_bound(COutPoint(hashTx, 0));
+    SpentOutputsMap::const_iterator it = mapSpentOutputs.find(hashTx);
+    if (it == mapSpentOutputs.end())
+        return;
 
-    // iterate over all COutPoints in mapNextTx whose hash equals the provided hashTx
-    while (it != mapNextTx.end() && it->first.hash == hashTx) {
-        coins.Spend(it->first.n); // and remove those outputs from coins
-        it++;
-    }
+    // remove all outputs of hashTx spent in the pool from coins
+    BOOST_FOREACH (uint32_t n, it->second)
+        coins.Spend(n);
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -410,18 +529,20 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
-        for (unsigned int i = 0; i < tx.vin.size(); i++)
+        const CTransaction& tx = (mapTx[hash] = entry).GetTx();
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
             mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+            mapSpentOutputs[tx.vin[i].prevout.hash].push_back(tx.vin[i].prevout.n);
+        }
         nTransactionsUpdated++;
         totalTxSize += entry.GetTxSize();
+        stats.RecordAdded(entry);
     }
     return true;
 }
 
 
-void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& removed, bool fRecursive)
+void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& removed, bool fRecursive, MemPoolRemovalReason reason)
 {
     // Remove transaction from memory pool
     {
@@ -434,7 +555,7 @@ void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& rem
             // happen during chain re-orgs if origTx isn't re-accepted into
             // the mempool for any reason.
             for (unsigned int i = 0; i < origTx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
+                NextTxMap::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
                 txToRemove.push_back(it->second.ptx->GetHash());
@@ -443,37 +564,47 @@ void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& rem
         while (!txToRemove.empty()) {
             uint256 hash = txToRemove.front();
             txToRemove.pop_front();
-            if (!mapTx.count(hash))
+            TxMap::iterator itTx = mapTx.find(hash);
+            if (itTx == mapTx.end())
                 continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
+            const CTransaction& tx = itTx->second.GetTx();
             if (fRecursive) {
                 for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
+                    NextTxMap::iterator it = mapNextTx.find(COutPoint(hash, i));
                     if (it == mapNextTx.end())
                         continue;
                     txToRemove.push_back(it->second.ptx->GetHash());
                 }
             }
-            BOOST_FOREACH (const CTxIn& txin, tx.vin)
+            BOOST_FOREACH (const CTxIn& txin, tx.vin) {
                 mapNextTx.erase(txin.prevout);
+                SpentOutputsMap::iterator itSpent = mapSpentOutputs.find(txin.prevout.hash);
+                if (itSpent != mapSpentOutputs.end()) {
+                    std::vector<uint32_t>& vSpent = itSpent->second;
+                    vSpent.erase(std::remove(vSpent.begin(), vSpent.end(), txin.prevout.n), vSpent.end());
+                    if (vSpent.empty())
+                        mapSpentOutputs.erase(itSpent);
+                }
+            }
 
             removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
+            totalTxSize -= itTx->second.GetTxSize();
+            stats.RecordRemoved(itTx->second, reason);
+            mapTx.erase(itTx);
             nTransactionsUpdated++;
         }
     }
 }
 
-void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight)
+void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight, std::list<CTransaction>& removed)
 {
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (TxMap::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         const CTransaction& tx = it->second.GetTx();
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            TxMap::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end())
                 continue;
             const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
@@ -484,10 +615,8 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned in
             }
         }
     }
-    BOOST_FOREACH (const CTransaction& tx, transactionsToRemove) {
-        list<CTransaction> removed;
-        remove(tx, removed, true);
-    }
+    BOOST_FOREACH (const CTransaction& tx, transactionsToRemove)
+        remove(tx, removed, true, MemPoolRemovalReason::REORG);
 }
 
 void CTxMemPool::removeConflicts(const CTransaction& tx, std::list<CTransaction>& removed)
@@ -496,11 +625,11 @@ void CTxMemPool::removeConflicts(const CTransaction& tx, std::list<CTransaction>
     list<CTransaction> result;
     LOCK(cs);
     BOOST_FOREACH (const CTxIn& txin, tx.vin) {
-        std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(txin.prevout);
+        NextTxMap::iterator it = mapNextTx.find(txin.prevout);
         if (it != mapNextTx.end()) {
             const CTransaction& txConflict = *it->second.ptx;
             if (txConflict != tx) {
-                remove(txConflict, removed, true);
+                remove(txConflict, removed, true, MemPoolRemovalReason::CONFLICT);
             }
         }
     }
@@ -509,19 +638,18 @@ void CTxMemPool::removeConflicts(const CTransaction& tx, std::list<CTransaction>
 /**
  * Called when a block is connected. Removes from mempool and updates the miner fee estimator.
  */
-void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts)
+void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts, std::list<CTransaction>& confirmed)
 {
     LOCK(cs);
     std::vector<CTxMemPoolEntry> entries;
     BOOST_FOREACH (const CTransaction& tx, vtx) {
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
-            entries.push_back(mapTx[hash]);
+        TxMap::const_iterator it = mapTx.find(tx.GetHash());
+        if (it != mapTx.end())
+            entries.push_back(it->second);
     }
     minerPolicyEstimator->seenBlock(entries, nBlockHeight, minRelayFee);
     BOOST_FOREACH (const CTransaction& tx, vtx) {
-        std::list<CTransaction> dummy;
-        remove(tx, dummy, false);
+        remove(tx, confirmed, false, MemPoolRemovalReason::BLOCK);
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
@@ -533,7 +661,9 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    mapSpentOutputs.clear();
     totalTxSize = 0;
+    stats.ClearFeeBuckets();
     ++nTransactionsUpdated;
 }
 
@@ -550,14 +680,14 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
 
     LOCK(cs);
     list<const CTxMemPoolEntry*> waitingOnDependants;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (TxMap::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
         checkTotal += it->second.GetTxSize();
         const CTransaction& tx = it->second.GetTx();
         bool fDependsWait = false;
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            TxMap::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
                 const CTransaction& tx2 = it2->second.GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
@@ -567,7 +697,7 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
                 assert(coins && coins->IsAvailable(txin.prevout.n));
             }
             // Check whether its inputs are marked in mapNextTx.
-            std::map<COutPoint, CInPoint>::const_iterator it3 = mapNextTx.find(txin.prevout);
+            NextTxMap::const_iterator it3 = mapNextTx.find(txin.prevout);
             assert(it3 != mapNextTx.end());
             assert(it3->second.ptx == &tx);
             assert(it3->second.n == i);
@@ -598,15 +728,23 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
             stepsSinceLastRemove = 0;
         }
     }
-    for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
+    for (NextTxMap::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
+        TxMap::const_iterator it2 = mapTx.find(hash);
         const CTransaction& tx = it2->second.GetTx();
         assert(it2 != mapTx.end());
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
+        // Check that the spend is also indexed by txid.
+        SpentOutputsMap::const_iterator it3 = mapSpentOutputs.find(it->first.hash);
+        assert(it3 != mapSpentOutputs.end());
+        assert(std::count(it3->second.begin(), it3->second.end(), it->first.n) == 1);
     }
+    size_t nSpentOutputs = 0;
+    for (SpentOutputsMap::const_iterator it = mapSpentOutputs.begin(); it != mapSpentOutputs.end(); it++)
+        nSpentOutputs += it->second.size();
+    assert(nSpentOutputs == mapNextTx.size());
 
     assert(totalTxSize == checkTotal);
 }
@@ -617,7 +755,7 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (TxMap::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
@@ -626,14 +764,14 @@ void CTxMemPool::getTransactions(std::set<uint256>& setTxid)
     setTxid.clear();
 
     LOCK(cs);
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (TxMap::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         setTxid.insert((*mi).first);
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    TxMap::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
     result = i->second.GetTx();
     return true;
@@ -717,10 +855,13 @@ bool CCoinsViewMemPool::GetCoins(const uint256& txid, CCoins& coins) const
     // If an entry in the mempool exists, always return that one, as it's guaranteed to never
     // conflict with the underlying cache, and it cannot have pruned entries (as it contains full)
     // transactions. First checking the underlying cache risks returning a pruned entry instead.
-    CTransaction tx;
-    if (mempool.lookup(txid, tx)) {
-        coins = CCoins(tx, MEMPOOL_HEIGHT);
-        return true;
+    {
+        LOCK(mempool.cs);
+        CTxMemPool::TxMap::const_iterator it = mempool.mapTx.find(txid);
+        if (it != mempool.mapTx.end()) {
+            coins = CCoins(it->second.GetTx(), MEMPOOL_HEIGHT);
+            return true;
+        }
     }
     return (base->GetCoins(txid, coins) && !coins.IsPruned());
 }
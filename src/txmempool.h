@@ -8,6 +8,7 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <atomic>
 #include <list>
 
 #include "amount.h"
@@ -15,6 +16,8 @@
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/unordered_map.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -83,6 +86,87 @@ public:
     bool IsNull() const { return (ptx == NULL && n == (uint32_t)-1); }
 };
 
+/**
+ * Salted hasher for outpoints, the outpoint equivalent of CCoinsKeyHasher.
+ * The salt keeps peers from crafting transactions whose inputs all land in
+ * the same bucket of mapNextTx.
+ */
+class COutPointHasher
+{
+private:
+    uint256 salt;
+
+public:
+    COutPointHasher();
+
+    size_t operator()(const COutPoint& key) const
+    {
+        return key.hash.GetHash(salt) ^ ((uint64_t)key.n * 0x9E3779B97F4A7C15ULL);
+    }
+};
+
+/** Reason a transaction left the mempool */
+enum class MemPoolRemovalReason {
+    UNKNOWN = 0, //! removed by a caller that gave no reason
+    BLOCK,       //! included in a connected block
+    CONFLICT,    //! double spent by a block or a locked transaction
+    REORG,       //! no longer valid after its block was disconnected
+};
+static const unsigned int MEMPOOL_REMOVAL_REASONS = 4;
+
+std::string RemovalReasonToString(MemPoolRemovalReason reason);
+
+/**
+ * Admission and removal telemetry reported by getmempoolstats. Everything
+ * except the reject reason map is an atomic counter, so recording adds no
+ * work under CTxMemPool::cs and reading never takes it.
+ */
+class CMemPoolStats
+{
+public:
+    //! Admission latencies are bucketed by powers of two microseconds
+    static const unsigned int LATENCY_BUCKETS = 32;
+    //! Number of fee rate buckets, see GetFeeBucketStart
+    static const unsigned int FEE_BUCKETS = 12;
+
+private:
+    std::atomic<uint64_t> nAccepted;
+    std::atomic<uint64_t> nRejected;
+    std::atomic<uint64_t> vLatency[LATENCY_BUCKETS];
+    std::atomic<uint64_t> vRemoved[MEMPOOL_REMOVAL_REASONS];
+    std::atomic<uint64_t> vFeeCount[FEE_BUCKETS];
+    std::atomic<uint64_t> vFeeBytes[FEE_BUCKETS];
+
+    mutable CCriticalSection cs_rejects;
+    std::map<std::string, uint64_t> mapRejects;
+
+    void RecordLatency(int64_t nMicros);
+    static unsigned int GetFeeBucket(const CTxMemPoolEntry& entry);
+
+public:
+    CMemPoolStats();
+
+    void RecordAccept(int64_t nMicros);
+    void RecordReject(const std::string& strReason, int64_t nMicros);
+    //! Called by CTxMemPool with cs held
+    void RecordAdded(const CTxMemPoolEntry& entry);
+    void RecordRemoved(const CTxMemPoolEntry& entry, MemPoolRemovalReason reason);
+    void ClearFeeBuckets();
+
+    uint64_t GetAccepted() const { return nAccepted; }
+    uint64_t GetRejected() const { return nRejected; }
+    std::map<std::string, uint64_t> GetRejects() const;
+    uint64_t GetRemoved(MemPoolRemovalReason reason) const { return vRemoved[(unsigned int)reason]; }
+
+    /** Upper bound in microseconds of the latency below which dFraction of all admission attempts completed */
+    int64_t GetLatencyPercentile(double dFraction) const;
+
+    /** Lowest fee rate, in satoshis per kB, counted in bucket nBucket */
+    static CAmount GetFeeBucketStart(unsigned int nBucket);
+    uint64_t GetFeeBucketCount(unsigned int nBucket) const { return vFeeCount[nBucket]; }
+    uint64_t GetFeeBucketBytes(unsigned int nBucket) const { return vFeeBytes[nBucket]; }
+};
+
 /**
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -103,11 +187,22 @@ private:
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
 
+    /**
+     * Output indexes of each txid that are spent by pool transactions. Gives
+     * pruneSpent the per-txid range lookup that mapNextTx, being hashed, lacks.
+     */
+    typedef boost::unordered_map<uint256, std::vector<uint32_t>, CCoinsKeyHasher> SpentOutputsMap;
+    SpentOutputsMap mapSpentOutputs;
+
 public:
+    typedef boost::unordered_map<uint256, CTxMemPoolEntry, CCoinsKeyHasher> TxMap;
+    typedef boost::unordered_map<COutPoint, CInPoint, COutPointHasher> NextTxMap;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
-    std::map<COutPoint, CInPoint> mapNextTx;
+    TxMap mapTx;
+    NextTxMap mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    CMemPoolStats stats;
 
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
@@ -122,10 +217,10 @@ public:
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
-    void remove(const CTransaction& tx, std::list<CTransaction>& removed, bool fRecursive = false);
-    void removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight);
+    void remove(const CTransaction& tx, std::list<CTransaction>& removed, bool fRecursive = false, MemPoolRemovalReason reason = MemPoolRemovalReason::UNKNOWN);
+    void removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight, std::list<CTransaction>& removed);
     void removeConflicts(const CTransaction& tx, std::list<CTransaction>& removed);
-    void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts);
+    void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts, std::list<CTransaction>& confirmed);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void getTransactions(std::set<uint256>& setTxid);
@@ -12,7 +12,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 81080;
+static const int PROTOCOL_VERSION = 81083;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -23,5 +23,14 @@ static const int MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT = 81079;
 //! BIP 0031, pong message, is enabled for all versions AFTER this one
 static const int BIP0031_VERSION = 81078;
 
+//! "getheaders" is answered with "headers" and blocks are fetched headers-first starting with this version
+static const int HEADERS_FIRST_VERSION = 81081;
+
+//! "sendcmpct", "cmpctblock", "getblocktxn" and "blocktxn" messages are understood starting with this version
+static const int COMPACT_BLOCKS_VERSION = 81082;
+
+//! "getmnlist" is answered with "mnlistdiff", the masternode list changes since a known list state, starting with this version
+static const int MNLIST_DIFF_VERSION = 81083;
+
 
 #endif // BITCOIN_VERSION_H
@@ -27,6 +27,7 @@ protected:
     void SyncTransaction(const CTransaction &tx, const CBlock *pblock);
     void UpdatedBlockTip(const CBlockIndex *pindex);
     void NotifyTransactionLock(const CTransaction &tx);
+    void TransactionRemovedFromMempool(const CTransaction &tx, MemPoolRemovalReason reason);
 
 private:
     CZMQNotificationInterface();
@@ -5,6 +5,7 @@
 #include "chainparams.h"
 #include "zmqpublishnotifier.h"
 #include "main.h"
+#include "txmempool.h"
 #include "util.h"
 #include "crypto/common.h"
 
@@ -16,6 +17,7 @@ static const char *MSG_HASHTXLOCK = "hashtxlock";
 static const char *MSG_RAWBLOCK   = "rawblock";
 static const char *MSG_RAWTX      = "rawtx";
 static const char *MSG_RAWTXLOCK = "rawtxlock";
+static const char *MSG_REMOVEDTX = "removedtx";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -212,3 +214,15 @@ bool CZMQPublishRawTransactionLockNotifier::NotifyTransactionLock(const CTransac
     ss << transaction;
     return SendMessage(MSG_RAWTXLOCK, &(*ss.begin()), ss.size());
 }
+
+bool CZMQPublishRemovedTransactionNotifier::NotifyTransactionRemoved(const CTransaction &transaction, MemPoolRemovalReason reason)
+{
+    uint256 hash = transaction.GetHash();
+    std::string strReason = RemovalReasonToString(reason);
+    LogPrint("zmq", "zmq: Publish removedtx %s (%s)\n", hash.GetHex(), strReason);
+    std::vector<char> data(32 + strReason.size());
+    for (unsigned int i = 0; i < 32; i++)
+        data[31 - i] = hash.begin()[i];
+    std::copy(strReason.begin(), strReason.end(), data.begin() + 32);
+    return SendMessage(MSG_REMOVEDTX, &data[0], data.size());
+}
@@ -64,4 +64,10 @@ public:
     bool NotifyTransactionLock(const CTransaction &transaction);
 };
 
+class CZMQPublishRemovedTransactionNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyTransactionRemoved(const CTransaction &transaction, MemPoolRemovalReason reason);
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H